@@ -0,0 +1,93 @@
+/**
+ * @file arena.c
+ * @brief   Per request scratch memory: every simulated request allocates a few
+ *          hundred small objects and drops them all at the end. Compares freeing
+ *          each object with buddy_free against one arena_reset per request.
+ *
+ *          usage: arena [requests] [pool_k]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "../src/lab.h"
+#include "../src/arena.h"
+#include "../src/clock.h"
+
+#define MAX_OBJECTS 512
+
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double per_object(struct buddy_pool *pool, size_t requests, size_t *objects)
+{
+    void *obj[MAX_OBJECTS];
+    rng_state = 0x9E3779B97F4A7C15ull;
+    *objects = 0;
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < requests; r++)
+    {
+        size_t n = 64 + (size_t)(rng() % (MAX_OBJECTS - 64));
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t size = 16 + (size_t)(rng() % 496);
+            obj[i] = buddy_malloc(pool, size);
+            memset(obj[i], 0, 16);
+        }
+        for (size_t i = 0; i < n; i++)
+            buddy_free(pool, obj[i]);
+        *objects += n;
+    }
+    return (double)(now_ns() - start) / 1e9;
+}
+
+static double with_arena(struct buddy_pool *pool, size_t requests, size_t *objects)
+{
+    struct buddy_arena arena;
+    arena_init(&arena, pool, 0);
+    rng_state = 0x9E3779B97F4A7C15ull;
+    *objects = 0;
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < requests; r++)
+    {
+        size_t n = 64 + (size_t)(rng() % (MAX_OBJECTS - 64));
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t size = 16 + (size_t)(rng() % 496);
+            void *p = arena_alloc(&arena, size);
+            memset(p, 0, 16);
+        }
+        arena_reset(&arena);
+        *objects += n;
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    arena_destroy(&arena);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    size_t requests = argc > 1 ? strtoull(argv[1], NULL, 10) : 20000;
+    size_t pool_k = argc > 2 ? strtoull(argv[2], NULL, 10) : 24;
+    struct buddy_pool pool;
+    buddy_init(&pool, UINT64_C(1) << pool_k);
+
+    printf("arena: %zu requests of 64-512 objects (16-512 bytes)\n", requests);
+    printf("%-12s %12s %14s\n", "mode", "ns/request", "Mobjects/sec");
+    size_t objects;
+    double t = per_object(&pool, requests, &objects);
+    printf("%-12s %12.0f %14.2f\n", "malloc/free", t * 1e9 / (double)requests, (double)objects / t / 1e6);
+    t = with_arena(&pool, requests, &objects);
+    printf("%-12s %12.0f %14.2f\n", "arena", t * 1e9 / (double)requests, (double)objects / t / 1e6);
+
+    buddy_destroy(&pool);
+    return 0;
+}
@@ -0,0 +1,177 @@
+/**
+ * @file frag.c
+ * @brief   Long running fragmentation benchmark comparing the placement policies
+ *          with and without tail trimming.
+ *          Every policy replays the same random allocation stream and we sample how
+ *          far up the pool live blocks reach, how large a block is still free and
+ *          how much of the free memory is too fragmented for a 128KiB block.
+ *          With a heatmap prefix each run also writes <prefix><policy>.csv with
+ *          the used bytes of every 64KiB of the pool at the end of the run.
+ *
+ *          usage: frag [ops] [pool_k] [heatmap_prefix]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "../src/lab.h"
+
+#define SLOTS 4096
+#define SAMPLE_EVERY 4096
+#define FRAG_ORDER 17
+#define HEATMAP_K 16
+
+struct frag_result
+{
+    size_t failures;
+    double avg_top;       /*Average fraction of the pool below the highest live block*/
+    double avg_largest;   /*Average largest free order*/
+    size_t min_largest;   /*Smallest largest free order seen*/
+    double avg_unusable;  /*Average fragmentation index for order FRAG_ORDER*/
+};
+
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/**
+ * Log uniform request sizes between 16 bytes and 8KiB with the occasional
+ * 64-256KiB buffer mixed in.
+ */
+static size_t next_size(void)
+{
+    if (rng() % 64 == 0)
+        return (size_t)(64 << 10) + (size_t)(rng() % (192 << 10));
+    size_t shift = 4 + (size_t)(rng() % 9);
+    return (UINT64_C(1) << shift) + (size_t)(rng() % (UINT64_C(1) << shift));
+}
+
+static void write_heatmap(struct buddy_pool *pool, const char *prefix, const char *name)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s.csv", prefix, name);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    buddy_heatmap(pool, f, HEATMAP_K, BUDDY_HEATMAP_CSV);
+    fclose(f);
+}
+
+static void run(unsigned int policy, size_t ops, size_t pool_k, const char *heatmap, const char *name,
+                struct frag_result *out)
+{
+    struct buddy_pool pool;
+    buddy_init_ex(&pool, UINT64_C(1) << pool_k, policy);
+    char **live = calloc(SLOTS, sizeof(char *));
+    rng_state = 0x9E3779B97F4A7C15ull;
+
+    size_t samples = 0;
+    double top_sum = 0, largest_sum = 0, unusable_sum = 0;
+    out->failures = 0;
+    out->min_largest = pool_k;
+    for (size_t i = 0; i < ops; i++)
+    {
+        //Let the live set breathe: the fill target moves between 25% and 100% of the slots
+        size_t phase = (i / (SLOTS * 8)) % 4;
+        size_t target = SLOTS / 4 * (phase + 1);
+        size_t slot = (size_t)(rng() % SLOTS);
+        bool want = slot < target;
+        if (live[slot] && (!want || rng() % 4 == 0))
+        {
+            buddy_free(&pool, live[slot]);
+            live[slot] = NULL;
+        }
+        else if (!live[slot] && want)
+        {
+            live[slot] = buddy_malloc(&pool, next_size());
+            if (!live[slot]) out->failures++;
+        }
+
+        if (i % SAMPLE_EVERY == 0)
+        {
+            size_t top = 0;
+            for (size_t s = 0; s < SLOTS; s++)
+            {
+                if (!live[s]) continue;
+                struct avail *hdr = (struct avail *)live[s] - 1;
+                size_t len = (policy & BUDDY_TRIM_TAIL) ? hdr->span : UINT64_C(1) << hdr->kval;
+                size_t end = (size_t)((char *)hdr - (char *)pool.base) + len;
+                if (end > top) top = end;
+            }
+            struct buddy_frag frag;
+            buddy_fragmentation(&pool, &frag);
+            size_t largest = frag.largest_free_order;
+            top_sum += (double)top / (double)pool.numbytes;
+            largest_sum += (double)largest;
+            unusable_sum += frag.frag_index[FRAG_ORDER];
+            if (largest < out->min_largest) out->min_largest = largest;
+            samples++;
+        }
+    }
+    out->avg_top = top_sum / (double)samples;
+    out->avg_largest = largest_sum / (double)samples;
+    out->avg_unusable = unusable_sum / (double)samples;
+    if (heatmap) write_heatmap(&pool, heatmap, name);
+
+    for (size_t s = 0; s < SLOTS; s++)
+        buddy_free(&pool, live[s]);
+    free(live);
+    buddy_destroy(&pool);
+}
+
+/**
+ * Fill an empty pool with variable sized large buffers (16KiB-1MiB, log
+ * uniform) until the first failure and return how many bytes were handed out.
+ */
+static size_t capacity(unsigned int flags, size_t pool_k)
+{
+    struct buddy_pool pool;
+    buddy_init_ex(&pool, UINT64_C(1) << pool_k, flags);
+    rng_state = 0x2545F4914F6CDD1Dull;
+    size_t bytes = 0;
+    for (;;)
+    {
+        size_t shift = 14 + (size_t)(rng() % 6);
+        size_t size = (UINT64_C(1) << shift) + (size_t)(rng() % (UINT64_C(1) << shift));
+        if (!buddy_malloc(&pool, size)) break;
+        bytes += size;
+    }
+    buddy_destroy(&pool);
+    return bytes;
+}
+
+int main(int argc, char **argv)
+{
+    size_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+    size_t pool_k = argc > 2 ? strtoull(argv[2], NULL, 10) : 24;
+    const char *heatmap = argc > 3 ? argv[3] : NULL;
+    const char *names[] = {"lifo", "address", "buddy-busy", "lifo+trim", "address+trim"};
+    unsigned int policies[] = {BUDDY_POLICY_LIFO, BUDDY_POLICY_ADDRESS, BUDDY_POLICY_BUDDY_BUSY,
+                               BUDDY_POLICY_LIFO | BUDDY_TRIM_TAIL, BUDDY_POLICY_ADDRESS | BUDDY_TRIM_TAIL};
+
+    printf("fragmentation: %zu ops on a 2^%zu byte pool\n", ops, pool_k);
+    printf("%-12s %10s %12s %14s %14s %14s\n", "policy", "failures", "avg top %", "avg largest k",
+           "min largest k", "unusable 128K");
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+    {
+        struct frag_result r;
+        run(policies[p], ops, pool_k, heatmap, names[p], &r);
+        printf("%-12s %10zu %12.1f %14.2f %14zu %13.1f%%\n", names[p], r.failures,
+               r.avg_top * 100.0, r.avg_largest, r.min_largest, r.avg_unusable * 100.0);
+    }
+
+    printf("\ncapacity: large buffers handed out before the first failure\n");
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+    {
+        size_t bytes = capacity(policies[p], pool_k);
+        printf("%-12s %10.1f%%\n", names[p], 100.0 * (double)bytes / (double)(UINT64_C(1) << pool_k));
+    }
+    return 0;
+}
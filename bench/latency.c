@@ -0,0 +1,215 @@
+/**
+ * @file latency.c
+ * @brief   Per operation latency of buddy_malloc and buddy_free for the buddy and
+ *          TLSF engines. We care about the tail: p99.99 and the worst case.
+ *
+ *          Two workloads. "mix" mixes small objects with the occasional large
+ *          buffer. "chain" is the buddy engine's worst case: on an empty pool
+ *          every smallest block is split off the whole pool and merged back
+ *          on free, pool_k - SMALLEST_K steps each way, where TLSF does the
+ *          same constant work as for any other size.
+ *
+ *          The pool pages are faulted in before anything is timed and each
+ *          workload runs several times, alternating engines, so a page fault
+ *          or a preemption in one run does not decide the max column. Every
+ *          column is the median over the runs, worst is the largest max seen.
+ *
+ *          usage: latency [ops] [pool_k] [runs]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../src/lab.h"
+#include "../src/clock.h"
+
+#define SLOTS 8192
+#define MAX_RUNS 32
+#define COLUMNS 5
+
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * p50, p99, p99.9, p99.99 and max of one run of one operation.
+ */
+struct tail
+{
+    uint32_t col[COLUMNS];
+};
+
+static struct tail percentiles(uint32_t *lat, size_t n)
+{
+    struct tail t = {{0}};
+    if (n == 0) return t;
+    qsort(lat, n, sizeof(*lat), cmp_u32);
+    t.col[0] = lat[n / 2];
+    t.col[1] = lat[n * 99 / 100];
+    t.col[2] = lat[n * 999 / 1000];
+    t.col[3] = lat[n * 9999 / 10000];
+    t.col[4] = lat[n - 1];
+    return t;
+}
+
+static void report(const char *engine, const char *workload, const char *op, size_t n,
+                   struct tail *runs, size_t nruns)
+{
+    uint32_t column[MAX_RUNS];
+    uint32_t median[COLUMNS];
+    uint32_t worst = 0;
+    for (int c = 0; c < COLUMNS; c++)
+    {
+        for (size_t r = 0; r < nruns; r++)
+            column[r] = runs[r].col[c];
+        qsort(column, nruns, sizeof(*column), cmp_u32);
+        median[c] = column[nruns / 2];
+    }
+    for (size_t r = 0; r < nruns; r++)
+        if (runs[r].col[4] > worst) worst = runs[r].col[4];
+    printf("%-6s %-6s %-6s %10zu %8u %8u %8u %8u %8u %8u\n", engine, workload, op, n,
+           median[0], median[1], median[2], median[3], median[4], worst);
+}
+
+/**
+ * Write every page of the mapping once without changing it, so the headers
+ * the engine keeps in the pool survive.
+ */
+static void prefault(struct buddy_pool *pool)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    volatile char *p = pool->base;
+    for (size_t off = 0; off < pool->numbytes; off += page)
+        p[off] = p[off];
+}
+
+struct engine
+{
+    const char *name;
+    unsigned int flags;
+    struct buddy_pool pool;
+    struct tail mix[2][MAX_RUNS];
+    struct tail chain[2][MAX_RUNS];
+    size_t nm, nf;
+};
+
+static void **live;
+static uint32_t *mlat, *flat;
+
+static void run_mix(struct engine *e, size_t ops, size_t run)
+{
+    struct buddy_pool *pool = &e->pool;
+    size_t nm = 0, nf = 0;
+    rng_state = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < ops; i++)
+    {
+        size_t slot = (size_t)(rng() % SLOTS);
+        if (live[slot])
+        {
+            uint64_t t0 = now_ns();
+            buddy_free(pool, live[slot]);
+            flat[nf++] = (uint32_t)(now_ns() - t0);
+            live[slot] = NULL;
+        }
+        else
+        {
+            size_t size = rng() % 512 == 0 ? (size_t)(1 << 20) : (size_t)(16 + rng() % 4096);
+            uint64_t t0 = now_ns();
+            live[slot] = buddy_malloc(pool, size);
+            mlat[nm++] = (uint32_t)(now_ns() - t0);
+        }
+    }
+    for (size_t s = 0; s < SLOTS; s++)
+    {
+        buddy_free(pool, live[s]);
+        live[s] = NULL;
+    }
+    e->mix[0][run] = percentiles(mlat, nm);
+    e->mix[1][run] = percentiles(flat, nf);
+    e->nm = nm;
+    e->nf = nf;
+}
+
+static void run_chain(struct engine *e, size_t ops, size_t run)
+{
+    struct buddy_pool *pool = &e->pool;
+    size_t n = ops / 2;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t t0 = now_ns();
+        void *mem = buddy_malloc(pool, 16);
+        uint64_t t1 = now_ns();
+        buddy_free(pool, mem);
+        uint64_t t2 = now_ns();
+        mlat[i] = (uint32_t)(t1 - t0);
+        flat[i] = (uint32_t)(t2 - t1);
+    }
+    e->chain[0][run] = percentiles(mlat, n);
+    e->chain[1][run] = percentiles(flat, n);
+}
+
+int main(int argc, char **argv)
+{
+    size_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t pool_k = argc > 2 ? strtoull(argv[2], NULL, 10) : 28;
+    size_t runs = argc > 3 ? strtoull(argv[3], NULL, 10) : 5;
+    if (runs < 1) runs = 1;
+    if (runs > MAX_RUNS) runs = MAX_RUNS;
+
+    struct engine engines[] = {
+        { .name = "buddy", .flags = BUDDY_ENGINE_BUDDY },
+        { .name = "tlsf", .flags = BUDDY_ENGINE_TLSF },
+    };
+    size_t nengines = sizeof(engines) / sizeof(engines[0]);
+    live = calloc(SLOTS, sizeof(void *));
+    mlat = malloc(ops * sizeof(uint32_t));
+    flat = malloc(ops * sizeof(uint32_t));
+    if (live == NULL || mlat == NULL || flat == NULL)
+    {
+        perror("latency");
+        return 1;
+    }
+    for (size_t e = 0; e < nengines; e++)
+    {
+        buddy_init_ex(&engines[e].pool, UINT64_C(1) << pool_k, engines[e].flags);
+        prefault(&engines[e].pool);
+    }
+
+    //Run 0 warms caches and branch predictors and is not reported
+    for (size_t r = 0; r <= runs; r++)
+        for (size_t e = 0; e < nengines; e++)
+        {
+            size_t slot = r ? r - 1 : 0;
+            run_mix(&engines[e], ops, slot);
+            run_chain(&engines[e], ops, slot);
+        }
+
+    printf("latency: %zu ops on a 2^%zu byte pool, median of %zu runs, nanoseconds\n", ops, pool_k, runs);
+    printf("%-6s %-6s %-6s %10s %8s %8s %8s %8s %8s %8s\n", "engine", "load", "op", "count",
+           "p50", "p99", "p99.9", "p99.99", "max", "worst");
+    for (size_t e = 0; e < nengines; e++)
+    {
+        report(engines[e].name, "mix", "malloc", engines[e].nm, engines[e].mix[0], runs);
+        report(engines[e].name, "mix", "free", engines[e].nf, engines[e].mix[1], runs);
+        report(engines[e].name, "chain", "malloc", ops / 2, engines[e].chain[0], runs);
+        report(engines[e].name, "chain", "free", ops / 2, engines[e].chain[1], runs);
+        buddy_destroy(&engines[e].pool);
+    }
+    free(live);
+    free(mlat);
+    free(flat);
+    return 0;
+}
@@ -0,0 +1,353 @@
+/**
+ * @file micro.c
+ * @brief   Microbenchmarks for buddy_malloc, buddy_free and buddy_realloc with
+ *          glibc malloc as the baseline: fixed size churn for every order,
+ *          random size mixes, LIFO and FIFO free order and realloc growth.
+ *          Every benchmark runs twice on the same allocator state, an untimed
+ *          pass for the throughput (it also faults in the pages) and a pass that
+ *          times each call for the latency percentiles. The clock read adds about
+ *          20ns to every latency, compare allocators rather than absolute values.
+ *          Results go to stdout as JSON.
+ *
+ *          With BENCH_COUNTERS=1 in the environment every benchmark runs a third
+ *          time with perf_event_open counters (perf.h) read around each batch of
+ *          mallocs and each batch of frees, reported per call. Benchmarks that mix
+ *          the two are reported as one "mixed" phase.
+ *
+ *          usage: micro [ops] [pool_k]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "../src/lab.h"
+#include "../src/clock.h"
+#include "perf.h"
+
+#define SLOTS 4096
+#define BATCH 1024
+#define CHAINS 64
+#define MIN_ORDER SMALLEST_K
+#define MAX_ORDER 16
+
+struct allocator
+{
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    unsigned int flags;         /*buddy_init_ex flags for the pool*/
+};
+
+struct bench
+{
+    const char *name;
+    size_t (*run)(const struct allocator *a, size_t ops, uint32_t *lat);
+    bool per_order;             /*Run once for every order MIN_ORDER..MAX_ORDER*/
+};
+
+enum phase { PHASE_MALLOC, PHASE_FREE, PHASE_MIXED, PHASES };
+static const char *phase_names[PHASES] = {"malloc", "free", "mixed"};
+
+static struct buddy_pool pool;
+static size_t order;            /*Order under test for the per order benchmarks*/
+static struct perf_counters *counting;  /*Set during the counter pass*/
+static struct perf_totals phase_totals[PHASES];
+static uint64_t rng_state;
+static void *slots[SLOTS];
+
+static void *pool_malloc(size_t size) { return buddy_malloc(&pool, size); }
+static void pool_free(void *ptr) { buddy_free(&pool, ptr); }
+static void *pool_realloc(void *ptr, size_t size) { return buddy_realloc(&pool, ptr, size); }
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/**
+ * Run expr, timing it into lat[n] when lat is set, and count the operation.
+ */
+#define TIMED(lat, n, expr)                                         \
+    do {                                                            \
+        if (lat) {                                                  \
+            uint64_t t0_ = now_ns();                                \
+            expr;                                                   \
+            (lat)[n] = (uint32_t)(now_ns() - t0_);                  \
+        } else {                                                    \
+            expr;                                                   \
+        }                                                           \
+        (n)++;                                                      \
+    } while (0)
+
+static inline void phase_begin(void)
+{
+    if (counting) perf_begin(counting);
+}
+
+static inline void phase_end(enum phase phase, size_t ops)
+{
+    if (counting) perf_end(counting, &phase_totals[phase], ops);
+}
+
+/**
+ * Log uniform sizes between 16 bytes and 2^max_shift bytes.
+ */
+static size_t log_size(size_t max_shift)
+{
+    size_t shift = 4 + (size_t)(rng() % (max_shift - 4));
+    return (UINT64_C(1) << shift) + (size_t)(rng() % (UINT64_C(1) << shift));
+}
+
+/**
+ * Batches of requests that exactly fill a block of the current order, freed
+ * newest first.
+ */
+static size_t bench_churn(const struct allocator *a, size_t ops, uint32_t *lat)
+{
+    size_t size = (UINT64_C(1) << order) - sizeof(struct avail);
+    size_t batch = order > 12 ? 64 : BATCH;
+    size_t n = 0;
+    while (n + 2 * batch <= ops)
+    {
+        phase_begin();
+        for (size_t i = 0; i < batch; i++)
+            TIMED(lat, n, slots[i] = a->malloc(size));
+        phase_end(PHASE_MALLOC, batch);
+        phase_begin();
+        for (size_t i = batch; i-- > 0;)
+            TIMED(lat, n, a->free(slots[i]));
+        phase_end(PHASE_FREE, batch);
+    }
+    return n;
+}
+
+/**
+ * A live set of SLOTS objects of 16B-64KiB where each step frees or
+ * allocates a random slot.
+ */
+static size_t bench_random(const struct allocator *a, size_t ops, uint32_t *lat)
+{
+    size_t n = 0;
+    rng_state = 0x9E3779B97F4A7C15ull;
+    phase_begin();
+    while (n < ops)
+    {
+        size_t slot = (size_t)(rng() % SLOTS);
+        if (slots[slot]) {
+            TIMED(lat, n, a->free(slots[slot]));
+            slots[slot] = NULL;
+        } else {
+            size_t size = log_size(16);
+            TIMED(lat, n, slots[slot] = a->malloc(size));
+        }
+    }
+    phase_end(PHASE_MIXED, n);
+    for (size_t i = 0; i < SLOTS; i++)
+    {
+        a->free(slots[i]);
+        slots[i] = NULL;
+    }
+    return n;
+}
+
+static size_t bench_free_order(const struct allocator *a, size_t ops, uint32_t *lat, bool lifo)
+{
+    size_t n = 0;
+    rng_state = 0x2545F4914F6CDD1Dull;
+    while (n + 2 * BATCH <= ops)
+    {
+        phase_begin();
+        for (size_t i = 0; i < BATCH; i++)
+        {
+            size_t size = 16 + (size_t)(rng() % 1008);
+            TIMED(lat, n, slots[i] = a->malloc(size));
+        }
+        phase_end(PHASE_MALLOC, BATCH);
+        phase_begin();
+        for (size_t i = 0; i < BATCH; i++)
+            TIMED(lat, n, a->free(slots[lifo ? BATCH - 1 - i : i]));
+        phase_end(PHASE_FREE, BATCH);
+    }
+    return n;
+}
+
+/**
+ * Batches of 16B-1KiB objects freed newest first.
+ */
+static size_t bench_lifo(const struct allocator *a, size_t ops, uint32_t *lat)
+{
+    return bench_free_order(a, ops, lat, true);
+}
+
+/**
+ * Batches of 16B-1KiB objects freed oldest first.
+ */
+static size_t bench_fifo(const struct allocator *a, size_t ops, uint32_t *lat)
+{
+    return bench_free_order(a, ops, lat, false);
+}
+
+/**
+ * CHAINS buffers grown by half their size at a time from 16 bytes to 256KiB,
+ * round robin so they get in each other's way, then freed and started over.
+ */
+static size_t bench_realloc(const struct allocator *a, size_t ops, uint32_t *lat)
+{
+    size_t sizes[CHAINS];
+    size_t n = 0;
+    for (size_t c = 0; c < CHAINS; c++)
+        sizes[c] = 16;
+    phase_begin();
+    while (n < ops)
+    {
+        for (size_t c = 0; c < CHAINS && n < ops; c++)
+        {
+            if (sizes[c] > (UINT64_C(256) << 10)) {
+                TIMED(lat, n, a->free(slots[c]));
+                slots[c] = NULL;
+                sizes[c] = 16;
+                continue;
+            }
+            void *p = NULL;
+            TIMED(lat, n, p = a->realloc(slots[c], sizes[c]));
+            if (p) {
+                ((char *)p)[sizes[c] - 1] = 1;
+                slots[c] = p;
+            }
+            sizes[c] += sizes[c] / 2;
+        }
+    }
+    phase_end(PHASE_MIXED, n);
+    for (size_t c = 0; c < CHAINS; c++)
+    {
+        a->free(slots[c]);
+        slots[c] = NULL;
+    }
+    return n;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+struct result
+{
+    size_t ops;
+    double ops_per_sec;
+    uint32_t p50, p99, p999;
+    struct perf_totals phase[PHASES];
+};
+
+static void measure(const struct bench *b, const struct allocator *a, size_t ops, size_t pool_k,
+                    uint32_t *lat, struct perf_counters *pc, struct result *r)
+{
+    if (a->flags != UINT32_MAX) buddy_init_ex(&pool, UINT64_C(1) << pool_k, a->flags);
+
+    //Every benchmark leaves its slots freed, not cleared
+    memset(slots, 0, sizeof(slots));
+    uint64_t start = now_ns();
+    r->ops = b->run(a, ops, NULL);
+    r->ops_per_sec = (double)r->ops * 1e9 / (double)(now_ns() - start);
+
+    memset(slots, 0, sizeof(slots));
+    size_t n = b->run(a, ops, lat);
+    qsort(lat, n, sizeof(*lat), cmp_u32);
+    r->p50 = lat[n / 2];
+    r->p99 = lat[n * 99 / 100];
+    r->p999 = lat[n * 999 / 1000];
+
+    if (pc) {
+        memset(slots, 0, sizeof(slots));
+        memset(phase_totals, 0, sizeof(phase_totals));
+        counting = pc;
+        b->run(a, ops, NULL);
+        counting = NULL;
+        memcpy(r->phase, phase_totals, sizeof(phase_totals));
+    }
+
+    if (a->flags != UINT32_MAX) buddy_destroy(&pool);
+}
+
+int main(int argc, char **argv)
+{
+    size_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : 200000;
+    size_t pool_k = argc > 2 ? strtoull(argv[2], NULL, 10) : 26;
+    //glibc first, it is the baseline the others are compared with
+    const struct allocator allocators[] = {
+        {"glibc", malloc, free, realloc, UINT32_MAX},
+        {"buddy", pool_malloc, pool_free, pool_realloc, BUDDY_ENGINE_BUDDY},
+        {"tlsf", pool_malloc, pool_free, pool_realloc, BUDDY_ENGINE_TLSF},
+    };
+    const struct bench benches[] = {
+        {"churn", bench_churn, true},
+        {"random", bench_random, false},
+        {"free_lifo", bench_lifo, false},
+        {"free_fifo", bench_fifo, false},
+        {"realloc_growth", bench_realloc, false},
+    };
+    size_t n_alloc = sizeof(allocators) / sizeof(allocators[0]);
+    uint32_t *lat = malloc(ops * sizeof(uint32_t));
+
+    struct perf_counters counters, *pc = NULL;
+    const char *counter_kind = "off";
+    const char *env = getenv("BENCH_COUNTERS");
+    if (env && *env && strcmp(env, "0")) {
+        if (perf_open(&counters) > 0) {
+            pc = &counters;
+            counter_kind = counters.hardware ? "hardware" : "software";
+        } else {
+            fprintf(stderr, "micro: perf_event_open gave no counters, running without\n");
+        }
+    }
+
+    printf("{\n  \"ops\": %zu,\n  \"pool_k\": %zu,\n  \"counters\": \"%s\",\n  \"results\": [",
+           ops, pool_k, counter_kind);
+    const char *sep = "\n";
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++)
+    {
+        size_t first = benches[b].per_order ? MIN_ORDER : 0;
+        size_t last = benches[b].per_order ? MAX_ORDER : 0;
+        for (order = first; order <= last; order++)
+        {
+            double baseline = 0;
+            for (size_t a = 0; a < n_alloc; a++)
+            {
+                struct result r;
+                measure(&benches[b], &allocators[a], ops, pool_k, lat, pc, &r);
+                if (a == 0) baseline = r.ops_per_sec;
+                printf("%s    {\"bench\": \"%s\", ", sep, benches[b].name);
+                if (benches[b].per_order) printf("\"order\": %zu, ", order);
+                printf("\"allocator\": \"%s\", \"ops\": %zu, \"ops_per_sec\": %.0f, "
+                       "\"p50_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u, \"vs_glibc\": %.2f",
+                       allocators[a].name, r.ops, r.ops_per_sec, r.p50, r.p99, r.p999,
+                       r.ops_per_sec / baseline);
+                if (pc) {
+                    //Per call counters of each phase the benchmark has
+                    const char *psep = "";
+                    printf(", \"counters\": {");
+                    for (int p = 0; p < PHASES; p++)
+                    {
+                        if (r.phase[p].ops == 0) continue;
+                        printf("%s\"%s\": ", psep, phase_names[p]);
+                        perf_json(pc, &r.phase[p], stdout);
+                        psep = ", ";
+                    }
+                    printf("}");
+                }
+                printf("}");
+                sep = ",\n";
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    if (pc) perf_close(pc);
+    free(lat);
+    return 0;
+}
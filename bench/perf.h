@@ -0,0 +1,142 @@
+/**
+ * @file perf.h
+ * @brief   perf_event_open counters for the benchmarks: cycles, instructions,
+ *          L1D, LLC and dTLB read misses and page faults of the calling thread,
+ *          user space only. Containers and VMs often hide the hardware counters,
+ *          cycles then falls back to the task clock in ns and the other hardware
+ *          counters are left out, so a benchmark always gets whatever is there.
+ *          Counters are read around whole phases, a batch of mallocs or frees,
+ *          so the read syscalls are spread over many calls.
+ */
+#ifndef BENCH_PERF_H
+#define BENCH_PERF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#define PERF_EVENTS 6
+
+struct perf_counters
+{
+    int fd[PERF_EVENTS];            /*-1 for a counter that could not be opened*/
+    const char *name[PERF_EVENTS];  /*What each counter ended up measuring*/
+    bool hardware;                  /*cycles is a real cycle count*/
+    double start[PERF_EVENTS];
+};
+
+struct perf_totals
+{
+    double value[PERF_EVENTS];
+    size_t ops;                     /*Calls the values were measured over*/
+};
+
+#ifdef __linux__
+static inline int perf_event(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static inline uint64_t perf_cache(uint64_t cache, uint64_t result)
+{
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+}
+#endif
+
+/**
+ * Open every counter the kernel lets us have.
+ *
+ * @return The number of counters opened, 0 if there are none at all
+ */
+static inline int perf_open(struct perf_counters *pc)
+{
+    static const char *names[PERF_EVENTS] = {
+        "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses", "page_faults",
+    };
+    int opened = 0;
+    for (int i = 0; i < PERF_EVENTS; i++)
+    {
+        pc->fd[i] = -1;
+        pc->name[i] = names[i];
+    }
+#ifdef __linux__
+    pc->fd[0] = perf_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    pc->fd[1] = perf_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    pc->fd[2] = perf_event(PERF_TYPE_HW_CACHE, perf_cache(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    pc->fd[3] = perf_event(PERF_TYPE_HW_CACHE, perf_cache(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    pc->fd[4] = perf_event(PERF_TYPE_HW_CACHE, perf_cache(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    pc->fd[5] = perf_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+    pc->hardware = pc->fd[0] >= 0;
+    if (!pc->hardware) {
+        pc->fd[0] = perf_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK);
+        pc->name[0] = "task_clock_ns";
+    }
+#endif
+    for (int i = 0; i < PERF_EVENTS; i++)
+        if (pc->fd[i] >= 0) opened++;
+    return opened;
+}
+
+static inline void perf_close(struct perf_counters *pc)
+{
+    for (int i = 0; i < PERF_EVENTS; i++)
+        if (pc->fd[i] >= 0) close(pc->fd[i]);
+}
+
+/**
+ * Read a counter, scaled up for the time it was multiplexed out.
+ */
+static inline double perf_read(int fd)
+{
+    uint64_t v[3];
+    if (read(fd, v, sizeof(v)) != (ssize_t)sizeof(v) || v[2] == 0) return 0;
+    return (double)v[0] * ((double)v[1] / (double)v[2]);
+}
+
+static inline void perf_begin(struct perf_counters *pc)
+{
+    for (int i = 0; i < PERF_EVENTS; i++)
+        if (pc->fd[i] >= 0) pc->start[i] = perf_read(pc->fd[i]);
+}
+
+/**
+ * Add what the counters moved since perf_begin to t, over ops calls.
+ */
+static inline void perf_end(struct perf_counters *pc, struct perf_totals *t, size_t ops)
+{
+    for (int i = 0; i < PERF_EVENTS; i++)
+        if (pc->fd[i] >= 0) t->value[i] += perf_read(pc->fd[i]) - pc->start[i];
+    t->ops += ops;
+}
+
+/**
+ * Print the totals per call as a JSON object.
+ */
+static inline void perf_json(const struct perf_counters *pc, const struct perf_totals *t, FILE *out)
+{
+    const char *sep = "";
+    fputc('{', out);
+    for (int i = 0; i < PERF_EVENTS; i++)
+    {
+        if (pc->fd[i] < 0) continue;
+        fprintf(out, "%s\"%s\": %.3f", sep, pc->name[i], t->ops ? t->value[i] / (double)t->ops : 0);
+        sep = ", ";
+    }
+    fputc('}', out);
+}
+
+#endif
@@ -0,0 +1,261 @@
+/**
+ * @file threads.c
+ * @brief   Multi threaded workloads for a BUDDY_LOCKED pool and a lock-free
+ *          BUDDY_ENGINE_NBBS pool with glibc malloc as the baseline. Every
+ *          workload runs with 1, 2, 4, ... up to max_threads threads and
+ *          reports the total throughput and the speedup over one thread, the
+ *          scaling curve of each allocator.
+ *
+ *          larson:       server churn, each round a thread frees and replaces
+ *                        random objects allocated by another thread the round before
+ *          threadtest:   every thread allocates a batch of small objects and frees it
+ *          cache-scratch: one thread allocates an object per thread, each thread frees
+ *                        its object and then allocates, writes and frees its own, so
+ *                        an allocator that hands neighbouring bytes to different
+ *                        threads shows up as false sharing
+ *          prodcons:     thread t allocates into a queue read by thread t+1, which
+ *                        frees, so every free is a cross thread free
+ *
+ *          usage: threads [max_threads] [ops_per_thread] [pool_k]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "../src/lab.h"
+#include "../src/clock.h"
+
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 10
+#define THREADTEST_BATCH 500
+#define SCRATCH_WRITES 100
+#define QUEUE_SIZE 1024
+#define MAX_THREADS 64
+
+struct allocator
+{
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    unsigned int flags;         /*buddy_init_ex flags for the pool, UINT32_MAX for none*/
+};
+
+/**
+ * A single producer single consumer ring.
+ */
+struct queue
+{
+    void *item[QUEUE_SIZE];
+    size_t head __attribute__((aligned(64)));   /*Next slot to read, written by the consumer*/
+    size_t tail __attribute__((aligned(64)));   /*Next slot to write, written by the producer*/
+};
+
+struct workload
+{
+    const char *name;
+    void (*run)(size_t t);
+};
+
+static struct buddy_pool pool;
+static const struct allocator *alloc;
+static size_t nthreads;
+static size_t ops;
+static pthread_barrier_t barrier;
+static void **larson_slots[MAX_THREADS];
+static void *scratch[MAX_THREADS];
+static struct queue queues[MAX_THREADS];
+
+static void *pool_malloc(size_t size) { return buddy_malloc(&pool, size); }
+static void pool_free(void *ptr) { buddy_free(&pool, ptr); }
+
+static inline uint64_t rng(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void larson(size_t t)
+{
+    uint64_t seed = 0x9E3779B97F4A7C15ull * (t + 1);
+    void **mine = larson_slots[t];
+    for (size_t i = 0; i < LARSON_SLOTS; i++)
+        mine[i] = alloc->malloc(16 + (size_t)(rng(&seed) % 496));
+    pthread_barrier_wait(&barrier);
+
+    size_t per_round = ops / 2 / LARSON_ROUNDS;
+    for (size_t r = 0; r < LARSON_ROUNDS; r++)
+    {
+        //The objects of the thread next door, allocated by it last round
+        void **slots = larson_slots[(t + r + 1) % nthreads];
+        for (size_t i = 0; i < per_round; i++)
+        {
+            size_t s = (size_t)(rng(&seed) % LARSON_SLOTS);
+            alloc->free(slots[s]);
+            slots[s] = alloc->malloc(16 + (size_t)(rng(&seed) % 496));
+        }
+        pthread_barrier_wait(&barrier);
+    }
+}
+
+static void threadtest(size_t t)
+{
+    void *batch[THREADTEST_BATCH];
+    (void)t;
+    for (size_t done = 0; done < ops; done += 2 * THREADTEST_BATCH)
+    {
+        for (size_t i = 0; i < THREADTEST_BATCH; i++)
+            batch[i] = alloc->malloc(64);
+        for (size_t i = 0; i < THREADTEST_BATCH; i++)
+            alloc->free(batch[i]);
+    }
+}
+
+static void cache_scratch(size_t t)
+{
+    alloc->free(scratch[t]);
+    for (size_t i = 0; i < ops; i += 2)
+    {
+        volatile char *p = alloc->malloc(8);
+        for (size_t w = 0; w < SCRATCH_WRITES; w++)
+            p[w & 7]++;
+        alloc->free((void *)p);
+    }
+}
+
+static void prodcons(size_t t)
+{
+    struct queue *out = &queues[(t + 1) % nthreads];
+    struct queue *in = &queues[t];
+    size_t produced = 0, consumed = 0;
+    //ops counts both halves, the previous thread sends us as many as we send
+    while (produced < ops / 2 || consumed < ops / 2)
+    {
+        size_t tail = out->tail;
+        bool sent = false;
+        if (produced < ops / 2 && tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE) < QUEUE_SIZE)
+        {
+            out->item[tail % QUEUE_SIZE] = alloc->malloc(16 + produced % 240);
+            __atomic_store_n(&out->tail, tail + 1, __ATOMIC_RELEASE);
+            produced++;
+            sent = true;
+        }
+        size_t head = in->head;
+        if (head != __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE))
+        {
+            alloc->free(in->item[head % QUEUE_SIZE]);
+            __atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+            consumed++;
+        }
+        else if (!sent)
+        {
+            //Nothing to read and nothing could be sent, let the other threads run
+            sched_yield();
+        }
+    }
+}
+
+static const struct workload *current;
+static uint64_t started[MAX_THREADS];
+static uint64_t finished[MAX_THREADS];
+
+static void *worker(void *arg)
+{
+    size_t t = (size_t)(uintptr_t)arg;
+    pthread_barrier_wait(&barrier);
+    started[t] = now_ns();
+    current->run(t);
+    finished[t] = now_ns();
+    return NULL;
+}
+
+/**
+ * Run a workload on n threads and return the operations per second, counting
+ * a malloc and a free as one operation each.
+ */
+static double measure(const struct workload *w, size_t n, size_t pool_k)
+{
+    if (alloc->flags != UINT32_MAX) buddy_init_ex(&pool, UINT64_C(1) << pool_k, alloc->flags);
+    current = w;
+    nthreads = n;
+    memset(queues, 0, sizeof(queues));
+    for (size_t t = 0; t < n; t++)
+    {
+        larson_slots[t] = calloc(LARSON_SLOTS, sizeof(void *));
+        scratch[t] = alloc->malloc(8);
+    }
+
+    //Timed from the first thread to leave the barrier to the last one done
+    pthread_barrier_init(&barrier, NULL, (unsigned)n);
+    pthread_t tid[MAX_THREADS];
+    for (size_t t = 0; t < n; t++)
+        pthread_create(&tid[t], NULL, worker, (void *)(uintptr_t)t);
+    uint64_t start = 0, end = 0;
+    for (size_t t = 0; t < n; t++)
+    {
+        pthread_join(tid[t], NULL);
+        if (t == 0 || started[t] < start) start = started[t];
+        if (finished[t] > end) end = finished[t];
+    }
+    double elapsed = (double)(end - start) / 1e9;
+    pthread_barrier_destroy(&barrier);
+
+    for (size_t t = 0; t < n; t++)
+    {
+        if (w->run == larson)
+            for (size_t i = 0; i < LARSON_SLOTS; i++)
+                alloc->free(larson_slots[t][i]);
+        if (w->run != cache_scratch) alloc->free(scratch[t]);
+        free(larson_slots[t]);
+    }
+    if (alloc->flags != UINT32_MAX) buddy_destroy(&pool);
+    return (double)(ops * n) / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    size_t max_threads = argc > 1 ? strtoull(argv[1], NULL, 10) : 8;
+    ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 100000;
+    size_t pool_k = argc > 3 ? strtoull(argv[3], NULL, 10) : 28;
+    if (max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+
+    const struct allocator allocators[] = {
+        {"glibc", malloc, free, UINT32_MAX},
+        {"buddy", pool_malloc, pool_free, BUDDY_LOCKED},
+        {"tlsf", pool_malloc, pool_free, BUDDY_LOCKED | BUDDY_ENGINE_TLSF},
+        {"nbbs", pool_malloc, pool_free, BUDDY_ENGINE_NBBS},
+    };
+    const struct workload workloads[] = {
+        {"larson", larson},
+        {"threadtest", threadtest},
+        {"cache-scratch", cache_scratch},
+        {"prodcons", prodcons},
+    };
+    size_t n_alloc = sizeof(allocators) / sizeof(allocators[0]);
+
+    printf("threads: %zu ops per thread, Mops/sec (speedup over 1 thread)\n", ops);
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        printf("\n%-14s %7s", workloads[w].name, "threads");
+        for (size_t a = 0; a < n_alloc; a++)
+            printf(" %18s", allocators[a].name);
+        printf("\n");
+        double single[sizeof(allocators) / sizeof(allocators[0])];
+        for (size_t n = 1; n <= max_threads; n *= 2)
+        {
+            printf("%-14s %7zu", "", n);
+            for (size_t a = 0; a < n_alloc; a++)
+            {
+                alloc = &allocators[a];
+                double rate = measure(&workloads[w], n, pool_k);
+                if (n == 1) single[a] = rate;
+                printf(" %10.2f (%4.2fx)", rate / 1e6, rate / single[a]);
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,246 @@
+/**
+ * @file buddy_preload.c
+ * @brief   malloc, free, calloc, realloc, posix_memalign, aligned_alloc, memalign
+ *          and malloc_usable_size on top of one BUDDY_LOCKED buddy pool, built as
+ *          libbuddy.so to run unmodified programs on the allocator:
+ *
+ *          LD_PRELOAD=./libbuddy.so program
+ *
+ *          The pool is created by the first call. BUDDY_PRELOAD_K sets its order
+ *          (default 32, the mapping is only backed as it is touched) and
+ *          BUDDY_PRELOAD_FLAGS its placement flags, see buddy_init_ex. The buddy
+ *          engine is always used.
+ *
+ *          Three kinds of pointers reach free: blocks of the pool, blocks from
+ *          the bootstrap buffer that served the calls made while the pool was
+ *          being created (dlsym and pthread_atfork may allocate), and foreign
+ *          blocks from glibc, handed out before the library was loaded, by
+ *          glibc internals that call its allocator directly or when the pool
+ *          ran out of memory. The address tells them apart.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../src/lab.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define PRELOAD_DEFAULT_K 32
+#define MALLOC_ALIGN 16             /*What glibc malloc guarantees, alignof(max_align_t)*/
+#define BOOTSTRAP_BYTES (64 * 1024)
+
+#define STATE_NONE 0
+#define STATE_INIT 1
+#define STATE_READY 2
+
+/*
+ * glibc's own allocator, for foreign pointers and when the pool is full.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+static struct buddy_pool pool;
+static atomic_int state = STATE_NONE;
+static size_t (*libc_usable_size)(void *);
+
+/*
+ * Set while this thread creates the pool, its allocations go to the
+ * bootstrap buffer. initial-exec so reading it never allocates.
+ */
+static __thread int in_init __attribute__((tls_model("initial-exec")));
+
+/*
+ * Bump allocator for the calls made while the pool is being created. Each
+ * block is preceded by its size so realloc can copy it out. Only the
+ * creating thread uses it and its blocks are never reused.
+ */
+static _Alignas(MALLOC_ALIGN) char bootstrap[BOOTSTRAP_BYTES];
+static size_t bootstrap_used;
+
+static inline bool from_pool(void *ptr)
+{
+    return (char *)ptr >= (char *)pool.base && (char *)ptr < (char *)pool.base + pool.numbytes;
+}
+
+static inline bool from_bootstrap(void *ptr)
+{
+    return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP_BYTES;
+}
+
+static void *bootstrap_alloc(size_t align, size_t size)
+{
+    if (align < MALLOC_ALIGN) align = MALLOC_ALIGN;
+    size_t start = (bootstrap_used + MALLOC_ALIGN + align - 1) & ~(align - 1);
+    if (size > BOOTSTRAP_BYTES || start > BOOTSTRAP_BYTES - size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    bootstrap_used = start + size;
+    *(size_t *)(bootstrap + start - sizeof(size_t)) = size;
+    return bootstrap + start;
+}
+
+static inline size_t bootstrap_size(void *ptr)
+{
+    return *(size_t *)((char *)ptr - sizeof(size_t));
+}
+
+/*
+ * The pool lock is held across fork so the child does not inherit it in
+ * the middle of a call made by a thread that no longer exists.
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&pool.lock);
+}
+
+static void fork_release(void)
+{
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static size_t env_value(const char *name, size_t fallback)
+{
+    const char *v = getenv(name);
+    return v && *v ? (size_t)strtoull(v, NULL, 0) : fallback;
+}
+
+/**
+ * Create the pool on first use. Returns false when the caller is the
+ * thread creating it, which has to use the bootstrap buffer.
+ */
+static bool pool_ready(void)
+{
+    int s = atomic_load_explicit(&state, memory_order_acquire);
+    if (s == STATE_READY) return true;
+    if (in_init) return false;
+
+    s = STATE_NONE;
+    if (atomic_compare_exchange_strong(&state, &s, STATE_INIT)) {
+        in_init = 1;
+        size_t k = env_value("BUDDY_PRELOAD_K", PRELOAD_DEFAULT_K);
+        if (k < MIN_K || k >= MAX_K) k = PRELOAD_DEFAULT_K;
+        unsigned int flags = (unsigned int)env_value("BUDDY_PRELOAD_FLAGS", 0);
+        flags &= BUDDY_POLICY_MASK | BUDDY_TRIM_TAIL;
+        buddy_init_ex(&pool, UINT64_C(1) << k, flags | BUDDY_LOCKED);
+        libc_usable_size = (size_t (*)(void *))dlsym(RTLD_NEXT, "malloc_usable_size");
+        pthread_atfork(fork_prepare, fork_release, fork_release);
+        in_init = 0;
+        atomic_store_explicit(&state, STATE_READY, memory_order_release);
+        return true;
+    }
+    while (atomic_load_explicit(&state, memory_order_acquire) != STATE_READY)
+        sched_yield();
+    return true;
+}
+
+static void *preload_memalign(size_t align, size_t size)
+{
+    if (!pool_ready()) return bootstrap_alloc(align, size);
+    void *mem = buddy_memalign(&pool, align, size);
+    if (mem == NULL && size) mem = __libc_memalign(align, size);
+    return mem;
+}
+
+static size_t usable_size(void *ptr)
+{
+    if (ptr == NULL) return 0;
+    if (from_bootstrap(ptr)) return bootstrap_size(ptr);
+    if (from_pool(ptr)) return buddy_usable_size(&pool, ptr);
+    return libc_usable_size ? libc_usable_size(ptr) : 0;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    return preload_memalign(MALLOC_ALIGN, size ? size : 1);
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr == NULL || from_bootstrap(ptr)) return;
+    if (from_pool(ptr)) {
+        buddy_free(&pool, ptr);
+        return;
+    }
+    __libc_free(ptr);
+}
+
+EXPORT void *calloc(size_t n, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(n, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    //Pool blocks are recycled without being cleared
+    void *mem = malloc(bytes);
+    if (mem) memset(mem, 0, bytes);
+    return mem;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (from_pool(ptr)) {
+        void *mem = buddy_realloc(&pool, ptr, size);
+        if (mem || errno != ENOMEM) return mem;
+        //Out of pool memory, continue the block in glibc's heap
+        size_t old = usable_size(ptr);
+        if ((mem = __libc_malloc(size)) == NULL) return NULL;
+        memcpy(mem, ptr, old < size ? old : size);
+        buddy_free(&pool, ptr);
+        return mem;
+    }
+    if (from_bootstrap(ptr)) {
+        size_t old = bootstrap_size(ptr);
+        void *mem = malloc(size);
+        if (mem) memcpy(mem, ptr, old < size ? old : size);
+        return mem;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    if (align < sizeof(void *) || (align & (align - 1))) return EINVAL;
+    int saved = errno;
+    void *mem = preload_memalign(align < MALLOC_ALIGN ? MALLOC_ALIGN : align, size ? size : 1);
+    if (mem == NULL) {
+        int err = errno;
+        errno = saved;
+        return err;
+    }
+    *memptr = mem;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return preload_memalign(align < MALLOC_ALIGN ? MALLOC_ALIGN : align, size ? size : 1);
+}
+
+EXPORT void *memalign(size_t align, size_t size)
+{
+    return aligned_alloc(align, size);
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return usable_size(ptr);
+}
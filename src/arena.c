@@ -0,0 +1,96 @@
+/**
+ * @file arena.c
+ * @brief   Bump allocator carved from buddy blocks. Scratch memory that dies all at
+ *          once is handed out by moving a pointer and given back to the pool
+ *          chunk by chunk instead of object by object.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+static inline size_t align_up(size_t n, size_t align)
+{
+    return (n + align - 1) & ~(align - 1);
+}
+
+static inline char *chunk_begin(struct arena_chunk *chunk)
+{
+    return (char *)(chunk + 1);
+}
+
+void arena_init(struct buddy_arena *arena, struct buddy_pool *pool, size_t chunk_size)
+{
+    arena->pool = pool;
+    arena->head = NULL;
+    arena->cur = arena->end = NULL;
+    arena->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+    if (arena->chunk_size < (UINT64_C(1) << SMALLEST_K))
+        arena->chunk_size = UINT64_C(1) << SMALLEST_K;
+}
+
+/**
+ * @brief Chain a new chunk big enough for size bytes in front of the arena.
+ *
+ * @return false if the pool is out of memory
+ */
+static bool arena_grow(struct buddy_arena *arena, size_t size)
+{
+    //Ask for exactly chunk_size bytes of buddy block so no power of two is wasted
+    size_t header = sizeof(struct arena_chunk) + ARENA_ALIGN;
+    size_t want = arena->chunk_size - sizeof(struct avail);
+    if (size + header > want) want = size + header;
+    struct arena_chunk *chunk = buddy_malloc(arena->pool, want);
+    if (chunk == NULL) return false;
+
+    chunk->prev = arena->head;
+    chunk->size = want - sizeof(struct arena_chunk);
+    arena->head = chunk;
+    arena->cur = chunk_begin(chunk);
+    arena->end = arena->cur + chunk->size;
+    return true;
+}
+
+void *arena_alloc(struct buddy_arena *arena, size_t size)
+{
+    if (size == 0) return NULL;
+
+    char *ptr = (char *)align_up((uintptr_t)arena->cur, ARENA_ALIGN);
+    if (arena->head == NULL || ptr > arena->end || (size_t)(arena->end - ptr) < size)
+    {
+        if (!arena_grow(arena, size)) return NULL;
+        ptr = (char *)align_up((uintptr_t)arena->cur, ARENA_ALIGN);
+    }
+    arena->cur = ptr + size;
+    return ptr;
+}
+
+void arena_reset(struct buddy_arena *arena)
+{
+    struct arena_chunk *chunk = arena->head;
+    if (chunk == NULL) return;
+
+    while (chunk->prev != NULL)
+    {
+        struct arena_chunk *prev = chunk->prev;
+        buddy_free(arena->pool, chunk);
+        chunk = prev;
+    }
+    arena->head = chunk;
+    arena->cur = chunk_begin(chunk);
+    arena->end = arena->cur + chunk->size;
+}
+
+void arena_destroy(struct buddy_arena *arena)
+{
+    struct arena_chunk *chunk = arena->head;
+    while (chunk != NULL)
+    {
+        struct arena_chunk *prev = chunk->prev;
+        buddy_free(arena->pool, chunk);
+        chunk = prev;
+    }
+    arena->head = NULL;
+    arena->cur = arena->end = NULL;
+}
@@ -0,0 +1,85 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * The default number of bytes an arena takes from its pool at a time. This
+   * includes the pool's block header so a power of two fills a buddy block.
+   */
+#define ARENA_DEFAULT_CHUNK (UINT64_C(1) << 16)
+
+  /**
+   * A chunk is one buddy block. The arena hands out memory by moving a
+   * pointer forward inside the newest chunk, objects carry no header.
+   */
+  struct arena_chunk
+  {
+    struct arena_chunk *prev;   /*The chunk that filled up before this one*/
+    size_t size;                /*Usable bytes after this header*/
+  };
+
+  /**
+   * A region of memory whose objects are all released together.
+   */
+  struct buddy_arena
+  {
+    struct buddy_pool *pool;    /*The pool the chunks come from*/
+    struct arena_chunk *head;   /*The chunk we are currently bumping through*/
+    char *cur;                  /*Next unused byte in head, not yet aligned*/
+    char *end;                  /*One past the last usable byte in head*/
+    size_t chunk_size;          /*Bytes requested from the pool for a new chunk*/
+  };
+
+  /**
+   * Initialize an empty arena. No memory is taken from the pool until the
+   * first call to arena_alloc.
+   *
+   * @param arena The arena to initialize
+   * @param pool The pool the arena takes its chunks from
+   * @param chunk_size Bytes per chunk, best a power of two, 0 selects ARENA_DEFAULT_CHUNK
+   */
+  void arena_init(struct buddy_arena *arena, struct buddy_pool *pool, size_t chunk_size);
+
+  /**
+   * Allocate size bytes aligned for any type. When the current chunk is full
+   * a new one of at least chunk_size bytes is taken from the pool and chained
+   * in front of it.
+   *
+   * If size is zero or the pool is out of memory the return value is NULL
+   * and errno is set by buddy_malloc.
+   *
+   * @param arena The arena to allocate from
+   * @param size The number of bytes requested
+   * @return A pointer to the memory
+   */
+  void *arena_alloc(struct buddy_arena *arena, size_t size);
+
+  /**
+   * Release every object in the arena at once. The first chunk is kept for
+   * the next round, any chunks chained after it go back to the pool, so an
+   * arena that fits in one chunk resets in constant time.
+   *
+   * @param arena The arena to reset
+   */
+  void arena_reset(struct buddy_arena *arena);
+
+  /**
+   * Release every object and return all chunks to the pool. The arena can be
+   * used again afterwards as if it was freshly initialized.
+   *
+   * @param arena The arena to destroy
+   */
+  void arena_destroy(struct buddy_arena *arena);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
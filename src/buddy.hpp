@@ -0,0 +1,261 @@
+#ifndef BUDDY_HPP
+#define BUDDY_HPP
+
+/*
+ * C++ adapters that put standard containers on a buddy pool: a
+ * std::pmr::memory_resource for the pmr containers and a stateful allocator
+ * for the classic ones. Both keep a pointer to the pool, which has to
+ * outlive every container using it and be created with BUDDY_LOCKED when the
+ * containers are shared between threads. ObjectCache wraps the typed object
+ * caches of cache.h.
+ */
+
+#include <cerrno>
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include "lab.h"
+#include "cache.h"
+
+namespace buddy
+{
+  namespace detail
+  {
+    /*
+     * buddy_malloc already returns 8 byte aligned memory, larger alignments
+     * go through buddy_memalign. Containers ask for zero bytes now and then
+     * and expect a unique pointer back, buddy_malloc returns NULL for that.
+     */
+    inline void *allocate(buddy_pool *pool, std::size_t bytes, std::size_t alignment)
+    {
+      if (bytes == 0) bytes = 1;
+      void *mem = alignment <= sizeof(void *) ? buddy_malloc(pool, bytes)
+                                              : buddy_memalign(pool, alignment, bytes);
+      if (mem == nullptr) throw std::bad_alloc();
+      return mem;
+    }
+
+    /*
+     * Every caller knows the size and alignment it allocated with, so the
+     * pool can skip reading the block header. buddy_memalign blocks are
+     * found through their header and take the plain path.
+     */
+    inline void deallocate(buddy_pool *pool, void *ptr, std::size_t bytes, std::size_t alignment) noexcept
+    {
+      if (alignment <= sizeof(void *))
+        buddy_free_sized(pool, ptr, bytes ? bytes : 1);
+      else
+        buddy_free(pool, ptr);
+    }
+  } // namespace detail
+
+  /**
+   * A memory resource handing out blocks of one pool, for
+   * std::pmr::polymorphic_allocator and the std::pmr containers:
+   *
+   *   buddy::buddy_memory_resource res(&pool);
+   *   std::pmr::unordered_map<int, int> map(&res);
+   *
+   * Allocation failure throws std::bad_alloc.
+   */
+  class buddy_memory_resource : public std::pmr::memory_resource
+  {
+  public:
+    /**
+     * Use a pool created by the caller, which stays the owner.
+     *
+     * @param pool The memory pool, must outlive the resource
+     */
+    explicit buddy_memory_resource(buddy_pool *pool) noexcept : pool_(pool), owned_(false) {}
+
+    /**
+     * Create a pool of its own, destroyed with the resource.
+     *
+     * @param size The size of the pool in bytes, see buddy_init_ex
+     * @param flags The buddy_init_ex flags
+     */
+    explicit buddy_memory_resource(std::size_t size, unsigned int flags = 0) : pool_(&own_), owned_(true)
+    {
+      buddy_init_ex(&own_, size, flags);
+    }
+
+    ~buddy_memory_resource() override
+    {
+      if (owned_) buddy_destroy(&own_);
+    }
+
+    buddy_memory_resource(const buddy_memory_resource &) = delete;
+    buddy_memory_resource &operator=(const buddy_memory_resource &) = delete;
+
+    /**
+     * The pool the blocks come from.
+     */
+    buddy_pool *pool() const noexcept { return pool_; }
+
+  protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+      return detail::allocate(pool_, bytes, alignment);
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) override
+    {
+      detail::deallocate(pool_, ptr, bytes, alignment);
+    }
+
+    /*
+     * Two resources on the same pool can free each other's blocks.
+     */
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+      const auto *res = dynamic_cast<const buddy_memory_resource *>(&other);
+      return res != nullptr && res->pool_ == pool_;
+    }
+
+  private:
+    buddy_pool *pool_;
+    bool owned_;
+    buddy_pool own_{};
+  };
+
+  /**
+   * A stateful allocator over one pool for the classic containers. Copies
+   * and rebound copies share the pool, so node based containers allocate
+   * their nodes from it too:
+   *
+   *   std::vector<int, buddy::BuddyAllocator<int>> v{buddy::BuddyAllocator<int>(&pool)};
+   *
+   * The allocator follows its container on copy, move and swap, so a
+   * container never ends up holding blocks of a pool it does not free into.
+   *
+   * @tparam T The element type
+   */
+  template <class T>
+  class BuddyAllocator
+  {
+  public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    template <class U>
+    struct rebind
+    {
+      using other = BuddyAllocator<U>;
+    };
+
+    /**
+     * @param pool The memory pool, must outlive every container using it
+     */
+    explicit BuddyAllocator(buddy_pool *pool) noexcept : pool_(pool) {}
+
+    template <class U>
+    BuddyAllocator(const BuddyAllocator<U> &other) noexcept : pool_(other.pool()) {}
+
+    T *allocate(std::size_t n)
+    {
+      if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+      return static_cast<T *>(detail::allocate(pool_, n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept
+    {
+      detail::deallocate(pool_, ptr, n * sizeof(T), alignof(T));
+    }
+
+    /**
+     * The pool the blocks come from.
+     */
+    buddy_pool *pool() const noexcept { return pool_; }
+
+  private:
+    buddy_pool *pool_;
+  };
+
+  template <class T, class U>
+  bool operator==(const BuddyAllocator<T> &a, const BuddyAllocator<U> &b) noexcept
+  {
+    return a.pool() == b.pool();
+  }
+
+  template <class T, class U>
+  bool operator!=(const BuddyAllocator<T> &a, const BuddyAllocator<U> &b) noexcept
+  {
+    return a.pool() != b.pool();
+  }
+
+  /**
+   * A cache of T objects kept constructed between uses, see buddy_cache_init.
+   * T is default constructed the first time an object is handed out and
+   * destroyed when its slab goes back to the pool, deallocate leaves it
+   * alive for the next allocate, so T must be fit for reuse as it was left:
+   *
+   *   buddy::ObjectCache<connection> conns(&pool, "connection");
+   *   connection *c = conns.allocate();
+   *   conns.deallocate(c);
+   *
+   * Allocation failure, or T's constructor throwing, throws std::bad_alloc.
+   *
+   * @tparam T The object type
+   */
+  template <class T>
+  class ObjectCache
+  {
+  public:
+    /**
+     * @param pool The memory pool, buddy engine only, must outlive the cache
+     * @param name Name of the cache, may be nullptr
+     */
+    explicit ObjectCache(buddy_pool *pool, const char *name = nullptr)
+    {
+      if (buddy_cache_init(&cache_, pool, name, sizeof(T), alignof(T), construct, destroy, nullptr) != 0)
+        throw std::system_error(errno, std::generic_category(), "buddy_cache_init");
+    }
+
+    ~ObjectCache() { buddy_cache_destroy(&cache_); }
+
+    ObjectCache(const ObjectCache &) = delete;
+    ObjectCache &operator=(const ObjectCache &) = delete;
+
+    T *allocate()
+    {
+      void *obj = buddy_cache_alloc(&cache_);
+      if (obj == nullptr) throw std::bad_alloc();
+      return static_cast<T *>(obj);
+    }
+
+    void deallocate(T *obj) noexcept { buddy_cache_free(&cache_, obj); }
+
+    /**
+     * Destroy the cached objects of idle slabs and give them back to the pool.
+     */
+    std::size_t reap() noexcept { return buddy_cache_reap(&cache_); }
+
+    struct buddy_cache_stats stats() const noexcept { return cache_.stats; }
+
+  private:
+    //Exceptions must not cross the C code
+    static int construct(void *obj, void *) noexcept
+    {
+      try {
+        new (obj) T();
+        return 0;
+      } catch (...) {
+        return -1;
+      }
+    }
+
+    static void destroy(void *obj, void *) noexcept { static_cast<T *>(obj)->~T(); }
+
+    buddy_cache cache_;
+  };
+} // namespace buddy
+
+#endif
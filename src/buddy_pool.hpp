@@ -0,0 +1,308 @@
+#ifndef BUDDY_POOL_HPP
+#define BUDDY_POOL_HPP
+
+/*
+ * A buddy pool whose geometry is fixed at compile time, for small pools
+ * embedded in other objects. The storage lives inside the object, the order
+ * of a request comes from a constexpr table and the search, split and merge
+ * paths are unrolled over the orders the pool actually has, so there is no
+ * kval_m to load and no avail[MAX_K] array to walk. It is not thread safe,
+ * one pool per owner is the intended use.
+ */
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace buddy
+{
+  /**
+   * Header policies of BuddyPool, deciding where the order of a block is kept.
+   */
+
+  /**
+   * A 16 byte header at the start of every block, as buddy_malloc does with
+   * struct avail. Costs 16 bytes per block, the pool itself stays the size
+   * of its storage. User pointers are 16 byte aligned.
+   */
+  struct InlineHeader
+  {
+    static constexpr std::size_t overhead = 16;
+    static constexpr bool side_table = false;
+  };
+
+  /**
+   * No header, one byte per smallest block in a table next to the storage.
+   * A 2^k request takes exactly a 2^k block and the pointer is aligned to
+   * the block size within the storage, at the price of 2^(MaxK-MinK) bytes
+   * of table.
+   */
+  struct SideTable
+  {
+    static constexpr std::size_t overhead = 0;
+    static constexpr bool side_table = true;
+  };
+
+  /**
+   * A buddy pool of 2^MaxK bytes handing out blocks of 2^MinK to 2^MaxK bytes.
+   *
+   *   struct connection {
+   *     buddy::BuddyPool<16, 6> scratch;   //64KiB of scratch memory, inline
+   *   };
+   *   void *p = conn.scratch.allocate(200);
+   *   conn.scratch.deallocate(p);
+   *
+   * @tparam MaxK Order of the pool
+   * @tparam MinK Order of the smallest block
+   * @tparam HeaderPolicy InlineHeader or SideTable
+   */
+  template <unsigned MaxK, unsigned MinK = 6, class HeaderPolicy = InlineHeader>
+  class BuddyPool
+  {
+    static_assert(MinK <= MaxK && MaxK < 8 * sizeof(std::size_t) - 1, "bad pool orders");
+    static_assert(MaxK - MinK < 64, "one mask bit per order");
+
+    static constexpr std::size_t kOverhead = HeaderPolicy::overhead;
+    static constexpr unsigned kLevels = MaxK - MinK + 1;
+
+    struct node
+    {
+      node *next;
+      node *prev;
+    };
+
+    //A free block needs room for its header and its list links
+    static_assert((std::size_t(1) << MinK) >= kOverhead + sizeof(node), "MinK too small for the header policy");
+
+    static constexpr std::uint8_t kFree = 0x80;
+
+    /*
+     * Orders of requests up to 2^kTableBits smallest blocks come from the
+     * table, indexed by the number of smallest blocks the request covers.
+     */
+    static constexpr unsigned kTableBits = kLevels - 1 < 8 ? kLevels - 1 : 8;
+
+    static constexpr std::array<std::uint8_t, (std::size_t(1) << kTableBits)> make_order_table()
+    {
+      std::array<std::uint8_t, (std::size_t(1) << kTableBits)> table{};
+      for (std::size_t i = 0; i < table.size(); i++)
+      {
+        unsigned k = 0;
+        while ((std::size_t(1) << k) < i + 1)
+          k++;
+        table[i] = static_cast<std::uint8_t>(MinK + k);
+      }
+      return table;
+    }
+
+    static constexpr std::array<std::uint8_t, (std::size_t(1) << kTableBits)> kOrderTable = make_order_table();
+
+  public:
+    /**
+     * Largest request the pool can serve.
+     */
+    static constexpr std::size_t max_size = (std::size_t(1) << MaxK) - kOverhead;
+
+    /**
+     * Order of the block a request of size bytes takes, size between 1 and max_size.
+     */
+    static constexpr unsigned order_for(std::size_t size) noexcept
+    {
+      std::size_t blocks = (size + kOverhead - 1) >> MinK;
+      if (blocks < kOrderTable.size()) return kOrderTable[blocks];
+      unsigned k = 8 * sizeof(std::size_t) - static_cast<unsigned>(__builtin_clzll(blocks));
+      return MinK + k;
+    }
+
+    BuddyPool() noexcept { reset(); }
+
+    BuddyPool(const BuddyPool &) = delete;
+    BuddyPool &operator=(const BuddyPool &) = delete;
+
+    /**
+     * Drop every block at once, the whole storage becomes one free block.
+     */
+    void reset() noexcept
+    {
+      for (unsigned i = 0; i < kLevels; i++)
+        head_[i] = nullptr;
+      mask_ = 0;
+      push(storage_, MaxK);
+      bytes_free_ = std::size_t(1) << MaxK;
+    }
+
+    /**
+     * Allocate size bytes.
+     *
+     * @return The memory, nullptr if size is 0 or no block is large enough
+     */
+    void *allocate(std::size_t size) noexcept
+    {
+      if (size == 0 || size > max_size) return nullptr;
+      unsigned k = order_for(size);
+      std::uint64_t fit = mask_ & (~std::uint64_t(0) << (k - MinK));
+      if (fit == 0) return nullptr;
+      unsigned found = MinK + static_cast<unsigned>(__builtin_ctzll(fit));
+
+      unsigned char *block = pop(found);
+      split(block, found, k, std::make_index_sequence<kLevels - 1>());
+      mark(block, k, false);
+      bytes_free_ -= std::size_t(1) << k;
+      return block + kOverhead;
+    }
+
+    /**
+     * Give a block back, merging it with its free buddies.
+     *
+     * @param ptr Memory returned by allocate on this pool, may be nullptr
+     */
+    void deallocate(void *ptr) noexcept
+    {
+      if (ptr == nullptr) return;
+      unsigned char *block = static_cast<unsigned char *>(ptr) - kOverhead;
+      unsigned k = order_of(block);
+      bytes_free_ += std::size_t(1) << k;
+      merge(block, k, std::make_index_sequence<kLevels - 1>());
+      push(block, k);
+    }
+
+    /**
+     * Bytes of the block behind ptr the caller may use.
+     */
+    std::size_t usable_size(const void *ptr) const noexcept
+    {
+      const unsigned char *block = static_cast<const unsigned char *>(ptr) - kOverhead;
+      return (std::size_t(1) << order_of(block)) - kOverhead;
+    }
+
+    /**
+     * Whether ptr points into the pool's storage.
+     */
+    bool owns(const void *ptr) const noexcept
+    {
+      const unsigned char *p = static_cast<const unsigned char *>(ptr);
+      return p >= storage_ && p < storage_ + sizeof(storage_);
+    }
+
+    /**
+     * Bytes in free blocks.
+     */
+    std::size_t bytes_free() const noexcept { return bytes_free_; }
+
+    /**
+     * Size of the storage, 2^MaxK.
+     */
+    static constexpr std::size_t capacity() noexcept { return std::size_t(1) << MaxK; }
+
+  private:
+    /*
+     * The state of a block head: its order, with kFree while it is on a list.
+     * Only heads are ever read, the buddy of a block of order k is always the
+     * head of a block of order k or of a smaller one.
+     */
+    void mark(unsigned char *block, unsigned k, bool free) noexcept
+    {
+      std::uint8_t state = static_cast<std::uint8_t>(k | (free ? kFree : 0));
+      if constexpr (HeaderPolicy::side_table)
+        table_[static_cast<std::size_t>(block - storage_) >> MinK] = state;
+      else
+        *block = state;
+    }
+
+    std::uint8_t state_of(const unsigned char *block) const noexcept
+    {
+      if constexpr (HeaderPolicy::side_table)
+        return table_[static_cast<std::size_t>(block - storage_) >> MinK];
+      else
+        return *block;
+    }
+
+    unsigned order_of(const unsigned char *block) const noexcept
+    {
+      return state_of(block) & static_cast<std::uint8_t>(~kFree);
+    }
+
+    node *links(unsigned char *block) noexcept
+    {
+      return reinterpret_cast<node *>(block + kOverhead);
+    }
+
+    void push(unsigned char *block, unsigned k) noexcept
+    {
+      mark(block, k, true);
+      node *n = links(block);
+      node *&head = head_[k - MinK];
+      n->prev = nullptr;
+      n->next = head;
+      if (head) head->prev = n;
+      head = n;
+      mask_ |= std::uint64_t(1) << (k - MinK);
+    }
+
+    void unlink(unsigned char *block, unsigned k) noexcept
+    {
+      node *n = links(block);
+      if (n->prev)
+        n->prev->next = n->next;
+      else
+        head_[k - MinK] = n->next;
+      if (n->next) n->next->prev = n->prev;
+      if (head_[k - MinK] == nullptr) mask_ &= ~(std::uint64_t(1) << (k - MinK));
+    }
+
+    unsigned char *pop(unsigned k) noexcept
+    {
+      unsigned char *block = reinterpret_cast<unsigned char *>(head_[k - MinK]) - kOverhead;
+      unlink(block, k);
+      return block;
+    }
+
+    /*
+     * One step of a split: the block of order from is halved down to order
+     * to, step J puts the upper half of order J on its list when J is on
+     * the way. The steps are expanded for every order of the pool.
+     */
+    template <unsigned J>
+    void split_step(unsigned char *block, unsigned from, unsigned to) noexcept
+    {
+      if (J < from && J >= to) push(block + (std::size_t(1) << J), J);
+    }
+
+    template <std::size_t... I>
+    void split(unsigned char *block, unsigned from, unsigned to, std::index_sequence<I...>) noexcept
+    {
+      (split_step<MaxK - 1 - static_cast<unsigned>(I)>(block, from, to), ...);
+    }
+
+    /*
+     * One step of a merge at order J, false once the buddy is taken.
+     */
+    template <unsigned J>
+    bool merge_step(unsigned char *&block, unsigned &k) noexcept
+    {
+      if (J < k) return true;
+      unsigned char *buddy = storage_ + (static_cast<std::size_t>(block - storage_) ^ (std::size_t(1) << J));
+      if (state_of(buddy) != (J | kFree)) return false;
+      unlink(buddy, J);
+      if (buddy < block) block = buddy;
+      k = J + 1;
+      return true;
+    }
+
+    template <std::size_t... I>
+    void merge(unsigned char *&block, unsigned &k, std::index_sequence<I...>) noexcept
+    {
+      bool merging = true;
+      ((merging = merging && merge_step<MinK + static_cast<unsigned>(I)>(block, k)), ...);
+    }
+
+    alignas(64) unsigned char storage_[std::size_t(1) << MaxK];
+    std::array<std::uint8_t, HeaderPolicy::side_table ? (std::size_t(1) << (MaxK - MinK)) : 1> table_;
+    node *head_[kLevels];
+    std::uint64_t mask_;
+    std::size_t bytes_free_;
+  };
+} // namespace buddy
+
+#endif
@@ -0,0 +1,234 @@
+/**
+ * @file cache.c
+ * @brief   Object caches on buddy slabs. A slab is one buddy block of a fixed
+ *          order, so the slab of an object is found by masking its offset in
+ *          the pool, and its objects stay constructed while they sit on the
+ *          slab's free list.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "cache.h"
+
+#define CACHE_MAX_ALIGN 4096
+
+/**
+ * Header at the start of a slab, in front of its objects.
+ */
+struct cache_slab
+{
+    struct cache_slab *next;
+    struct cache_slab *prev;
+    struct cache_slab **list;   /*Head of the list the slab is on*/
+    void *free;                 /*Constructed objects not in use*/
+    size_t in_use;              /*Objects handed out*/
+    size_t fresh;               /*Objects below this index have been constructed*/
+};
+
+static inline size_t align_up(size_t n, size_t align)
+{
+    return (n + align - 1) & ~(align - 1);
+}
+
+static inline char *slab_object(struct buddy_cache *cache, struct cache_slab *slab, size_t i)
+{
+    return (char *)slab + cache->first + i * cache->stride;
+}
+
+/**
+ * @brief The free list link sits right behind the object.
+ */
+static inline void **object_link(struct buddy_cache *cache, void *obj)
+{
+    return (void **)((char *)obj + align_up(cache->size, sizeof(void *)));
+}
+
+/**
+ * @brief Slabs are buddy blocks of order slab_k, which start at a multiple
+ * of their size from the pool base.
+ */
+static inline struct cache_slab *slab_of(struct buddy_cache *cache, void *obj)
+{
+    char *base = cache->pool->base;
+    size_t off = (size_t)((char *)obj - base) & ~((UINT64_C(1) << cache->slab_k) - 1);
+    return (struct cache_slab *)(base + off + sizeof(struct avail));
+}
+
+static void list_remove(struct cache_slab *slab)
+{
+    if (slab->prev) slab->prev->next = slab->next;
+    else *slab->list = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+static void list_push(struct cache_slab **list, struct cache_slab *slab)
+{
+    slab->list = list;
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static inline void list_move(struct cache_slab **list, struct cache_slab *slab)
+{
+    list_remove(slab);
+    list_push(list, slab);
+}
+
+int buddy_cache_init(struct buddy_cache *cache, struct buddy_pool *pool, const char *name, size_t size,
+                     size_t align, buddy_cache_ctor ctor, buddy_cache_dtor dtor, void *arg)
+{
+    if (align == 0) align = _Alignof(max_align_t);
+    if (cache == NULL || pool == NULL || size == 0 || size > pool->numbytes ||
+        (align & (align - 1)) || align > CACHE_MAX_ALIGN ||
+        (pool->flags & BUDDY_ENGINE_MASK) != BUDDY_ENGINE_BUDDY) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(cache, 0, sizeof(*cache));
+    cache->pool = pool;
+    cache->name = name;
+    cache->size = size;
+    cache->align = align < sizeof(void *) ? sizeof(void *) : align;
+    cache->stride = align_up(align_up(size, sizeof(void *)) + sizeof(void *), cache->align);
+    //The pool's block header and ours come first, the objects are aligned
+    //from the block start, which the pool base and the order keep aligned
+    cache->first = align_up(sizeof(struct avail) + sizeof(struct cache_slab), cache->align) - sizeof(struct avail);
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->arg = arg;
+
+    size_t k = CACHE_MIN_SLAB_K;
+    while (k <= pool->kval_m &&
+           ((UINT64_C(1) << k) - sizeof(struct avail) - cache->first) / cache->stride < CACHE_MIN_OBJECTS)
+        k++;
+    if (k > pool->kval_m) {
+        errno = EINVAL;
+        return -1;
+    }
+    cache->slab_k = k;
+    cache->per_slab = ((UINT64_C(1) << k) - sizeof(struct avail) - cache->first) / cache->stride;
+    return 0;
+}
+
+/**
+ * @brief Take a slab from the pool, its objects are constructed on demand.
+ */
+static struct cache_slab *slab_create(struct buddy_cache *cache)
+{
+    struct cache_slab *slab = buddy_malloc(cache->pool, (UINT64_C(1) << cache->slab_k) - sizeof(struct avail));
+    if (slab == NULL) return NULL;
+    slab->free = NULL;
+    slab->in_use = 0;
+    slab->fresh = 0;
+    list_push(&cache->empty, slab);
+    cache->stats.slabs++;
+    cache->stats.objects += cache->per_slab;
+    cache->stats.slab_allocs++;
+    return slab;
+}
+
+/**
+ * @brief Destroy the constructed objects of a slab with none in use and
+ * give it back to the pool.
+ */
+static void slab_destroy(struct buddy_cache *cache, struct cache_slab *slab)
+{
+    if (cache->dtor) {
+        for (void *obj = slab->free; obj; obj = *object_link(cache, obj))
+            cache->dtor(obj, cache->arg);
+        cache->stats.dtor_calls += slab->fresh - slab->in_use;
+    }
+    cache->stats.constructed -= slab->fresh;
+    cache->stats.in_use -= slab->in_use;
+    cache->stats.slabs--;
+    cache->stats.objects -= cache->per_slab;
+    cache->stats.slab_frees++;
+    list_remove(slab);
+    buddy_free(cache->pool, slab);
+}
+
+void *buddy_cache_alloc(struct buddy_cache *cache)
+{
+    //Fill partial slabs first so empty ones can be reaped
+    struct cache_slab *slab = cache->partial ? cache->partial : cache->empty;
+    if (slab == NULL && (slab = slab_create(cache)) == NULL) {
+        cache->stats.failed_allocs++;
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *obj = slab->free;
+    if (obj) {
+        slab->free = *object_link(cache, obj);
+    } else {
+        obj = slab_object(cache, slab, slab->fresh);
+        if (cache->ctor) {
+            cache->stats.ctor_calls++;
+            if (cache->ctor(obj, cache->arg) != 0) {
+                cache->stats.failed_allocs++;
+                errno = ECANCELED;
+                return NULL;
+            }
+        }
+        slab->fresh++;
+        cache->stats.constructed++;
+    }
+
+    slab->in_use++;
+    if (slab->in_use == cache->per_slab) list_move(&cache->full, slab);
+    else if (slab->list == &cache->empty) list_move(&cache->partial, slab);
+    cache->stats.in_use++;
+    cache->stats.allocs++;
+    return obj;
+}
+
+void buddy_cache_free(struct buddy_cache *cache, void *obj)
+{
+    if (obj == NULL) return;
+    struct cache_slab *slab = slab_of(cache, obj);
+    *object_link(cache, obj) = slab->free;
+    slab->free = obj;
+
+    slab->in_use--;
+    if (slab->in_use == 0) list_move(&cache->empty, slab);
+    else if (slab->list == &cache->full) list_move(&cache->partial, slab);
+    cache->stats.in_use--;
+    cache->stats.frees++;
+}
+
+size_t buddy_cache_reap(struct buddy_cache *cache)
+{
+    size_t released = 0;
+    while (cache->empty)
+    {
+        slab_destroy(cache, cache->empty);
+        released++;
+    }
+    return released;
+}
+
+int buddy_cache_stats(struct buddy_cache *cache, struct buddy_cache_stats *out)
+{
+    if (cache == NULL || out == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    *out = cache->stats;
+    return 0;
+}
+
+void buddy_cache_destroy(struct buddy_cache *cache)
+{
+    buddy_cache_reap(cache);
+    while (cache->partial)
+        slab_destroy(cache, cache->partial);
+    while (cache->full)
+        slab_destroy(cache, cache->full);
+}
@@ -0,0 +1,145 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * The smallest slab a cache takes from its pool, as the order of the buddy
+   * block. A slab holds at least CACHE_MIN_OBJECTS objects, larger objects
+   * get larger slabs.
+   */
+#define CACHE_MIN_SLAB_K 12
+#define CACHE_MIN_OBJECTS 8
+
+  /**
+   * Constructor and destructor of the cached objects. The constructor runs
+   * once when an object is first handed out and returns 0, or nonzero if it
+   * failed and the allocation fails with it. The destructor runs when the
+   * slab holding the object goes back to the pool.
+   */
+  typedef int (*buddy_cache_ctor)(void *obj, void *arg);
+  typedef void (*buddy_cache_dtor)(void *obj, void *arg);
+
+  /**
+   * Counters of a cache, see buddy_cache_stats.
+   */
+  struct buddy_cache_stats
+  {
+    size_t slabs;               /*Slabs held*/
+    size_t objects;             /*Objects the slabs have room for*/
+    size_t in_use;              /*Objects handed out*/
+    size_t constructed;         /*Objects in the constructed state, in use or cached*/
+    size_t allocs;              /*Successful buddy_cache_alloc calls*/
+    size_t frees;               /*buddy_cache_free calls*/
+    size_t ctor_calls;          /*Constructor runs, allocs minus the ones served constructed*/
+    size_t dtor_calls;          /*Destructor runs*/
+    size_t slab_allocs;         /*Slabs taken from the pool*/
+    size_t slab_frees;          /*Slabs given back to the pool*/
+    size_t failed_allocs;       /*buddy_cache_alloc calls that returned NULL*/
+  };
+
+  struct cache_slab;
+
+  /**
+   * A cache of objects of one type kept constructed between uses, after
+   * Bonwick's slab allocator. Each slab is one buddy block, its objects are
+   * constructed the first time they are handed out and freed objects keep
+   * their constructed state, so the next allocation skips the constructor.
+   * The free list link lives behind each object and never touches it.
+   *
+   * A cache is not thread safe, the pool may be shared through BUDDY_LOCKED.
+   */
+  struct buddy_cache
+  {
+    struct buddy_pool *pool;    /*The pool the slabs come from*/
+    const char *name;           /*For reports, not copied*/
+    size_t size;                /*Object size*/
+    size_t align;               /*Object alignment*/
+    size_t stride;              /*Distance between objects, object plus link rounded up to align*/
+    size_t slab_k;              /*Order of the buddy block of a slab*/
+    size_t per_slab;            /*Objects per slab*/
+    size_t first;               /*Offset of the first object from the slab header*/
+    buddy_cache_ctor ctor;      /*May be NULL*/
+    buddy_cache_dtor dtor;      /*May be NULL*/
+    void *arg;                  /*Passed to ctor and dtor*/
+    struct cache_slab *partial; /*Slabs with objects both in use and free*/
+    struct cache_slab *full;    /*Slabs with every object in use*/
+    struct cache_slab *empty;   /*Slabs with no object in use, kept until buddy_cache_reap*/
+    struct buddy_cache_stats stats;
+  };
+
+  /**
+   * Initialize a cache of objects of size bytes.
+   *
+   * @param cache The cache to initialize
+   * @param pool The pool the slabs come from, it must use the buddy engine
+   *             because a slab is found from an object by its block order
+   * @param name Name of the cache, may be NULL
+   * @param size Object size, not 0
+   * @param align Object alignment, a power of two up to 4096, 0 for max_align_t
+   * @param ctor Constructor, may be NULL
+   * @param dtor Destructor, may be NULL
+   * @param arg Passed to ctor and dtor
+   * @return 0 on success, -1 with errno set to EINVAL for a bad argument or a
+   *         pool that does not use the buddy engine
+   */
+  int buddy_cache_init(struct buddy_cache *cache, struct buddy_pool *pool, const char *name, size_t size,
+                       size_t align, buddy_cache_ctor ctor, buddy_cache_dtor dtor, void *arg);
+
+  /**
+   * Hand out a constructed object. A cached object is returned as it was
+   * freed, otherwise a fresh one is constructed, from a new slab if needed.
+   *
+   * @param cache The cache
+   * @return The object, NULL with errno set to ENOMEM if the pool is out of
+   *         memory or to ECANCELED if the constructor failed
+   */
+  void *buddy_cache_alloc(struct buddy_cache *cache);
+
+  /**
+   * Give an object back, still constructed. Its slab is found from its
+   * address, the object carries no header.
+   *
+   * @param cache The cache the object came from
+   * @param obj The object, may be NULL
+   */
+  void buddy_cache_free(struct buddy_cache *cache, void *obj);
+
+  /**
+   * Destroy the objects of the slabs that have none in use and give those
+   * slabs back to the pool.
+   *
+   * @param cache The cache
+   * @return The number of slabs released
+   */
+  size_t buddy_cache_reap(struct buddy_cache *cache);
+
+  /**
+   * Copy the counters of the cache into out.
+   *
+   * @param cache The cache
+   * @param out Where to store the counters
+   * @return 0 on success, -1 with errno set to EINVAL if an argument is NULL
+   */
+  int buddy_cache_stats(struct buddy_cache *cache, struct buddy_cache_stats *out);
+
+  /**
+   * Destroy every cached object and give all slabs back to the pool. Objects
+   * still in use are released without their destructor. The cache can be
+   * initialized again afterwards.
+   *
+   * @param cache The cache
+   */
+  void buddy_cache_destroy(struct buddy_cache *cache);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
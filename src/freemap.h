@@ -0,0 +1,88 @@
+#ifndef FREEMAP_H
+#define FREEMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bitmap trees behind the pool freemap, also used by tools/simulate.c to
+ * model the same placement. One tree indexes the 2^n blocks of an order:
+ * level 0 holds the block bits and each word of level l+1 says which words
+ * of level l are non-zero, so the first set bit is found with one ctz per
+ * level. The levels are stored one after the other, level 0 first.
+ */
+
+/**
+ * Number of words in level lvl of a tree over 2^n bits.
+ */
+static inline size_t freemap_words(size_t n, size_t lvl)
+{
+    size_t shift = 6 * (lvl + 1);
+    return n > shift ? (UINT64_C(1) << (n - shift)) : 1;
+}
+
+/**
+ * Number of levels needed to index 2^n bits.
+ */
+static inline size_t freemap_levels(size_t n)
+{
+    return n <= 6 ? 1 : (n + 5) / 6;
+}
+
+static inline void freemap_tree_set(uint64_t *tree, size_t n, size_t idx)
+{
+    uint64_t *lvl = tree;
+    for (size_t l = 0; l < freemap_levels(n); l++)
+    {
+        uint64_t *word = &lvl[idx >> 6];
+        uint64_t was = *word;
+        *word = was | (UINT64_C(1) << (idx & 63));
+        if (was) break; // upper levels already know this word is non-zero
+        lvl += freemap_words(n, l);
+        idx >>= 6;
+    }
+}
+
+static inline void freemap_tree_clear(uint64_t *tree, size_t n, size_t idx)
+{
+    uint64_t *lvl = tree;
+    for (size_t l = 0; l < freemap_levels(n); l++)
+    {
+        uint64_t *word = &lvl[idx >> 6];
+        *word &= ~(UINT64_C(1) << (idx & 63));
+        if (*word) break; // word still has bits set, upper levels stay set
+        lvl += freemap_words(n, l);
+        idx >>= 6;
+    }
+}
+
+static inline bool freemap_tree_test(const uint64_t *tree, size_t idx)
+{
+    return (tree[idx >> 6] >> (idx & 63)) & 1;
+}
+
+/**
+ * Lowest set bit of a tree over 2^n bits, SIZE_MAX if there is none.
+ */
+static inline size_t freemap_tree_first(const uint64_t *tree, size_t n)
+{
+    size_t levels = freemap_levels(n);
+    const uint64_t *lvl[8];
+    for (size_t l = 0; l < levels; l++)
+    {
+        lvl[l] = tree;
+        tree += freemap_words(n, l);
+    }
+
+    size_t idx = 0;
+    for (size_t l = levels; l-- > 0;)
+    {
+        uint64_t word = lvl[l][idx];
+        if (word == 0) return SIZE_MAX;
+        idx = (idx << 6) | (size_t)__builtin_ctzll(word);
+    }
+    return idx;
+}
+
+#endif
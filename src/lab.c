@@ -17,12 +17,28 @@
 #include <execinfo.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
 #include <errno.h>
 #endif
 #include "lab.h"
+#include "tlsf.h"
+#include "nbbs.h"
+#include "percpu.h"
+#include "profile.h"
+#include "trace.h"
+#include "registry.h"
+#include "freemap.h"
+#include "clock.h"
+#include "pool_lock.h"
+
+#ifdef BUDDY_HISTOGRAMS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
 
 #define handle_error_and_die(msg) \
     do                            \
@@ -75,19 +91,339 @@ struct avail *buddy_calc(struct buddy_pool *pool, struct avail *buddy)
     return buddyPtr;
 }
 
+/*
+ * The freemap keeps one bit per possible block of each order, set while that
+ * block sits on an avail list. Every order is a bitmap tree (freemap.h)
+ * starting at freemap_off[k].
+ */
+
+static inline void freemap_set(struct buddy_pool *pool, size_t k, size_t idx)
+{
+    freemap_tree_set(pool->freemap + pool->freemap_off[k], pool->kval_m - k, idx);
+}
+
+static inline void freemap_clear(struct buddy_pool *pool, size_t k, size_t idx)
+{
+    freemap_tree_clear(pool->freemap + pool->freemap_off[k], pool->kval_m - k, idx);
+}
+
+static inline bool freemap_test(struct buddy_pool *pool, size_t k, size_t idx)
+{
+    return freemap_tree_test(pool->freemap + pool->freemap_off[k], idx);
+}
+
 /**
- * @brief Allocate a block of memory from the buddy pool.
+ * @brief Find the lowest free block of order k
+ *
+ * @return The index of the block or SIZE_MAX if there is none
+ */
+static inline size_t freemap_first(struct buddy_pool *pool, size_t k)
+{
+    return freemap_tree_first(pool->freemap + pool->freemap_off[k], pool->kval_m - k);
+}
+
+/**
+ * @brief Index of a block within its order, used as the freemap bit number
+ */
+static inline size_t block_index(struct buddy_pool *pool, struct avail *block, size_t k)
+{
+    return (size_t)((char *)block - (char *)pool->base) >> k;
+}
+
+/**
+ * @brief Link a free block at the front or the back of the avail list for its kval.
+ */
+static void avail_link(struct buddy_pool *pool, struct avail *block, bool front)
+{
+    size_t k = block->kval;
+    struct avail *list_head = &pool->avail[k];
+    block->tag = BLOCK_AVAIL;
+
+    if (front)
+    {
+        block->next = list_head->next;
+        block->prev = list_head;
+    }
+    else
+    {
+        block->next = list_head;
+        block->prev = list_head->prev;
+    }
+    block->next->prev = block;
+    block->prev->next = block;
+
+    if (pool->freemap) freemap_set(pool, k, block_index(pool, block, k));
+    pool->stats.free_blocks[k]++;
+}
+
+/**
+ * @brief Put a free block on the avail list for its kval.
+ *
+ * Under BUDDY_POLICY_BUDDY_BUSY a block whose buddy is reserved as a whole goes
+ * to the front of the list and every other block to the back. With eager
+ * coalescing a free block's buddy can only become free again by merging with
+ * it, so the decision made here stays correct while the block is on the list.
+ */
+static void avail_push(struct buddy_pool *pool, struct avail *block)
+{
+    size_t k = block->kval;
+    bool front = true;
+    if ((pool->flags & BUDDY_POLICY_MASK) == BUDDY_POLICY_BUDDY_BUSY && k < pool->kval_m)
+    {
+        struct avail *buddy = buddy_calc(pool, block);
+        front = buddy->tag == BLOCK_RESERVED && buddy->kval == k;
+    }
+    avail_link(pool, block, front);
+}
+
+/**
+ * @brief Unlink a free block from its avail list.
+ */
+static void avail_remove(struct buddy_pool *pool, struct avail *block)
+{
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    if (pool->freemap) freemap_clear(pool, block->kval, block_index(pool, block, block->kval));
+    pool->stats.free_blocks[block->kval]--;
+}
+
+/**
+ * @brief Take the block the placement policy prefers off a non-empty list.
+ */
+static struct avail *avail_pop(struct buddy_pool *pool, size_t k)
+{
+    struct avail *block = pool->avail[k].next;
+    if ((pool->flags & BUDDY_POLICY_MASK) == BUDDY_POLICY_ADDRESS)
+    {
+        size_t idx = freemap_first(pool, k);
+        block = (struct avail *)((char *)pool->base + (idx << k));
+    }
+    avail_remove(pool, block);
+    return block;
+}
+
+/**
+ * @brief Walk the pieces a trimmed block of order k keeps for span bytes.
+ *
+ * Halving the block either frees the upper half (the rest fits in the lower
+ * one) or keeps the lower half as a whole piece and continues in the upper
+ * half. Each kept piece is passed to keep and each released one to drop.
+ *
+ * @return The number of times the block was halved
+ */
+static size_t trim_walk(struct buddy_pool *pool, struct avail *block, size_t k, size_t span,
+                      void (*keep)(struct buddy_pool *, struct avail *, size_t),
+                      void (*drop)(struct buddy_pool *, struct avail *, size_t))
+{
+    char *at = (char *)block;
+    size_t halvings = 0;
+    while (span < (UINT64_C(1) << k))
+    {
+        halvings++;
+        size_t half = UINT64_C(1) << --k;
+        if (span <= half)
+        {
+            if (drop) drop(pool, (struct avail *)(at + half), k);
+        }
+        else
+        {
+            if (keep) keep(pool, (struct avail *)at, k);
+            at += half;
+            span -= half;
+        }
+    }
+    if (keep) keep(pool, (struct avail *)at, k);
+    return halvings;
+}
+
+/**
+ * @brief Queue a trimmed tail piece at the back of its list so it is handed
+ * out last and has a chance to merge again when the block is freed.
+ */
+static void trim_drop(struct buddy_pool *pool, struct avail *piece, size_t k)
+{
+    piece->kval = k;
+    avail_link(pool, piece, false);
+}
+
+/**
+ * @brief Hand the tail of a freshly reserved block back to the free lists.
+ *
+ * The header keeps the kval of the whole block and the number of bytes kept,
+ * buddy_free walks the same pieces again to release them.
+ *
+ * @param pool The memory pool
+ * @param block The reserved block
+ * @param bytes The bytes needed including the header
+ */
+static void block_trim(struct buddy_pool *pool, struct avail *block, size_t bytes)
+{
+    size_t unit = UINT64_C(1) << SMALLEST_K;
+    size_t span = (bytes + unit - 1) & ~(unit - 1);
+    block->span = span;
+    pool->stats.splits += trim_walk(pool, block, block->kval, span, NULL, trim_drop);
+}
+
+/**
+ * @brief Account for a block handed to the user.
+ */
+static inline void stats_reserve(struct buddy_pool *pool, size_t granted, size_t requested)
+{
+    struct buddy_stats *st = &pool->stats;
+    st->allocs++;
+    st->bytes_reserved += granted;
+    st->bytes_requested += requested;
+    if (st->bytes_reserved > st->peak_reserved) st->peak_reserved = st->bytes_reserved;
+}
+
+/**
+ * @brief Account for a block coming back from the user.
+ */
+static inline void stats_release(struct buddy_pool *pool, size_t granted, size_t requested)
+{
+    struct buddy_stats *st = &pool->stats;
+    st->frees++;
+    st->bytes_reserved -= granted;
+    st->bytes_requested -= requested;
+}
+
+/*
+ * The NBBS engine runs without the pool lock, its counters are updated with
+ * atomic adds instead.
+ */
+static inline void stats_reserve_shared(struct buddy_pool *pool, size_t granted)
+{
+    struct buddy_stats *st = &pool->stats;
+    __atomic_fetch_add(&st->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->bytes_requested, granted, __ATOMIC_RELAXED);
+    size_t reserved = __atomic_add_fetch(&st->bytes_reserved, granted, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&st->peak_reserved, __ATOMIC_RELAXED);
+    while (reserved > peak &&
+           !__atomic_compare_exchange_n(&st->peak_reserved, &peak, reserved, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static inline void stats_release_shared(struct buddy_pool *pool, size_t granted)
+{
+    struct buddy_stats *st = &pool->stats;
+    __atomic_fetch_add(&st->frees, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&st->bytes_reserved, granted, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&st->bytes_requested, granted, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Histogram bucket for a value, exact below 2^BUDDY_HIST_SUB_BITS and
+ * log-linear above.
+ */
+static inline unsigned hist_bucket(uint64_t v)
+{
+    if (v < (UINT64_C(1) << BUDDY_HIST_SUB_BITS)) return (unsigned)v;
+    unsigned msb = 63 - (unsigned)__builtin_clzll(v);
+    unsigned sub = (unsigned)(v >> (msb - BUDDY_HIST_SUB_BITS)) & ((1u << BUDDY_HIST_SUB_BITS) - 1);
+    return ((msb - BUDDY_HIST_SUB_BITS + 1) << BUDDY_HIST_SUB_BITS) | sub;
+}
+
+/**
+ * @brief Largest value that lands in a histogram bucket.
+ */
+static inline uint64_t hist_bucket_upper(unsigned idx)
+{
+    if (idx < (1u << BUDDY_HIST_SUB_BITS)) return idx;
+    unsigned msb = (idx >> BUDDY_HIST_SUB_BITS) + BUDDY_HIST_SUB_BITS - 1;
+    uint64_t sub = idx & ((1u << BUDDY_HIST_SUB_BITS) - 1);
+    uint64_t width = UINT64_C(1) << (msb - BUDDY_HIST_SUB_BITS);
+    return (UINT64_C(1) << msb) + sub * width + (width - 1);
+}
+
+#ifdef BUDDY_HISTOGRAMS
+/**
+ * @brief Cheapest monotonic tick source available, the TSC on x86.
+ */
+static inline uint64_t hist_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return now_ns();
+#endif
+}
+
+static inline void hist_add(struct buddy_histogram *h, uint64_t v)
+{
+    h->count[hist_bucket(v)]++;
+    h->total++;
+    if (v > h->max) h->max = v;
+}
+
+static inline void hist_record(struct buddy_histogram *by_order, struct buddy_histogram *by_steps,
+                               size_t order, size_t steps, uint64_t ticks)
+{
+    hist_add(&by_order[order < MAX_K ? order : MAX_K - 1], ticks);
+    hist_add(&by_steps[steps < MAX_K ? steps : MAX_K - 1], ticks);
+}
+
+#define HIST_START_MALLOC(pool) \
+    uint64_t hist_t0 = hist_ticks(); \
+    size_t hist_splits0 = (pool)->stats.splits
+#define HIST_START_FREE(pool) \
+    uint64_t hist_t0 = hist_ticks(); \
+    size_t hist_merges0 = (pool)->stats.merges
+#define HIST_MALLOC(pool, order) \
+    hist_record((pool)->hist->malloc_by_order, (pool)->hist->malloc_by_steps, (order), \
+                (pool)->stats.splits - hist_splits0, hist_ticks() - hist_t0)
+#define HIST_FREE(pool, order) \
+    hist_record((pool)->hist->free_by_order, (pool)->hist->free_by_steps, (order), \
+                (pool)->stats.merges - hist_merges0, hist_ticks() - hist_t0)
+#else
+#define HIST_START_MALLOC(pool)
+#define HIST_START_FREE(pool)
+#define HIST_MALLOC(pool, order)
+#define HIST_FREE(pool, order)
+#endif
+
+/**
+ * @brief Allocate a block of memory from the buddy pool, the lock (if any)
+ * is held and the profiler is left to the caller.
  *
  * @param pool The memory pool to allocate from
  * @param size The size of the user requested memory block in bytes
  * @return void* Pointer to the allocated memory block
  */
-void *buddy_malloc(struct buddy_pool *pool, size_t size)
+static void *pool_malloc(struct buddy_pool *pool, size_t size)
 {
     if (size == 0 || pool == NULL)
     {
         return NULL;
     }
+    //NBBS has no steps to time, and the histograms would need the lock it avoids
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_NBBS)
+    {
+        void *mem = nbbs_malloc(pool, size);
+        if (mem == NULL) {
+            __atomic_fetch_add(&pool->stats.failed_allocs, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        stats_reserve_shared(pool, nbbs_usable_size(pool, mem));
+        return mem;
+    }
+    HIST_START_MALLOC(pool);
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_TLSF)
+    {
+        void *mem = tlsf_malloc(pool, size);
+        if (mem == NULL) {
+            pool->stats.failed_allocs++;
+            return NULL;
+        }
+        size_t granted = tlsf_usable_size(mem);
+        stats_reserve(pool, granted, granted);
+        HIST_MALLOC(pool, btok(size));
+        return mem;
+    }
 
     //////get the kval for the requested size with enough room for the tag and kval fields
     // Calculate the required size including the header
@@ -96,16 +432,11 @@ void *buddy_malloc(struct buddy_pool *pool, size_t size)
     // Get the smallest kval that fits the total size
     size_t kval = btok(totalSize);
 
-    printf("size=%zu, total_size=%zu, kval=%zu, SMALLEST_K=%d, pool->kval_m=%zu\n", 
-        size, totalSize, kval, SMALLEST_K, pool->kval_m);
-
-    printf("size=%zu, total_size=%zu, kval=%zu, SMALLEST_K=%d, pool->kval_m=%zu\n", 
-        size, totalSize, kval, SMALLEST_K, pool->kval_m);
-
     if (kval < SMALLEST_K) {
         kval = SMALLEST_K; // Enforce minimum block size
     }
     if (kval > pool->kval_m) {
+        pool->stats.failed_allocs++;
         errno = ENOMEM; // Request exceeds pool size
         return NULL; // Request exceeds pool size    
     }
@@ -114,189 +445,1669 @@ void *buddy_malloc(struct buddy_pool *pool, size_t size)
     /////R1 Find a block
     // Find the smallest available block that’s large enough
     size_t currentK = kval;
-    struct avail *block = NULL;
-    while (currentK <= pool->kval_m) {
-        if (pool->avail[currentK].next != &pool->avail[currentK]) {
-            // Found a block in the list
-            block = pool->avail[currentK].next;
-            printf("Found block at k=%zu, block->kval=%zu\n", currentK, (size_t)block->kval);
-            // printf("Found block at k=%zu, block->kval=%zu\n", currentK, block->kval);
-            break;
-        }
+    while (currentK <= pool->kval_m && pool->avail[currentK].next == &pool->avail[currentK]) {
         currentK++;
     }
 
-
-
     ////There was not enough memory to satisfy the request thus we need to set error and return NULL
     // No block found
-    if (block == NULL) {
+    if (currentK > pool->kval_m) {
+        pool->stats.failed_allocs++;
         errno = ENOMEM; 
         return NULL;    
     }
 
     ////R2 Remove from list;
-    // Remove the block from its current list
-    block->prev->next = block->next;
-    block->next->prev = block->prev;
+    // Remove the block the placement policy picks from its current list
+    struct avail *block = avail_pop(pool, currentK);
 
     ////R3 Split required?
     // Split the block if it’s too large
     while (block->kval > kval) {
-        printf("Splitting: block->kval=%zu to %zu\n", (size_t)block->kval, (size_t)(block->kval - 1));
-        //printf("Splitting: block->kval=%zu to %zu\n", block->kval, block->kval - 1);
         ////R4 Split the block
         // Reduce the block’s size by 1 (halving it)
         block->kval--;
         size_t newSize = UINT64_C(1) << block->kval;
 
-        // Create a new buddy block
+        // Create a new buddy block and add it to the appropriate availability list.
+        // The kept half is marked reserved once it has the final size so the
+        // buddy busy policy can tell it apart from a half that is split again.
+        if (block->kval == kval) block->tag = BLOCK_RESERVED;
         struct avail *buddy = (struct avail *)((char *)block + newSize);
-        buddy->tag = BLOCK_AVAIL;
         buddy->kval = block->kval;
-
-        // Add the buddy to the appropriate availability list
-        struct avail *list_head = &pool->avail[buddy->kval];
-        buddy->next = list_head->next;
-        buddy->prev = list_head;
-        list_head->next->prev = buddy;
-        list_head->next = buddy;
+        avail_push(pool, buddy);
+        pool->stats.splits++;
     }
 
     // Mark the block as reserved
     block->tag = BLOCK_RESERVED;
 
-    printf("Returning block with kval=%zu\n", (size_t)block->kval);
+    block->size = size;
+
+    if (pool->flags & BUDDY_TRIM_TAIL) {
+        block_trim(pool, block, totalSize);
+        stats_reserve(pool, block->span, size);
+    } else {
+        stats_reserve(pool, UINT64_C(1) << kval, size);
+    }
+    HIST_MALLOC(pool, kval);
+
     return (void *)((char *)block + sizeof(struct avail));
 }
 
 /**
- * @brief Free a block of memory back to the buddy pool.
+ * @brief Whether the block of order k at buddy sits whole on an avail list.
+ * With a freemap the header can not be trusted, a trimmed block may have
+ * left stale bytes there.
+ */
+static inline bool buddy_is_free(struct buddy_pool *pool, struct avail *buddy, size_t k)
+{
+    if (pool->freemap) return freemap_test(pool, k, block_index(pool, buddy, k));
+    return buddy->tag == BLOCK_AVAIL && buddy->kval == k;
+}
+
+/**
+ * @brief Coalesce a block of order k with its free buddies and put the result
+ * on the avail lists.
  *
  * @param pool The memory pool
- * @param ptr  Pointer to the memory block to free
+ * @param block The block being released
+ * @param current_k The kval of the block
  */
-void buddy_free(struct buddy_pool *pool, void *ptr)
+static void buddy_release(struct buddy_pool *pool, struct avail *block, size_t current_k)
 {
-    if (ptr == NULL) return;
-
-    struct avail *block = (struct avail *)((char *)ptr - sizeof(struct avail));
-    if (block->tag != BLOCK_RESERVED) return;
-
     block->tag = BLOCK_AVAIL;
-    size_t current_k = block->kval;
+    block->kval = current_k;
 
     while (current_k < pool->kval_m) {
         struct avail *buddy = buddy_calc(pool, block);
         
         // Check if buddy is valid and available
-        if ((char *)buddy >= (char *)pool->base + pool->numbytes ||
-            buddy->tag != BLOCK_AVAIL || 
-            buddy->kval != current_k) {
+        if ((char *)buddy >= (char *)pool->base + pool->numbytes) {
             break;
         }
+        if (!buddy_is_free(pool, buddy, current_k)) break;
 
         // Remove buddy from its list
-        buddy->prev->next = buddy->next;
-        buddy->next->prev = buddy->prev;
+        avail_remove(pool, buddy);
 
         // Use the lower address as the new block
         block = (block < buddy) ? block : buddy;
         current_k++;
         block->kval = current_k;
+        pool->stats.merges++;
     }
 
     // Add the block to its availability list
-    struct avail *list_head = &pool->avail[current_k];
-    block->next = list_head->next;
-    block->prev = list_head;
-    list_head->next->prev = block;
-    list_head->next = block;
+    avail_push(pool, block);
 }
 
 /**
- * @brief This is a simple version of realloc.
+ * @brief Free a block of memory back to the buddy pool, the lock (if any)
+ * is held and the profiler is left to the caller.
  *
- * @param poolThe memory pool
- * @param ptr  The user memory
- * @param size the new size requested
- * @return void* pointer to the new user memory
+ * @param pool The memory pool
+ * @param ptr  Pointer to the memory block to free
  */
-void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+static void pool_free(struct buddy_pool *pool, void *ptr)
 {
-    //Required for Grad Students
-    //Optional for Undergrad Students
-    printf("buddy_realloc not implemented\n");
-    return NULL;
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_NBBS) {
+        size_t released = nbbs_free(pool, ptr);
+        if (released) stats_release_shared(pool, released);
+        return;
+    }
+    HIST_START_FREE(pool);
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_TLSF) {
+        size_t released = tlsf_free(pool, ptr);
+        if (released) stats_release(pool, released, released);
+        HIST_FREE(pool, btok(released));
+        return;
+    }
+
+    struct avail *block = (struct avail *)((char *)ptr - sizeof(struct avail));
+    if (block->tag == BLOCK_ALIGNED) block = (struct avail *)((char *)block->origin - sizeof(struct avail));
+    if (block->tag != BLOCK_RESERVED) return;
+
+    size_t k = block->kval;
+    if (pool->flags & BUDDY_TRIM_TAIL) {
+        stats_release(pool, block->span, block->size);
+    } else {
+        stats_release(pool, UINT64_C(1) << k, block->size);
+    }
+    if ((pool->flags & BUDDY_TRIM_TAIL) && block->span < (UINT64_C(1) << k)) {
+        // A trimmed block goes back piece by piece, the pieces merge with the
+        // tail that was released at allocation time
+        trim_walk(pool, block, k, block->span, buddy_release, NULL);
+        HIST_FREE(pool, k);
+        return;
+    }
+    buddy_release(pool, block, k);
+    HIST_FREE(pool, k);
 }
 
 /**
- * @brief Initialize the buddy pool with a given size.
+ * @brief Free a block whose size the caller knows, the lock (if any) is
+ * held. The order and the requested bytes for the counters both come from
+ * size, the header is only written by the merge. Builds with BUDDY_DEBUG
+ * (make debug) check the header against size.
  *
- * @param pool The buddy pool to initialize
- * @param size The size of the pool in bytes
+ * @param pool The memory pool, buddy engine without BUDDY_TRIM_TAIL
+ * @param ptr  Pointer returned by pool_malloc
+ * @param size The size requested for the block
  */
-void buddy_init(struct buddy_pool *pool, size_t size)
+static void pool_free_sized(struct buddy_pool *pool, void *ptr, size_t size)
 {
-    size_t kval = 0;
-    if (size == 0)
-        kval = DEFAULT_K;
-    else
-        kval = btok(size);
+    HIST_START_FREE(pool);
+    struct avail *block = (struct avail *)((char *)ptr - sizeof(struct avail));
+    size_t k = btok(size + sizeof(struct avail));
+    if (k < SMALLEST_K) k = SMALLEST_K;
+#ifdef BUDDY_DEBUG
+    assert(block->tag == BLOCK_RESERVED && block->kval == k);
+#endif
+    stats_release(pool, UINT64_C(1) << k, size);
+    buddy_release(pool, block, k);
+    HIST_FREE(pool, k);
+}
 
-    if (kval < MIN_K)
-        kval = MIN_K;
-    if (kval > MAX_K)
-        kval = MAX_K - 1;
+/**
+ * @brief Allocate size bytes at a multiple of align, the lock (if any) is
+ * held and the profiler is left to the caller.
+ *
+ * A buddy block's user pointer is 2^SMALLEST_K aligned plus the header, so
+ * up to that alignment the offset of the aligned pointer is the same for
+ * every block and the request only grows by a constant. Beyond it the offset
+ * depends on where the block lands and the request is padded by the whole
+ * alignment.
+ *
+ * @param pool The memory pool to allocate from
+ * @param align A power of two
+ * @param size The size of the user requested memory block in bytes
+ * @return void* Pointer to the aligned memory
+ */
+static void *pool_memalign(struct buddy_pool *pool, size_t align, size_t size)
+{
+    if (align <= sizeof(void *)) return pool_malloc(pool, size);
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_NBBS) {
+        //Blocks are aligned to their size
+        return pool_malloc(pool, size && size < align ? align : size);
+    }
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_TLSF) {
+        if (size == 0) return NULL;
+        HIST_START_MALLOC(pool);
+        void *mem = tlsf_memalign(pool, align, size);
+        if (mem == NULL) {
+            pool->stats.failed_allocs++;
+            return NULL;
+        }
+        size_t granted = tlsf_usable_size(mem);
+        stats_reserve(pool, granted, granted);
+        HIST_MALLOC(pool, btok(size));
+        return mem;
+    }
 
-    //make sure pool struct is cleared out
-    memset(pool,0,sizeof(struct buddy_pool));
-    pool->kval_m = kval;
-    pool->numbytes = (UINT64_C(1) << pool->kval_m);
-    //Memory map a block of raw memory to manage
-    pool->base = mmap(
-        NULL,                               /*addr to map to*/
-        pool->numbytes,                     /*length*/
-        PROT_READ | PROT_WRITE,             /*prot*/
-        MAP_PRIVATE | MAP_ANONYMOUS,        /*flags*/
-        -1,                                 /*fd -1 when using MAP_ANONYMOUS*/
-        0                                   /* offset 0 when using MAP_ANONYMOUS*/
-    );
-    if (MAP_FAILED == pool->base)
-    {
-        handle_error_and_die("buddy_init avail array mmap failed");
+    size_t hdr = sizeof(struct avail);
+    size_t pad = align <= (UINT64_C(1) << SMALLEST_K) ? ((2 * hdr + align - 1) & ~(align - 1)) - hdr
+                                                       : hdr + align - sizeof(void *);
+    if (size == 0 || size > SIZE_MAX - pad) {
+        if (size) {
+            pool->stats.failed_allocs++;
+            errno = ENOMEM;
+        }
+        return NULL;
     }
+    char *raw = pool_malloc(pool, size + pad);
+    if (raw == NULL) return NULL;
 
-    //Set all blocks to empty. We are using circular lists so the first elements just point
-    //to an available block. Thus the tag, and kval feild are unused burning a small bit of
-    //memory but making the code more readable. We mark these blocks as UNUSED to aid in debugging.
-    for (size_t i = 0; i <= kval; i++)
+    char *mem = (char *)(((uintptr_t)raw + hdr + align - 1) & ~(uintptr_t)(align - 1));
+    struct avail *header = (struct avail *)(mem - hdr);
+    header->tag = BLOCK_ALIGNED;
+    header->kval = (unsigned short)btok(align);
+    header->size = size;
+    header->origin = raw;
+    return mem;
+}
+
+/**
+ * @brief Resize a buddy_memalign block and keep its alignment. Up to
+ * 2^SMALLEST_K the aligned pointer sits at the same offset in every block,
+ * so the block it lives in is resized in place or moved as a whole.
+ */
+static void *aligned_realloc(struct buddy_pool *pool, struct avail *header, size_t size);
+
+/**
+ * @brief Bytes of a reserved block the caller may use, from ptr to the end
+ * of the block, the lock (if any) is held.
+ *
+ * @return The usable bytes, 0 if ptr is not a reserved block
+ */
+static size_t pool_usable_size(struct buddy_pool *pool, void *ptr)
+{
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_TLSF) return tlsf_usable_size(ptr);
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_NBBS) return nbbs_usable_size(pool, ptr);
+
+    struct avail *block = (struct avail *)((char *)ptr - sizeof(struct avail));
+    if (block->tag == BLOCK_ALIGNED) block = (struct avail *)((char *)block->origin - sizeof(struct avail));
+    if (block->tag != BLOCK_RESERVED) return 0;
+    size_t granted = (pool->flags & BUDDY_TRIM_TAIL) ? block->span : UINT64_C(1) << block->kval;
+    return granted - (size_t)((char *)ptr - (char *)block);
+}
+
+/**
+ * @brief Grow a reserved block in place to order want_k by absorbing its
+ * upper buddies. Only possible while the block is the lower half at every
+ * order on the way and each upper half is free as a whole, which is checked
+ * before anything is touched.
+ *
+ * @return false if the block has to move
+ */
+static bool block_grow(struct buddy_pool *pool, struct avail *block, size_t want_k)
+{
+    size_t off = (size_t)((char *)block - (char *)pool->base);
+    if (want_k > pool->kval_m) return false;
+    for (size_t k = block->kval; k < want_k; k++)
     {
-        pool->avail[i].next = pool->avail[i].prev = &pool->avail[i];
-        pool->avail[i].kval = i;
-        pool->avail[i].tag = BLOCK_UNUSED;
+        struct avail *buddy = (struct avail *)((char *)block + (UINT64_C(1) << k));
+        if ((off & (UINT64_C(1) << k)) || !buddy_is_free(pool, buddy, k)) return false;
     }
+    for (size_t k = block->kval; k < want_k; k++)
+    {
+        avail_remove(pool, (struct avail *)((char *)block + (UINT64_C(1) << k)));
+        pool->stats.merges++;
+    }
+    block->kval = want_k;
+    return true;
+}
 
-    //Add in the first block
-    pool->avail[kval].next = pool->avail[kval].prev = (struct avail *)pool->base;
-    struct avail *m = pool->avail[kval].next;
-    m->tag = BLOCK_AVAIL;
-    m->kval = kval;
-    m->next = m->prev = &pool->avail[kval];
+/**
+ * @brief Shrink a reserved block in place to order want_k, the upper halves
+ * go back on the avail lists.
+ */
+static void block_shrink(struct buddy_pool *pool, struct avail *block, size_t want_k)
+{
+    while (block->kval > want_k)
+    {
+        block->kval--;
+        struct avail *upper = (struct avail *)((char *)block + (UINT64_C(1) << block->kval));
+        upper->kval = block->kval;
+        avail_push(pool, upper);
+        pool->stats.splits++;
+    }
 }
 
 /**
- * @brief Destroy the buddy pool and free the memory.
+ * @brief Resize a block, in place when the buddy structure allows it. The
+ * lock (if any) is held and the profiler is left to the caller.
  *
- * @param pool The buddy pool to destroy
+ * @param pool The memory pool
+ * @param ptr  The user memory, not NULL
+ * @param size the new size requested, not 0
+ * @return void* pointer to the new user memory
  */
-void buddy_destroy(struct buddy_pool *pool)
+static void *pool_realloc(struct buddy_pool *pool, void *ptr, size_t size)
 {
+
+    size_t old;
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_TLSF) {
+        old = tlsf_usable_size(ptr);
+        if (size <= old) return ptr;
+    } else if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_NBBS) {
+        old = nbbs_usable_size(pool, ptr);
+        if (old == 0) {
+            errno = EINVAL;
+            return NULL;
+        }
+        if (size <= old) return ptr;
+    } else {
+        struct avail *block = (struct avail *)((char *)ptr - sizeof(struct avail));
+        if (block->tag == BLOCK_ALIGNED) return aligned_realloc(pool, block, size);
+        if (block->tag != BLOCK_RESERVED) {
+            errno = EINVAL;
+            return NULL;
+        }
+        old = block->size;
+        size_t was = block->kval;
+        size_t granted = UINT64_C(1) << was;
+        size_t k = size < pool->numbytes ? btok(size + sizeof(struct avail)) : pool->kval_m + 1;
+        if (k < SMALLEST_K) k = SMALLEST_K;
+
+        bool in_place;
+        if (pool->flags & BUDDY_TRIM_TAIL) {
+            //The tail of a trimmed block belongs to the free lists, stay inside the span
+            in_place = size + sizeof(struct avail) <= block->span;
+            granted = block->span;
+        } else if (k <= was) {
+            block_shrink(pool, block, k);
+            in_place = true;
+        } else {
+            in_place = block_grow(pool, block, k);
+        }
+        if (in_place)
+        {
+            struct buddy_stats *st = &pool->stats;
+            size_t now = (pool->flags & BUDDY_TRIM_TAIL) ? granted : UINT64_C(1) << block->kval;
+            st->bytes_reserved = st->bytes_reserved - granted + now;
+            st->bytes_requested = st->bytes_requested - old + size;
+            if (st->bytes_reserved > st->peak_reserved) st->peak_reserved = st->bytes_reserved;
+            block->size = size;
+            return ptr;
+        }
+        //The caller may have used the whole block, see buddy_usable_size
+        old = granted - sizeof(struct avail);
+    }
+
+    void *mem = pool_malloc(pool, size);
+    if (mem == NULL) return NULL;
+    memcpy(mem, ptr, old < size ? old : size);
+    pool_free(pool, ptr);
+    return mem;
+}
+
+static void *aligned_realloc(struct buddy_pool *pool, struct avail *header, size_t size)
+{
+    char *mem = (char *)(header + 1);
+    char *raw = header->origin;
+    size_t align = UINT64_C(1) << header->kval;
+    size_t old = pool_usable_size(pool, mem);
+
+    if (align <= (UINT64_C(1) << SMALLEST_K)) {
+        size_t off = (size_t)(mem - raw);
+        if (size > SIZE_MAX - off) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        raw = pool_realloc(pool, raw, size + off);
+        if (raw == NULL) return NULL;
+        header = (struct avail *)(raw + off) - 1;
+        header->tag = BLOCK_ALIGNED;
+        header->kval = (unsigned short)btok(align);
+        header->size = size;
+        header->origin = raw;
+        return raw + off;
+    }
+
+    char *moved = pool_memalign(pool, align, size);
+    if (moved == NULL) return NULL;
+    memcpy(moved, mem, old < size ? old : size);
+    pool_free(pool, mem);
+    return moved;
+}
+
+/*
+ * The public entry points take the lock of a BUDDY_LOCKED pool and call the
+ * profiler hooks, which expect to be called straight from them. The trace
+ * hook runs under the lock so the calls are numbered in the order the pool
+ * saw them.
+ */
+
+/*
+ * A free on a BUDDY_OWNED pool from a thread other than its owner. The queue
+ * is a stack pushed with compare and swap by any number of threads and only
+ * ever emptied whole by the owner, so a pushed head is never popped from
+ * under a pusher and there is no ABA problem.
+ */
+static inline bool pool_is_remote(struct buddy_pool *pool)
+{
+    return (pool->flags & BUDDY_OWNED) && !pthread_equal(pool->owner, pthread_self());
+}
+
+static void remote_push(struct buddy_pool *pool, void *ptr)
+{
+    void *head = __atomic_load_n(&pool->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&pool->remote, &head, ptr, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Free every queued block, called by the owner under the pool lock.
+ */
+static size_t pool_drain_remote(struct buddy_pool *pool)
+{
+    void *ptr = __atomic_exchange_n(&pool->remote, NULL, __ATOMIC_ACQUIRE);
+    size_t drained = 0;
+    while (ptr)
+    {
+        void *next = *(void **)ptr;
+        if (pool->prof) profile_free(pool, ptr);
+        if (pool->trace) trace_record(pool, BUDDY_TRACE_FREE, ptr, NULL, 0);
+        pool_free(pool, ptr);
+        ptr = next;
+        drained++;
+    }
+    pool->stats.remote_frees += drained;
+    return drained;
+}
+
+/**
+ * @brief The cheap check the allocating calls make before the drain.
+ */
+static inline void pool_take_remote(struct buddy_pool *pool)
+{
+    if (pool && (pool->flags & BUDDY_OWNED) && __atomic_load_n(&pool->remote, __ATOMIC_RELAXED))
+        pool_drain_remote(pool);
+}
+
+/*
+ * Small blocks of a BUDDY_PERCPU pool go through the cache of the CPU the
+ * thread runs on. A cached block keeps its header, stays reserved as far as
+ * the pool knows and is handed out again as is. The pool lock is only taken
+ * to move a batch between the cache and the pool. The profiler and the trace
+ * recorder see every call, so they turn the caches off while they run, as do
+ * frees queued for the owner of a BUDDY_OWNED pool. A thread that cannot use
+ * the caches of the pool goes to the pool for every block.
+ */
+static inline bool percpu_active(struct buddy_pool *pool)
+{
+    return pool && pool->percpu && !pool->prof && !pool->trace && percpu_usable(pool);
+}
+
+/**
+ * @brief Allocate from the cache, refilling it with a batch on a miss.
+ *
+ * @return false if size does not fit a cached order
+ */
+static bool percpu_malloc(struct buddy_pool *pool, size_t size, void **mem)
+{
+    if (size == 0) return false;
+    size_t k = btok(size + sizeof(struct avail));
+    if (k < SMALLEST_K) k = SMALLEST_K;
+    if (k >= SMALLEST_K + PERCPU_ORDERS) return false;
+    size_t idx = k - SMALLEST_K;
+
+    *mem = percpu_pop(pool, idx);
+    if (*mem) return true;
+
+    //Refill with blocks that claim the whole order, whatever the caller asked
+    void *batch[PERCPU_BATCH];
+    size_t got = 0;
+    size_t full = (UINT64_C(1) << k) - sizeof(struct avail);
+    POOL_LOCK(pool);
+    pool_take_remote(pool);
+    while (got < PERCPU_BATCH && (batch[got] = pool_malloc(pool, full)) != NULL) got++;
+    POOL_UNLOCK(pool);
+    if (got == 0) {
+        *mem = NULL;
+        return true;
+    }
+    *mem = batch[--got];
+    size_t kept = 0;
+    while (kept < got && percpu_push(pool, idx, batch[kept])) kept++;
+    if (kept < got) {
+        POOL_LOCK(pool);
+        while (kept < got) pool_free(pool, batch[kept++]);
+        POOL_UNLOCK(pool);
+    }
+    return true;
+}
+
+/**
+ * @brief Put a block on the cache, moving a batch back to the pool when the
+ * cache is full.
+ *
+ * @return false if ptr is not a block of a cached order
+ */
+static bool percpu_free(struct buddy_pool *pool, void *ptr)
+{
+    if (pool_is_remote(pool)) return false;
+    struct avail *block = (struct avail *)((char *)ptr - sizeof(struct avail));
+    if (block->tag != BLOCK_RESERVED || block->kval >= SMALLEST_K + PERCPU_ORDERS) return false;
+    size_t idx = block->kval - SMALLEST_K;
+    if (percpu_push(pool, idx, ptr)) return true;
+
+    void *batch[PERCPU_BATCH];
+    size_t got = 0;
+    while (got < PERCPU_BATCH && (batch[got] = percpu_pop(pool, idx)) != NULL) got++;
+    POOL_LOCK(pool);
+    pool_free(pool, ptr);
+    while (got) pool_free(pool, batch[--got]);
+    POOL_UNLOCK(pool);
+    return true;
+}
+
+/**
+ * @brief Allocate a block of memory from the buddy pool.
+ *
+ * @param pool The memory pool to allocate from
+ * @param size The size of the user requested memory block in bytes
+ * @return void* Pointer to the allocated memory block
+ */
+void *buddy_malloc(struct buddy_pool *pool, size_t size)
+{
+    void *mem;
+    if (percpu_active(pool) && percpu_malloc(pool, size, &mem)) return mem;
+    POOL_LOCK(pool);
+    pool_take_remote(pool);
+    mem = pool_malloc(pool, size);
+    if (mem && pool->prof) profile_malloc(pool, mem, size);
+    if (pool && pool->trace) trace_record(pool, BUDDY_TRACE_MALLOC, NULL, mem, size);
+    POOL_UNLOCK(pool);
+    return mem;
+}
+
+/**
+ * @brief Allocate an aligned block of memory from the buddy pool.
+ *
+ * @param pool The memory pool to allocate from
+ * @param alignment A power of two
+ * @param size The size of the user requested memory block in bytes
+ * @return void* Pointer to the allocated memory block
+ */
+void *buddy_memalign(struct buddy_pool *pool, size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    POOL_LOCK(pool);
+    pool_take_remote(pool);
+    void *mem = pool ? pool_memalign(pool, alignment, size) : NULL;
+    if (mem && pool->prof) profile_malloc(pool, mem, size);
+    if (pool && pool->trace) trace_record(pool, BUDDY_TRACE_MALLOC, NULL, mem, size);
+    POOL_UNLOCK(pool);
+    return mem;
+}
+
+/**
+ * @brief Free a block of memory back to the buddy pool.
+ *
+ * @param pool The memory pool
+ * @param ptr  Pointer to the memory block to free
+ */
+void buddy_free(struct buddy_pool *pool, void *ptr)
+{
+    if (ptr == NULL) return;
+    if (percpu_active(pool) && percpu_free(pool, ptr)) return;
+    if (pool_is_remote(pool)) {
+        remote_push(pool, ptr);
+        return;
+    }
+    POOL_LOCK(pool);
+    if (pool->prof) profile_free(pool, ptr);
+    if (pool->trace) trace_record(pool, BUDDY_TRACE_FREE, ptr, NULL, 0);
+    pool_free(pool, ptr);
+    POOL_UNLOCK(pool);
+}
+
+/**
+ * @brief Free a block of memory of a known size back to the buddy pool.
+ *
+ * @param pool The memory pool
+ * @param ptr  Pointer to the memory block to free
+ * @param size The size it was allocated with
+ */
+void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    //Trimmed blocks and the TLSF engine need their header anyway, the
+    //remote queue does not keep the size and the per-CPU caches take any size
+    if (ptr == NULL) return;
+    if ((pool->flags & (BUDDY_ENGINE_MASK | BUDDY_TRIM_TAIL)) || size == 0 || size >= pool->numbytes ||
+        pool_is_remote(pool) || pool->percpu) {
+        buddy_free(pool, ptr);
+        return;
+    }
+    POOL_LOCK(pool);
+    if (pool->prof) profile_free(pool, ptr);
+    if (pool->trace) trace_record(pool, BUDDY_TRACE_FREE, ptr, NULL, 0);
+    pool_free_sized(pool, ptr, size);
+    POOL_UNLOCK(pool);
+}
+
+/**
+ * @brief The bytes of a block the caller may use.
+ *
+ * @param pool The memory pool
+ * @param ptr  Pointer to the memory block
+ * @return size_t the usable bytes
+ */
+size_t buddy_usable_size(struct buddy_pool *pool, void *ptr)
+{
+    if (pool == NULL || ptr == NULL) return 0;
+    POOL_LOCK(pool);
+    size_t usable = pool_usable_size(pool, ptr);
+    POOL_UNLOCK(pool);
+    return usable;
+}
+
+/**
+ * @brief Allocate a block and report all of its usable bytes.
+ *
+ * @param pool The memory pool to allocate from
+ * @param size The size of the user requested memory block in bytes
+ * @param actual Where to store the usable size, may be NULL
+ * @return void* Pointer to the allocated memory block
+ */
+void *buddy_malloc_at_least(struct buddy_pool *pool, size_t size, size_t *actual)
+{
+    POOL_LOCK(pool);
+    pool_take_remote(pool);
+    void *mem = pool_malloc(pool, size);
+    if (mem && pool->prof) profile_malloc(pool, mem, size);
+    if (pool && pool->trace) trace_record(pool, BUDDY_TRACE_MALLOC, NULL, mem, size);
+    if (actual) *actual = mem ? pool_usable_size(pool, mem) : 0;
+    POOL_UNLOCK(pool);
+    return mem;
+}
+
+/**
+ * @brief Find the pool a pointer belongs to.
+ *
+ * @param ptr Any address
+ * @return struct buddy_pool* the pool or NULL
+ */
+struct buddy_pool *buddy_pool_of(const void *ptr)
+{
+    return ptr ? registry_lookup(ptr) : NULL;
+}
+
+/**
+ * @brief Free a block of memory back to whichever pool it came from.
+ *
+ * @param ptr  Pointer to the memory block to free
+ */
+void buddy_free_any(void *ptr)
+{
+    struct buddy_pool *pool = buddy_pool_of(ptr);
+    if (pool) buddy_free(pool, ptr);
+}
+
+/**
+ * @brief Make the calling thread the owner of the pool.
+ *
+ * @param pool The memory pool
+ */
+void buddy_set_owner(struct buddy_pool *pool)
+{
+    POOL_LOCK(pool);
+    pool->owner = pthread_self();
+    POOL_UNLOCK(pool);
+}
+
+/**
+ * @brief Give the blocks in the per-CPU caches back to the pool.
+ *
+ * @param pool The memory pool
+ * @return size_t the number of blocks freed
+ */
+size_t buddy_percpu_flush(struct buddy_pool *pool)
+{
+    if (pool == NULL || pool->percpu == NULL) return 0;
+    POOL_LOCK(pool);
+    size_t flushed = percpu_flush(pool, pool_free);
+    POOL_UNLOCK(pool);
+    return flushed;
+}
+
+/**
+ * @brief Free the blocks other threads queued on the pool.
+ *
+ * @param pool The memory pool
+ * @return size_t the number of blocks freed
+ */
+size_t buddy_drain_remote(struct buddy_pool *pool)
+{
+    if (pool == NULL || !(pool->flags & BUDDY_OWNED)) return 0;
+    POOL_LOCK(pool);
+    size_t drained = pool_drain_remote(pool);
+    POOL_UNLOCK(pool);
+    return drained;
+}
+
+/**
+ * @brief Resize a block of memory.
+ *
+ * @param pool The memory pool
+ * @param ptr  The user memory
+ * @param size the new size requested
+ * @return void* pointer to the new user memory
+ */
+void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    if (ptr == NULL) return buddy_malloc(pool, size);
+    if (size == 0) {
+        buddy_free(pool, ptr);
+        return NULL;
+    }
+    POOL_LOCK(pool);
+    pool_take_remote(pool);
+    void *mem = pool_realloc(pool, ptr, size);
+    if (mem && pool->prof) {
+        //Sampled again like a fresh allocation, even when it did not move
+        profile_free(pool, ptr);
+        profile_malloc(pool, mem, size);
+    }
+    if (pool->trace) trace_record(pool, BUDDY_TRACE_REALLOC, ptr, mem, size);
+    POOL_UNLOCK(pool);
+    return mem;
+}
+
+static void pool_format(struct buddy_pool *pool);
+
+/**
+ * @brief Initialize the buddy pool with a given size.
+ *
+ * @param pool The buddy pool to initialize
+ * @param size The size of the pool in bytes
+ */
+void buddy_init(struct buddy_pool *pool, size_t size)
+{
+    buddy_init_ex(pool, size, 0);
+}
+
+/**
+ * @brief Map the freemap for a pool whose kval_m is already set.
+ *
+ * @param pool The buddy pool being initialized
+ */
+static void freemap_init(struct buddy_pool *pool)
+{
+    size_t words = 0;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++)
+    {
+        size_t n = pool->kval_m - k;
+        pool->freemap_off[k] = words;
+        for (size_t l = 0; l < freemap_levels(n); l++)
+            words += freemap_words(n, l);
+    }
+    pool->freemap_bytes = words * sizeof(uint64_t);
+    //Untouched pages of the map read as zero so only the parts in use cost memory
+    pool->freemap = mmap(NULL, pool->freemap_bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == pool->freemap)
+    {
+        handle_error_and_die("buddy_init freemap mmap failed");
+    }
+}
+
+/**
+ * @brief Initialize the buddy pool with a given size and options.
+ *
+ * @param pool The buddy pool to initialize
+ * @param size The size of the pool in bytes
+ * @param flags The BUDDY_POLICY_* to use
+ */
+void buddy_init_ex(struct buddy_pool *pool, size_t size, unsigned int flags)
+{
+    size_t kval = 0;
+    if (size == 0)
+        kval = DEFAULT_K;
+    else
+        kval = btok(size);
+
+    if (kval < MIN_K)
+        kval = MIN_K;
+    if (kval > MAX_K)
+        kval = MAX_K - 1;
+
+    //make sure pool struct is cleared out
+    memset(pool,0,sizeof(struct buddy_pool));
+    pool->kval_m = kval;
+    pool->numbytes = (UINT64_C(1) << pool->kval_m);
+    pool->flags = flags;
+    if (flags & BUDDY_LOCKED) pthread_mutex_init(&pool->lock, NULL);
+    pool->owner = pthread_self();
+    //Memory map a block of raw memory to manage. The registry tracks
+    //mappings in units of 2^REGISTRY_GRANULE_K, so map a unit more than
+    //needed and cut the mapping down to an aligned start
+    size_t granule = UINT64_C(1) << REGISTRY_GRANULE_K;
+    size_t mapped = pool->numbytes + granule;
+    char *raw = mmap(
+        NULL,                               /*addr to map to*/
+        mapped,                             /*length*/
+        PROT_READ | PROT_WRITE,             /*prot*/
+        MAP_PRIVATE | MAP_ANONYMOUS,        /*flags*/
+        -1,                                 /*fd -1 when using MAP_ANONYMOUS*/
+        0                                   /* offset 0 when using MAP_ANONYMOUS*/
+    );
+    if (MAP_FAILED == raw)
+    {
+        handle_error_and_die("buddy_init avail array mmap failed");
+    }
+    pool->base = (void *)(((uintptr_t)raw + granule - 1) & ~(uintptr_t)(granule - 1));
+    size_t head = (size_t)((char *)pool->base - raw);
+    if (head) munmap(raw, head);
+    munmap((char *)pool->base + pool->numbytes, mapped - head - pool->numbytes);
+    if (registry_add(pool))
+    {
+        handle_error_and_die("buddy_init registry");
+    }
+
+#ifdef BUDDY_HISTOGRAMS
+    //Mapped separately so the pool struct stays small, untouched buckets cost nothing
+    pool->hist = mmap(NULL, sizeof(*pool->hist), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == pool->hist)
+    {
+        handle_error_and_die("buddy_init histogram mmap failed");
+    }
+#endif
+
+    if ((flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_BUDDY &&
+        ((flags & BUDDY_POLICY_MASK) == BUDDY_POLICY_ADDRESS || (flags & BUDDY_TRIM_TAIL)))
+    {
+        freemap_init(pool);
+    }
+
+    pool_format(pool);
+
+    if ((flags & BUDDY_PERCPU) && (flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_BUDDY &&
+        !(flags & BUDDY_TRIM_TAIL) && percpu_init(pool) == -1)
+    {
+        handle_error_and_die("buddy_init per-CPU cache mmap failed");
+    }
+}
+
+/**
+ * @brief Reset the avail lists and hand the whole mapping out as one free block.
+ *
+ * Only touches the list heads and the first block header, so it is O(kval_m)
+ * no matter how many blocks were handed out before.
+ *
+ * @param pool A pool with its mapping (and freemap if any) in place
+ */
+static void pool_format(struct buddy_pool *pool)
+{
+    size_t kval = pool->kval_m;
+
+    //Live counters start over, the history (peak, totals) is kept across resets
+    memset(pool->stats.free_blocks, 0, sizeof(pool->stats.free_blocks));
+    pool->stats.bytes_reserved = 0;
+    pool->stats.bytes_requested = 0;
+
+    //Set all blocks to empty. We are using circular lists so the first elements just point
+    //to an available block. Thus the tag, and kval feild are unused burning a small bit of
+    //memory but making the code more readable. We mark these blocks as UNUSED to aid in debugging.
+    for (size_t i = 0; i <= kval; i++)
+    {
+        pool->avail[i].next = pool->avail[i].prev = &pool->avail[i];
+        pool->avail[i].kval = i;
+        pool->avail[i].tag = BLOCK_UNUSED;
+    }
+
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_TLSF)
+    {
+        //The TLSF engine keeps its own control structure inside the mapping
+        tlsf_init(pool);
+        return;
+    }
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_NBBS)
+    {
+        if (nbbs_init(pool) == -1)
+        {
+            handle_error_and_die("buddy_init nbbs tree mmap failed");
+        }
+        return;
+    }
+
+    //Add in the first block
+    struct avail *m = (struct avail *)pool->base;
+    m->kval = kval;
+    avail_push(pool, m);
+}
+
+/**
+ * @brief Drop every allocation in the pool at once.
+ *
+ * @param pool The buddy pool to reset
+ */
+void buddy_reset(struct buddy_pool *pool)
+{
+    buddy_reset_ex(pool, 0);
+}
+
+/**
+ * @brief Drop every allocation in the pool, optionally giving the pages back.
+ *
+ * @param pool The buddy pool to reset
+ * @param flags 0 or BUDDY_RESET_MADV_FREE
+ */
+void buddy_reset_ex(struct buddy_pool *pool, unsigned int flags)
+{
+    if (pool == NULL || pool->base == NULL) return;
+    POOL_LOCK(pool);
+
+    //Must come before pool_format writes the new headers
+    if (flags & BUDDY_RESET_MADV_FREE)
+    {
+#ifdef MADV_FREE
+        int advice = MADV_FREE;
+#else
+        int advice = MADV_DONTNEED;
+#endif
+        if (-1 == madvise(pool->base, pool->numbytes, advice))
+        {
+            handle_error_and_die("buddy_reset madvise");
+        }
+    }
+
+    //A private anonymous mapping reads back as zeros after MADV_DONTNEED,
+    //which empties the freemap without touching each word
+    if (pool->freemap && -1 == madvise(pool->freemap, pool->freemap_bytes, MADV_DONTNEED))
+    {
+        handle_error_and_die("buddy_reset freemap madvise");
+    }
+
+    if (pool->prof) profile_forget_live(pool);
+    if (pool->trace) trace_record(pool, BUDDY_TRACE_RESET, NULL, NULL, 0);
+    //Queued frees are of blocks the reset drops anyway
+    __atomic_store_n(&pool->remote, NULL, __ATOMIC_RELAXED);
+    if (pool->percpu) percpu_flush(pool, NULL);
+    pool_format(pool);
+    POOL_UNLOCK(pool);
+}
+
+/**
+ * @brief Copy the pool counters.
+ *
+ * @param pool The memory pool
+ * @param out Where to store the counters
+ * @return 0 on success or -1 with errno set to EINVAL
+ */
+int buddy_stats(struct buddy_pool *pool, struct buddy_stats *out)
+{
+    if (pool == NULL || out == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    POOL_LOCK(pool);
+    *out = pool->stats;
+    POOL_UNLOCK(pool);
+    out->bytes_free = pool->numbytes - out->bytes_reserved;
+    return 0;
+}
+
+/**
+ * @brief Copy and optionally clear the latency histograms.
+ *
+ * @param pool The memory pool
+ * @param out Where to store the histograms or NULL
+ * @param reset Clear the histograms after copying
+ * @return 0 on success or -1 with errno set
+ */
+int buddy_histograms_snapshot(struct buddy_pool *pool, struct buddy_histograms *out, bool reset)
+{
+    if (pool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pool->hist == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    POOL_LOCK(pool);
+    if (out) *out = *pool->hist;
+    if (reset) memset(pool->hist, 0, sizeof(*pool->hist));
+    POOL_UNLOCK(pool);
+    return 0;
+}
+
+/**
+ * @brief Walk the buckets until the requested fraction of samples is covered.
+ *
+ * @param hist The histogram
+ * @param fraction Between 0 and 1
+ * @return The upper bound of the bucket or 0 when empty
+ */
+uint64_t buddy_histogram_percentile(const struct buddy_histogram *hist, double fraction)
+{
+    if (hist->total == 0) return 0;
+    uint64_t want = (uint64_t)(fraction * (double)hist->total);
+    if (want >= hist->total) want = hist->total - 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < BUDDY_HIST_BUCKETS; i++)
+    {
+        seen += hist->count[i];
+        if (seen > want) {
+            uint64_t upper = hist_bucket_upper(i);
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+#define LEAK_LIST_MAX 16  /*Leaked blocks listed one by one before the report only counts*/
+
+/**
+ * Visitor for pool_walk, called with the user pointer, the bytes the block
+ * holds (as accounted in buddy_stats) and whether it is reserved.
+ */
+typedef void (*walk_fn)(void *arg, void *ptr, size_t size, bool used);
+
+/**
+ * @brief Visit every block of the pool in address order.
+ *
+ * Each header says how far away the next one is: 2^kval for a free block,
+ * 2^kval or the kept span for a reserved one, so the walk reads one header
+ * per block.
+ *
+ * @return 0 or -1 with errno set to EIO when a header makes no sense
+ */
+static int pool_walk(struct buddy_pool *pool, walk_fn visit, void *arg)
+{
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_TLSF) {
+        tlsf_walk(pool, visit, arg);
+        return 0;
+    }
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_NBBS) {
+        nbbs_walk(pool, visit, arg);
+        return 0;
+    }
+
+    char *base = (char *)pool->base;
+    size_t off = 0;
+    while (off < pool->numbytes)
+    {
+        struct avail *block = (struct avail *)(base + off);
+        size_t k = block->kval;
+        if ((block->tag != BLOCK_AVAIL && block->tag != BLOCK_RESERVED) ||
+            k < SMALLEST_K || k > pool->kval_m || (off & ((UINT64_C(1) << k) - 1)))
+        {
+            errno = EIO;
+            return -1;
+        }
+        bool used = block->tag == BLOCK_RESERVED;
+        size_t len = UINT64_C(1) << k;
+        if (used && (pool->flags & BUDDY_TRIM_TAIL)) len = block->span;
+        visit(arg, block + 1, len, used);
+        off += len;
+    }
+    return 0;
+}
+
+struct leak_walk
+{
+    struct buddy_pool *pool;
+    FILE *out;
+    struct buddy_leaks leaks;
+};
+
+static void leak_visit(void *arg, void *ptr, size_t size, bool used)
+{
+    struct leak_walk *w = arg;
+    if (!used) return;
+    //TLSF and NBBS do not keep requested sizes, like buddy_stats it reports the granted one
+    size_t requested = size;
+    if ((w->pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_BUDDY)
+        requested = ((struct avail *)ptr - 1)->size;
+
+    if (w->out && w->leaks.blocks < LEAK_LIST_MAX)
+        fprintf(w->out, "buddy:   %p %zu bytes (%zu reserved)\n", ptr, requested, size);
+    w->leaks.blocks++;
+    w->leaks.bytes_reserved += size;
+    w->leaks.bytes_requested += requested;
+}
+
+/**
+ * @brief Walk the pool for reserved blocks and print them.
+ *
+ * @param pool The memory pool
+ * @param out Where to write the report or NULL
+ * @param leaks Where to store the totals or NULL
+ * @return 0 on success or -1 with errno set
+ */
+int buddy_leak_report(struct buddy_pool *pool, FILE *out, struct buddy_leaks *leaks)
+{
+    if (pool == NULL || pool->base == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct leak_walk w = { .pool = pool, .out = out };
+    POOL_LOCK(pool);
+    int rval = pool_walk(pool, leak_visit, &w);
+    if (out)
+    {
+        if (w.leaks.blocks > LEAK_LIST_MAX)
+            fprintf(out, "buddy:   ... %zu more\n", w.leaks.blocks - LEAK_LIST_MAX);
+        fprintf(out, "buddy: %zu blocks still reserved, %zu bytes (%zu requested) in pool %p%s\n",
+                w.leaks.blocks, w.leaks.bytes_reserved, w.leaks.bytes_requested, pool->base,
+                rval ? ", walk stopped at a corrupt header" : "");
+    }
+    if (pool->prof) w.leaks.sampled = profile_report_live(pool, out);
+    POOL_UNLOCK(pool);
+    if (leaks) *leaks = w.leaks;
+    return rval;
+}
+
+/*
+ * buddy_check cuts the pool into ranges that each start on a block header and
+ * walks them independently. An address aligned to 2^c is either the start of
+ * a block or inside a block of order c or more, so a coarse pass that steps
+ * over the blocks of order c and up lands on the first header of every chunk
+ * made of smaller blocks. Two buddies of order below c share their chunk, so
+ * each range can also look for missed merges on its own.
+ */
+
+#define CHECK_CHUNKS_LOG2 10  /*The coarse pass cuts the pool into at most 2^10 chunks*/
+#define CHECK_MAX_THREADS 64
+
+struct check_part
+{
+    struct buddy_check_report r;
+    uint64_t sum[MAX_K];        /*Order independent checksum of the free blocks of each order*/
+    size_t first_error;         /*Offset of the lowest bad header, SIZE_MAX if none*/
+};
+
+struct check_range
+{
+    size_t lo;
+    size_t hi;
+};
+
+struct check_job
+{
+    struct buddy_pool *pool;
+    struct check_range *ranges;
+    size_t count;
+    size_t next;                /*Next range to hand out, taken with an atomic add*/
+};
+
+struct check_worker
+{
+    struct check_job *job;
+    struct check_part part;
+};
+
+/**
+ * @brief Mix a free block's offset and order into a checksum term. The walk
+ * and the avail lists add up the terms of the blocks they see, equal sums
+ * mean both saw the same set without sorting or marking anything.
+ */
+static inline uint64_t check_hash(size_t off, size_t k)
+{
+    uint64_t x = ((uint64_t)off << 6 | k) + UINT64_C(0x9E3779B97F4A7C15);
+    x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief Validate and account the block at off.
+ *
+ * @param prev_free Offset of the block before this one if it was free, SIZE_MAX otherwise
+ * @return The bytes to the next header or 0 if the header is bad
+ */
+static size_t check_block(struct buddy_pool *pool, size_t off, struct check_part *p, size_t *prev_free)
+{
+    struct avail *block = (struct avail *)((char *)pool->base + off);
+    size_t k = block->kval;
+    bool bad = (block->tag != BLOCK_AVAIL && block->tag != BLOCK_RESERVED) ||
+               k < SMALLEST_K || k > pool->kval_m || (off & ((UINT64_C(1) << k) - 1));
+    size_t len = bad ? 0 : UINT64_C(1) << k;
+    if (!bad && block->tag == BLOCK_RESERVED)
+    {
+        if (pool->flags & BUDDY_TRIM_TAIL)
+        {
+            bad = block->span == 0 || block->span > len || (block->span & ((UINT64_C(1) << SMALLEST_K) - 1));
+            len = block->span;
+        }
+        bad = bad || block->size + sizeof(struct avail) > len;
+    }
+    if (bad)
+    {
+        p->r.bad_headers++;
+        if (off < p->first_error) p->first_error = off;
+        return 0;
+    }
+
+    if (block->tag == BLOCK_RESERVED)
+    {
+        p->r.reserved_blocks++;
+        p->r.bytes_reserved += len;
+        p->r.bytes_requested += block->size;
+        *prev_free = SIZE_MAX;
+        return len;
+    }
+
+    p->r.free_blocks[k]++;
+    p->r.bytes_free += len;
+    p->sum[k] += check_hash(off, k);
+    if (pool->freemap && !freemap_test(pool, k, off >> k)) p->r.freemap_errors++;
+    //The lower buddy comes right before the upper one in address order
+    if (*prev_free != SIZE_MAX && !(*prev_free & len) && *prev_free + len == off &&
+        ((struct avail *)((char *)pool->base + *prev_free))->kval == k)
+    {
+        p->r.unmerged++;
+    }
+    *prev_free = off;
+    return len;
+}
+
+/**
+ * @brief Walk the blocks of [lo, hi), which starts on a header.
+ */
+static void check_range(struct buddy_pool *pool, size_t lo, size_t hi, struct check_part *p)
+{
+    size_t prev_free = SIZE_MAX;
+    for (size_t off = lo; off < hi;)
+    {
+        size_t len = check_block(pool, off, p, &prev_free);
+        if (len == 0) return;
+        off += len;
+    }
+}
+
+/**
+ * @brief Step over the blocks of order c and up, checking them, and pass
+ * each range of smaller blocks to emit.
+ */
+static void check_coarse(struct buddy_pool *pool, size_t c, struct check_part *p,
+                         void (*emit)(void *arg, size_t lo, size_t hi), void *arg)
+{
+    size_t chunk = UINT64_C(1) << c;
+    size_t prev_free = SIZE_MAX;
+    size_t off = 0;
+    while (off < pool->numbytes)
+    {
+        if (off & (chunk - 1))
+        {
+            //The tail after a trimmed span, its pieces below order c end on the boundary
+            size_t hi = (off | (chunk - 1)) + 1;
+            emit(arg, off, hi);
+            off = hi;
+            prev_free = SIZE_MAX;
+            continue;
+        }
+        if (((struct avail *)((char *)pool->base + off))->kval < c)
+        {
+            emit(arg, off, off + chunk);
+            off += chunk;
+            prev_free = SIZE_MAX;
+            continue;
+        }
+        size_t len = check_block(pool, off, p, &prev_free);
+        if (len == 0) return;
+        off += len;
+    }
+}
+
+struct check_inline
+{
+    struct buddy_pool *pool;
+    struct check_part *part;
+};
+
+static void check_emit_inline(void *arg, size_t lo, size_t hi)
+{
+    struct check_inline *c = arg;
+    check_range(c->pool, lo, hi, c->part);
+}
+
+static void check_emit_job(void *arg, size_t lo, size_t hi)
+{
+    struct check_job *job = arg;
+    job->ranges[job->count].lo = lo;
+    job->ranges[job->count].hi = hi;
+    job->count++;
+}
+
+static void *check_worker(void *arg)
+{
+    struct check_worker *w = arg;
+    struct check_job *job = w->job;
+    for (;;)
+    {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->count) break;
+        check_range(job->pool, job->ranges[i].lo, job->ranges[i].hi, &w->part);
+    }
+    return NULL;
+}
+
+static void check_merge(struct check_part *dst, const struct check_part *src)
+{
+    for (size_t k = 0; k < MAX_K; k++)
+    {
+        dst->r.free_blocks[k] += src->r.free_blocks[k];
+        dst->sum[k] += src->sum[k];
+    }
+    dst->r.reserved_blocks += src->r.reserved_blocks;
+    dst->r.bytes_free += src->r.bytes_free;
+    dst->r.bytes_reserved += src->r.bytes_reserved;
+    dst->r.bytes_requested += src->r.bytes_requested;
+    dst->r.bad_headers += src->r.bad_headers;
+    dst->r.unmerged += src->r.unmerged;
+    dst->r.freemap_errors += src->r.freemap_errors;
+    if (src->first_error < dst->first_error) dst->first_error = src->first_error;
+}
+
+/**
+ * @brief Walk the ranges found by the coarse pass on several threads. The
+ * calling thread takes part, so a failed pthread_create only costs speed.
+ */
+static void check_parallel(struct buddy_pool *pool, size_t c, unsigned int threads, struct check_part *total)
+{
+    if (threads > CHECK_MAX_THREADS) threads = CHECK_MAX_THREADS;
+    size_t max_ranges = (UINT64_C(2) << (pool->kval_m - c)) + 1;
+    size_t bytes = max_ranges * sizeof(struct check_range) + threads * sizeof(struct check_worker);
+    char *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == mem)
+    {
+        //Not worth failing a check over, walk on this thread instead
+        struct check_inline inl = { pool, total };
+        check_coarse(pool, c, total, check_emit_inline, &inl);
+        return;
+    }
+    struct check_worker *workers = (struct check_worker *)mem;
+    struct check_job job = { .pool = pool, .ranges = (struct check_range *)(workers + threads) };
+    check_coarse(pool, c, total, check_emit_job, &job);
+
+    pthread_t tid[CHECK_MAX_THREADS];
+    bool started[CHECK_MAX_THREADS] = { false };
+    for (unsigned int t = 0; t < threads; t++)
+    {
+        workers[t].job = &job;
+        workers[t].part.first_error = SIZE_MAX;
+        if (t > 0) started[t] = pthread_create(&tid[t], NULL, check_worker, &workers[t]) == 0;
+    }
+    check_worker(&workers[0]);
+    for (unsigned int t = 0; t < threads; t++)
+    {
+        if (started[t]) pthread_join(tid[t], NULL);
+        check_merge(total, &workers[t].part);
+    }
+    if (-1 == munmap(mem, bytes))
+    {
+        handle_error_and_die("buddy_check munmap");
+    }
+}
+
+/**
+ * @brief Number of bits set in the freemap for order k, reading only the
+ * level 0 words the level above marks as non-zero.
+ */
+static size_t freemap_count(struct buddy_pool *pool, size_t k)
+{
+    size_t n = pool->kval_m - k;
+    const uint64_t *leaf = pool->freemap + pool->freemap_off[k];
+    if (freemap_levels(n) == 1) return (size_t)__builtin_popcountll(leaf[0]);
+
+    const uint64_t *upper = leaf + freemap_words(n, 0);
+    size_t bits = 0;
+    for (size_t i = 0; i < freemap_words(n, 1); i++)
+    {
+        for (uint64_t w = upper[i]; w; w &= w - 1)
+            bits += (size_t)__builtin_popcountll(leaf[i * 64 + (size_t)__builtin_ctzll(w)]);
+    }
+    return bits;
+}
+
+/**
+ * @brief Compare the avail lists, the freemap and the counters with what the
+ * walk found.
+ */
+static void check_lists(struct buddy_pool *pool, struct check_part *p)
+{
+    char *base = (char *)pool->base;
+    for (size_t k = SMALLEST_K; k <= pool->kval_m; k++)
+    {
+        struct avail *head = &pool->avail[k];
+        size_t count = 0;
+        uint64_t sum = 0;
+        for (struct avail *prev = head, *b = head->next; b != head; prev = b, b = b->next)
+        {
+            size_t off = (size_t)((char *)b - base);
+            //Anything past the walk's count is a cycle or a block the walk did not see
+            if ((char *)b < base || off >= pool->numbytes || (off & ((UINT64_C(1) << k) - 1)) ||
+                b->tag != BLOCK_AVAIL || b->kval != k || b->prev != prev || count >= p->r.free_blocks[k])
+            {
+                p->r.list_errors++;
+                break;
+            }
+            count++;
+            sum += check_hash(off, k);
+        }
+        if (count != p->r.free_blocks[k] || sum != p->sum[k]) p->r.list_mismatch++;
+
+        if (pool->freemap)
+        {
+            size_t bits = freemap_count(pool, k);
+            if (bits > p->r.free_blocks[k]) p->r.freemap_errors += bits - p->r.free_blocks[k];
+        }
+        if (pool->stats.free_blocks[k] != p->r.free_blocks[k]) p->r.stats_mismatch++;
+    }
+}
+
+static void check_block_visit(void *arg, void *ptr, size_t size, bool used)
+{
+    struct check_part *p = arg;
+    (void)ptr;
+    if (used) {
+        p->r.reserved_blocks++;
+        p->r.bytes_reserved += size;
+        p->r.bytes_requested += size;
+    } else {
+        p->r.bytes_free += size;
+    }
+}
+
+/**
+ * @brief Walk the pool and cross check every structure that describes it.
+ *
+ * @param pool The memory pool
+ * @param report Where to store what the walk found
+ * @param threads Threads to walk with, 0 or 1 walks on the calling thread
+ * @return 0 if the pool is consistent or -1 with errno set
+ */
+int buddy_check(struct buddy_pool *pool, struct buddy_check_report *report, unsigned int threads)
+{
+    if (pool == NULL || pool->base == NULL || report == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct check_part total;
+    memset(&total, 0, sizeof(total));
+    total.first_error = SIZE_MAX;
+
+    POOL_LOCK(pool);
+    if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_TLSF)
+    {
+        tlsf_walk(pool, check_block_visit, &total);
+    }
+    else if ((pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_NBBS)
+    {
+        //A tree node that disagrees with its children is the NBBS bad header
+        total.r.bad_headers = nbbs_walk(pool, check_block_visit, &total);
+    }
+    else
+    {
+        //MIN_K leaves room for 2^CHECK_CHUNKS_LOG2 chunks above SMALLEST_K
+        size_t c = pool->kval_m - CHECK_CHUNKS_LOG2;
+        if (threads > 1) {
+            check_parallel(pool, c, threads, &total);
+        } else {
+            struct check_inline inl = { pool, &total };
+            check_coarse(pool, c, &total, check_emit_inline, &inl);
+        }
+        //A walk cut short leaves the lists nothing trustworthy to compare with
+        if (total.r.bad_headers == 0) check_lists(pool, &total);
+    }
+    if (pool->stats.bytes_reserved != total.r.bytes_reserved) total.r.stats_mismatch++;
+    if (pool->stats.bytes_requested != total.r.bytes_requested) total.r.stats_mismatch++;
+    POOL_UNLOCK(pool);
+
+    total.r.first_error = total.first_error == SIZE_MAX ? NULL : (char *)pool->base + total.first_error;
+    *report = total.r;
+    if (report->bad_headers || report->unmerged || report->list_errors || report->list_mismatch ||
+        report->freemap_errors || report->stats_mismatch)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static void frag_walk_visit(void *arg, void *ptr, size_t size, bool used)
+{
+    struct buddy_frag *f = arg;
+    (void)ptr;
+    if (used) return;
+    //The largest power of two that fits, what a request of that order could get
+    size_t k = (size_t)(63 - __builtin_clzll(size));
+    f->free_bytes[k < MAX_K ? k : MAX_K - 1] += size;
+}
+
+/**
+ * @brief Fill in the free bytes by order and the fragmentation index.
+ *
+ * @param pool The memory pool
+ * @param out Where to store the metrics
+ * @return 0 on success or -1 with errno set
+ */
+int buddy_fragmentation(struct buddy_pool *pool, struct buddy_frag *out)
+{
+    if (pool == NULL || pool->base == NULL || out == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(out, 0, sizeof(*out));
+    int rval = 0;
+    POOL_LOCK(pool);
+    if ((pool->flags & BUDDY_ENGINE_MASK) != BUDDY_ENGINE_BUDDY) {
+        rval = pool_walk(pool, frag_walk_visit, out);
+    } else {
+        for (size_t k = SMALLEST_K; k <= pool->kval_m; k++)
+            out->free_bytes[k] = pool->stats.free_blocks[k] << k;
+    }
+    POOL_UNLOCK(pool);
+    if (rval == -1) return -1;
+
+    size_t below = 0;
+    for (size_t k = 0; k < MAX_K; k++)
+        out->bytes_free += out->free_bytes[k];
+    for (size_t k = 0; k < MAX_K; k++)
+    {
+        out->frag_index[k] = out->bytes_free ? (double)below / (double)out->bytes_free : 0.0;
+        below += out->free_bytes[k];
+        if (out->free_bytes[k]) out->largest_free_order = k;
+    }
+    return 0;
+}
+
+struct heatmap_walk
+{
+    char *base;
+    FILE *out;
+    unsigned int format;
+    size_t cell_k;
+    size_t header;              /*Bytes between a block and the pointer pool_walk passes*/
+    size_t pos;                 /*Offset accounted so far*/
+    size_t used;                /*Used bytes of the cell holding pos*/
+};
+
+static void heatmap_cell(struct heatmap_walk *w, size_t cell)
+{
+    size_t bytes = UINT64_C(1) << w->cell_k;
+    if (w->format == BUDDY_HEATMAP_CSV) {
+        fprintf(w->out, "%zu,%zu,%zu\n", cell << w->cell_k, bytes, w->used);
+    } else {
+        unsigned char v = (unsigned char)((w->used * 255 + bytes - 1) / bytes);
+        fputc(v, w->out);
+    }
+    w->used = 0;
+}
+
+/**
+ * @brief Account [pos, end) as used or free, writing every cell it completes.
+ */
+static void heatmap_advance(struct heatmap_walk *w, size_t end, bool used)
+{
+    size_t mask = (UINT64_C(1) << w->cell_k) - 1;
+    while (w->pos < end)
+    {
+        size_t cell_end = (w->pos | mask) + 1;
+        size_t stop = end < cell_end ? end : cell_end;
+        if (used) w->used += stop - w->pos;
+        w->pos = stop;
+        if (stop == cell_end) heatmap_cell(w, (stop - 1) >> w->cell_k);
+    }
+}
+
+static void heatmap_visit(void *arg, void *ptr, size_t size, bool used)
+{
+    struct heatmap_walk *w = arg;
+    size_t lo = (size_t)((char *)ptr - w->base) - w->header;
+    //Anything the walk skipped is engine metadata
+    heatmap_advance(w, lo, true);
+    heatmap_advance(w, lo + size, used);
+}
+
+/**
+ * @brief Stream the used bytes of each cell to a file while walking the pool.
+ *
+ * @param pool The memory pool
+ * @param out Where to write the heatmap
+ * @param cell_k Order of one cell
+ * @param format BUDDY_HEATMAP_CSV or BUDDY_HEATMAP_BINARY
+ * @return 0 on success or -1 with errno set
+ */
+int buddy_heatmap(struct buddy_pool *pool, FILE *out, size_t cell_k, unsigned int format)
+{
+    if (pool == NULL || pool->base == NULL || out == NULL || cell_k < SMALLEST_K ||
+        cell_k > pool->kval_m || format > BUDDY_HEATMAP_BINARY)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    struct heatmap_walk w = {
+        .base = (char *)pool->base,
+        .out = out,
+        .format = format,
+        .cell_k = cell_k,
+        .header = (pool->flags & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_BUDDY ? sizeof(struct avail) : 0,
+    };
+    if (format == BUDDY_HEATMAP_CSV) {
+        fprintf(out, "offset,bytes,used\n");
+    } else {
+        struct buddy_heatmap_header h = { {'B', 'H', 'M', '1'}, (uint32_t)cell_k, pool->numbytes >> cell_k };
+        fwrite(&h, sizeof(h), 1, out);
+    }
+    POOL_LOCK(pool);
+    int rval = pool_walk(pool, heatmap_visit, &w);
+    POOL_UNLOCK(pool);
+    if (rval == -1) return -1;
+    //The TLSF sentinel at the end of the pool
+    heatmap_advance(&w, pool->numbytes, true);
+    if (ferror(out)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Destroy the buddy pool and free the memory.
+ *
+ * @param pool The buddy pool to destroy
+ */
+void buddy_destroy(struct buddy_pool *pool)
+{
+    if (pool->flags & BUDDY_OWNED) pool_drain_remote(pool);
+    if (pool->percpu) {
+        percpu_flush(pool, pool_free);
+        percpu_destroy(pool);
+    }
+    if ((pool->flags & BUDDY_LEAK_REPORT) && pool->stats.bytes_reserved)
+    {
+        buddy_leak_report(pool, stderr, NULL);
+    }
+    buddy_profile_stop(pool);
+    if (pool->trace) buddy_trace_stop(pool);
+    registry_remove(pool);
     int rval = munmap(pool->base, pool->numbytes);
     if (-1 == rval)
     {
         handle_error_and_die("buddy_destroy avail array");
     }
+    if (pool->freemap && -1 == munmap(pool->freemap, pool->freemap_bytes))
+    {
+        handle_error_and_die("buddy_destroy freemap");
+    }
+    nbbs_destroy(pool);
+    if (pool->hist && -1 == munmap(pool->hist, sizeof(*pool->hist)))
+    {
+        handle_error_and_die("buddy_destroy histograms");
+    }
+    if (pool->flags & BUDDY_LOCKED) pthread_mutex_destroy(&pool->lock);
     //Zero out the array so it can be reused it needed
     memset(pool,0,sizeof(struct buddy_pool));
 }
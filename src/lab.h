@@ -1,9 +1,11 @@
 #ifndef LAB_H
 #define LAB_H
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 
 #ifdef __cplusplus
@@ -37,6 +39,81 @@ extern "C"
 #define BLOCK_AVAIL    1  /*Block is available to allocate*/
 #define BLOCK_RESERVED 0  /*Block has been handed to user*/
 #define BLOCK_UNUSED   3  /*Block is not used at all*/
+#define BLOCK_ALIGNED  2  /*Header in front of a buddy_memalign pointer inside a reserved block*/
+
+  /**
+   * Placement policies selectable with buddy_init_ex. The policy decides which
+   * free block of the needed order is handed out when more than one exists.
+   */
+#define BUDDY_POLICY_LIFO       0x0  /*Most recently freed block first (default)*/
+#define BUDDY_POLICY_ADDRESS    0x1  /*Lowest address first, keeps the high end of the pool free*/
+#define BUDDY_POLICY_BUDDY_BUSY 0x2  /*Prefer blocks whose buddy is fully reserved*/
+#define BUDDY_POLICY_MASK       0x3
+
+  /**
+   * Give the unused tail of a block back to the free lists. A request is rounded
+   * up to a multiple of 2^SMALLEST_K instead of to a power of two, so a 600KiB
+   * request keeps 512KiB+64KiB+... of a 1MiB block instead of all of it.
+   * The released pieces can be taken by small requests, which then keep the
+   * block from merging again when it is freed, so this pays off for pools of
+   * mostly large buffers.
+   */
+#define BUDDY_TRIM_TAIL         0x4
+
+  /**
+   * Allocation engines selectable with buddy_init_ex. Every engine manages the
+   * same mmap region and is used through buddy_malloc/buddy_free. The TLSF
+   * engine (two level segregated fit) does malloc and free in a constant number
+   * of steps regardless of pool size, at the cost of the buddy specific options
+   * above which it ignores.
+   *
+   * The NBBS engine (non-blocking buddy system) keeps the buddy tree in a
+   * separate array of status bytes changed with compare and swap, so the pool
+   * can be shared by threads without BUDDY_LOCKED and malloc, free, realloc and
+   * usable_size never wait on each other. Its blocks have no header and are
+   * aligned to their size. It ignores the buddy specific options, and the
+   * profiler and the functions walking the pool still need BUDDY_LOCKED or a
+   * quiet pool.
+   */
+#define BUDDY_ENGINE_BUDDY      0x00
+#define BUDDY_ENGINE_TLSF       0x10
+#define BUDDY_ENGINE_NBBS       0x20
+#define BUDDY_ENGINE_MASK       0x30
+
+  /**
+   * Print a leak report to stderr from buddy_destroy when blocks are still
+   * reserved, see buddy_leak_report.
+   */
+#define BUDDY_LEAK_REPORT       0x40
+
+  /**
+   * Make the pool safe to share between threads. Every call taking the pool
+   * runs under one mutex. The profiler must be started and stopped while no
+   * other thread uses the pool.
+   */
+#define BUDDY_LOCKED            0x80
+
+  /**
+   * Give the pool to one thread, the one that called buddy_init_ex or later
+   * buddy_set_owner. Only the owner allocates, and it does so without locks.
+   * Any thread may free: a free from another thread pushes the block onto a
+   * lock-free queue of the pool and the owner takes the whole queue back in
+   * its next allocating call, or in buddy_drain_remote.
+   */
+#define BUDDY_OWNED             0x100
+
+  /**
+   * Cache freed blocks of the smallest orders per CPU, up to 512 bytes with
+   * the header. buddy_malloc and buddy_free of these sizes take a block off or
+   * put it on the cache of the CPU they run on, with a restartable sequence
+   * where Linux offers one, and only take the pool lock to move a batch
+   * between a cache and the pool. Cached memory grows with the number of
+   * CPUs, not threads. Blocks sitting in a cache count as reserved until
+   * buddy_percpu_flush. Meant for pools shared with BUDDY_LOCKED, ignored by
+   * the other engines and with BUDDY_TRIM_TAIL, and bypassed while the
+   * profiler or the trace recorder runs.
+   */
+#define BUDDY_PERCPU            0x200
 
   /**
    * Struct to represent the table of all available blocks do not reorder members
@@ -46,10 +123,135 @@ extern "C"
   {
     unsigned short int tag;     /*Tag for block status BLOCK_AVAIL, BLOCK_RESERVED*/
     unsigned short int kval;    /*The kval of this block*/
-    struct avail *next;         /*next memory block*/
-    struct avail *prev;         /*prev memory block*/
+    union
+    {
+      struct avail *next;       /*next memory block*/
+      size_t size;              /*Bytes the user asked for while the block is reserved*/
+    };
+    union
+    {
+      struct avail *prev;       /*prev memory block*/
+      size_t span;              /*Bytes kept by a reserved block in a BUDDY_TRIM_TAIL pool*/
+      void *origin;             /*User pointer of the reserved block a BLOCK_ALIGNED header sits in*/
+    };
   };
 
+  /**
+   * Counters describing a pool, see buddy_stats. They are updated as blocks
+   * move so reading them never walks the pool.
+   */
+  struct buddy_stats
+  {
+    size_t free_blocks[MAX_K];  /*Number of free blocks of each order (buddy engine only)*/
+    size_t bytes_free;          /*Bytes not handed out*/
+    size_t bytes_reserved;      /*Bytes in blocks handed out, including rounding (granted)*/
+    size_t bytes_requested;     /*Bytes callers asked for in the blocks handed out*/
+    size_t peak_reserved;       /*Highest bytes_reserved seen since buddy_init*/
+    size_t allocs;              /*Successful buddy_malloc calls*/
+    size_t frees;               /*Blocks returned through buddy_free*/
+    size_t failed_allocs;       /*buddy_malloc calls that returned NULL with ENOMEM*/
+    size_t splits;              /*Blocks halved to satisfy a request*/
+    size_t merges;              /*Buddies coalesced on free*/
+    size_t remote_frees;        /*Frees from other threads taken off the queue of a BUDDY_OWNED pool*/
+  };
+
+  /**
+   * The blocks found reserved by buddy_leak_report.
+   */
+  struct buddy_leaks
+  {
+    size_t blocks;              /*Blocks still reserved*/
+    size_t bytes_reserved;      /*Bytes those blocks hold, including rounding*/
+    size_t bytes_requested;     /*Bytes callers asked for in those blocks*/
+    size_t sampled;             /*Blocks the sampling profiler has a call stack for*/
+  };
+
+  /**
+   * What buddy_check found. The first group describes the pool, the second
+   * counts the problems, all of which are zero for a consistent pool.
+   */
+  struct buddy_check_report
+  {
+    size_t free_blocks[MAX_K];  /*Free blocks of each order found by the walk (buddy engine only)*/
+    size_t reserved_blocks;     /*Blocks handed out*/
+    size_t bytes_free;          /*Bytes in free blocks*/
+    size_t bytes_reserved;      /*Bytes in reserved blocks, including rounding*/
+    size_t bytes_requested;     /*Bytes callers asked for in the reserved blocks*/
+    size_t bad_headers;         /*Unknown tags, impossible kvals or sizes, misaligned blocks*/
+    size_t unmerged;            /*Pairs of free buddies of the same order left apart*/
+    size_t list_errors;         /*Broken links or avail list entries that are not free blocks of the list's order*/
+    size_t list_mismatch;       /*Orders whose avail list does not hold exactly the free blocks walked*/
+    size_t freemap_errors;      /*Free blocks missing from the bitmap index and bits set for no block*/
+    size_t stats_mismatch;      /*Counters in buddy_stats that disagree with the walk*/
+    void *first_error;          /*The lowest block with a bad header, NULL if none*/
+  };
+
+  /**
+   * How fragmented the free memory of a pool is, see buddy_fragmentation.
+   */
+  struct buddy_frag
+  {
+    size_t bytes_free;              /*Bytes in free blocks*/
+    size_t largest_free_order;      /*Order of the largest free block, 0 if nothing is free*/
+    size_t free_bytes[MAX_K];       /*Bytes in free blocks of each order*/
+    double frag_index[MAX_K];       /*Fraction of the free bytes in blocks too small for each order*/
+  };
+
+  /**
+   * Formats for buddy_heatmap.
+   */
+#define BUDDY_HEATMAP_CSV    0  /*"offset,bytes,used" header, then one line per cell*/
+#define BUDDY_HEATMAP_BINARY 1  /*struct buddy_heatmap_header, then one byte per cell*/
+
+  /**
+   * Start of a binary heatmap, in host byte order. Each of the cells that
+   * follow holds the used part of 2^cell_k bytes of the pool scaled to 0-255,
+   * rounded up so only an entirely free cell reads 0.
+   */
+  struct buddy_heatmap_header
+  {
+    char magic[4];              /*"BHM1"*/
+    uint32_t cell_k;            /*Each cell covers 2^cell_k bytes*/
+    uint64_t cells;             /*Number of cells, pool size >> cell_k*/
+  };
+
+  /**
+   * Latency histograms are compiled in with -DBUDDY_HISTOGRAMS (make HISTOGRAMS=1).
+   * Values are in timestamp counter ticks. Each power of two range is split in
+   * 2^BUDDY_HIST_SUB_BITS linear buckets, so a bucket is within 25% of its value
+   * while 256 buckets cover every 64 bit value.
+   */
+#define BUDDY_HIST_SUB_BITS 2
+#define BUDDY_HIST_BUCKETS  256
+
+  /**
+   * One log bucketed histogram.
+   */
+  struct buddy_histogram
+  {
+    uint64_t count[BUDDY_HIST_BUCKETS]; /*Samples that fell in each bucket*/
+    uint64_t total;                     /*Number of samples*/
+    uint64_t max;                       /*Largest sample*/
+  };
+
+  /**
+   * The latency histograms of a pool. Malloc is keyed by the order of the
+   * request and by the number of splits it took, free by the order of the
+   * block and by the number of merges it did.
+   */
+  struct buddy_histograms
+  {
+    struct buddy_histogram malloc_by_order[MAX_K];
+    struct buddy_histogram malloc_by_steps[MAX_K];
+    struct buddy_histogram free_by_order[MAX_K];
+    struct buddy_histogram free_by_steps[MAX_K];
+  };
+
+  struct buddy_profiler;
+  struct buddy_tracer;
+  struct nbbs_tree;
+  struct buddy_percpu;
+
   /**
    * The buddy memory pool.
    */
@@ -59,6 +261,21 @@ extern "C"
     size_t numbytes;            /*The number of bytes this pool is managing*/
     void *base;                 /*Base address used to scale memory for buddy calculations*/
     struct avail avail[MAX_K];  /*The array of available memory blocks*/
+    unsigned int flags;         /*Options the pool was created with (BUDDY_POLICY_*)*/
+    uint64_t *freemap;          /*Per order bitmaps of free blocks, NULL when not needed.
+                                  When present it decides whether a buddy is free*/
+    size_t freemap_bytes;       /*Size of the freemap mapping*/
+    size_t freemap_off[MAX_K];  /*Word offset of each order inside the freemap*/
+    struct buddy_stats stats;   /*Counters maintained by malloc and free*/
+    struct buddy_histograms *hist; /*Latency histograms, NULL unless BUDDY_HISTOGRAMS*/
+    struct buddy_profiler *prof; /*Sampling heap profiler (profile.h), NULL when off*/
+    struct buddy_tracer *trace; /*Allocation trace recorder (trace.h), NULL when off*/
+    struct nbbs_tree *nbbs;     /*Tree of the NBBS engine (nbbs.h), NULL for the others*/
+    struct buddy_percpu *percpu; /*Per-CPU block caches (percpu.h), NULL unless BUDDY_PERCPU*/
+    pthread_mutex_t lock;       /*Held by every call on a BUDDY_LOCKED pool*/
+    pthread_t owner;            /*The only thread allocating from a BUDDY_OWNED pool*/
+    void *remote;               /*Blocks freed by other threads, linked through their
+                                  first word, pushed and taken with atomic builtins*/
   };
 
   /**
@@ -108,6 +325,98 @@ extern "C"
    */
   void buddy_free(struct buddy_pool *pool, void *ptr);
 
+  /**
+   * Same as buddy_free for a caller that knows the size of the block. The
+   * buddy engine works out the order of the block and the bytes to take off
+   * bytes_requested from size instead of reading its header, so a wrong size
+   * or a block that is not reserved corrupts the pool. Any size up to the
+   * buddy_usable_size of the block frees the right block, but anything other
+   * than the size last requested leaves bytes_requested off by the
+   * difference. Pools with BUDDY_TRIM_TAIL and the TLSF engine need the
+   * header anyway and ignore size.
+   *
+   * @param pool The memory pool
+   * @param ptr Pointer returned by buddy_malloc, buddy_malloc_at_least or
+   *            buddy_realloc, not buddy_memalign
+   * @param size The size last requested for the block
+   */
+  void buddy_free_sized(struct buddy_pool *pool, void *ptr, size_t size);
+
+  /**
+   * The number of bytes at ptr the caller may use, at least the size it
+   * asked for. The buddy engine rounds requests up to a power of two block
+   * (or to the trimmed span with BUDDY_TRIM_TAIL) and the slack past the
+   * request belongs to the caller too. buddy_realloc keeps all of it when
+   * the block moves.
+   *
+   * @param pool The memory pool
+   * @param ptr Pointer to a memory block, may be NULL
+   * @return The usable bytes, 0 for NULL or a block that is not reserved
+   */
+  size_t buddy_usable_size(struct buddy_pool *pool, void *ptr);
+
+  /**
+   * Same as buddy_malloc but also reports the usable size of the block, so a
+   * growable buffer can take the slack of the power of two block as capacity
+   * instead of reallocating early.
+   *
+   * @param pool The memory pool to alloc from
+   * @param size The size of the user requested memory block in bytes
+   * @param actual Where to store the usable size, 0 on failure, may be NULL
+   * @return A pointer to the memory block
+   */
+  void *buddy_malloc_at_least(struct buddy_pool *pool, size_t size, size_t *actual);
+
+  /**
+   * Make the calling thread the owner of a BUDDY_OWNED pool. The previous
+   * owner must not use the pool any more, frees still queued are taken by
+   * the new owner.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_set_owner(struct buddy_pool *pool);
+
+  /**
+   * Give the blocks in the per-CPU caches of a BUDDY_PERCPU pool back to the
+   * pool, so buddy_stats, buddy_check and the leak report see them as free.
+   * No other thread may use the pool meanwhile. buddy_destroy does this too.
+   *
+   * @param pool The memory pool
+   * @return The number of blocks freed
+   */
+  size_t buddy_percpu_flush(struct buddy_pool *pool);
+
+  /**
+   * Free the blocks other threads queued on a BUDDY_OWNED pool. The owner's
+   * allocating calls do this on their own, an owner that stops allocating
+   * for a while can call it to give the memory back sooner.
+   *
+   * @param pool The memory pool, called from its owner
+   * @return The number of blocks freed
+   */
+  size_t buddy_drain_remote(struct buddy_pool *pool);
+
+  /**
+   * The pool whose mapping holds ptr, looked up in a global registry every
+   * pool is entered in by buddy_init_ex and removed from by buddy_destroy.
+   * The lookup takes no lock and costs at most three dependent loads, so
+   * code handling blocks of several pools does not have to carry the pool
+   * pointer around. The registry keeps the address of the pool struct,
+   * which must not move while the pool is in use.
+   *
+   * @param ptr Any address, may be NULL
+   * @return The pool, NULL if ptr is in no pool
+   */
+  struct buddy_pool *buddy_pool_of(const void *ptr);
+
+  /**
+   * Same as buddy_free on the pool found by buddy_pool_of. Pointers outside
+   * every pool are ignored.
+   *
+   * @param ptr Pointer to the memory block to free, may be NULL
+   */
+  void buddy_free_any(void *ptr);
+
   /**
    * Changes the size of the memory block pointed to by ptr.
    * The function may move the memory block to a new location
@@ -124,6 +433,12 @@ extern "C"
    * if size is equal to zero, and ptr is not NULL, then the  call
    * is equivalent to free(ptr)
    *
+   * A block grows in place when the buddies above it are free and
+   * shrinks in place by giving its upper halves back, so the block only
+   * moves when its buddies are taken. If the block has to move and the pool
+   * is out of memory NULL is returned with errno set to ENOMEM and ptr is
+   * left untouched.
+   *
    * @param pool The memory pool
    * @param ptr Pointer to a memory block
    * @param size The new size of the memory block
@@ -131,6 +446,25 @@ extern "C"
    */
   void *buddy_realloc(struct buddy_pool *pool, void *ptr, size_t size);
 
+  /**
+   * Same as buddy_malloc but the returned pointer is a multiple of alignment.
+   * The memory is released with buddy_free and resized with buddy_realloc.
+   * The buddy engine keeps the alignment across buddy_realloc, the TLSF
+   * engine only keeps 8 bytes when a block has to move, like realloc(3).
+   *
+   * Blocks of the buddy engine start 2^SMALLEST_K aligned and the pointer
+   * after the header is only 8 byte aligned, so a larger alignment pads the
+   * request and puts a BLOCK_ALIGNED header in front of the aligned pointer
+   * that leads back to the block. The TLSF engine gives the padding back.
+   *
+   * @param pool The memory pool to alloc from
+   * @param alignment A power of two
+   * @param size The size of the user requested memory block in bytes
+   * @return A pointer to the memory block, NULL with errno set to EINVAL for
+   *         a bad alignment or to ENOMEM when the pool is out of memory
+   */
+  void *buddy_memalign(struct buddy_pool *pool, size_t alignment, size_t size);
+
   /**
    * Initialize a new memory pool using the buddy algorithm. Internally,
    * this function uses mmap to get a block of memory to manage so should be
@@ -145,16 +479,170 @@ extern "C"
    *
    * NOTE: Memory pools returned by this function can not be intermingled.
    * Calling buddy_malloc with pool A and then calling buddy_free with
-   * pool B will result in undefined behavior.
+   * pool B will result in undefined behavior. buddy_free_any finds the
+   * right pool by itself.
+   *
+   * The mapping starts at a multiple of 2^MIN_K.
    *
    * @param size The size of the pool in bytes.
    * @param pool A pointer to the pool to initialize
    */
   void buddy_init(struct buddy_pool *pool, size_t size);
 
+  /**
+   * Same as buddy_init but lets the caller pick pool options. buddy_init is
+   * equivalent to calling this function with flags set to 0.
+   *
+   * BUDDY_POLICY_ADDRESS keeps a per order bitmap index of the free blocks
+   * (about 1/256th of the pool size, mapped lazily) so the lowest free block
+   * of an order is found in a handful of word reads instead of a list scan.
+   *
+   * BUDDY_TRIM_TAIL also uses the bitmap index: the trailing pieces of a
+   * trimmed block have no header, so coalescing can not trust what it reads
+   * at a buddy address and asks the bitmap instead.
+   *
+   * @param pool A pointer to the pool to initialize
+   * @param size The size of the pool in bytes.
+   * @param flags One of the BUDDY_POLICY_* values, optionally or'ed with BUDDY_TRIM_TAIL,
+   *              or'ed with one BUDDY_ENGINE_* value, optionally or'ed with
+   *              BUDDY_LEAK_REPORT, BUDDY_LOCKED, BUDDY_OWNED and BUDDY_PERCPU
+   */
+  void buddy_init_ex(struct buddy_pool *pool, size_t size, unsigned int flags);
+
+  /**
+   * Drop every block handed out by the pool at once. The avail lists go back
+   * to the state buddy_init left them in, with one block covering the whole
+   * pool, but the mapping and its resident pages are kept. Runs in O(kval_m)
+   * independent of how many blocks were allocated.
+   *
+   * All pointers into the pool are invalid afterwards.
+   *
+   * @param pool The memory pool to reset
+   */
+  void buddy_reset(struct buddy_pool *pool);
+
+  /**
+   * Give the pool's pages back to the kernel on reset. The mapping stays in
+   * place, pages are reclaimed lazily (MADV_FREE) when memory gets tight.
+   */
+#define BUDDY_RESET_MADV_FREE 0x1
+
+  /**
+   * Same as buddy_reset with options.
+   *
+   * @param pool The memory pool to reset
+   * @param flags 0 or BUDDY_RESET_MADV_FREE
+   */
+  void buddy_reset_ex(struct buddy_pool *pool, unsigned int flags);
+
+  /**
+   * Copy the pool's counters into out. The counters are maintained on every
+   * malloc and free, so this is a plain copy that is cheap enough to poll.
+   * The TLSF engine does not keep requested sizes, it reports the granted
+   * size for both and leaves free_blocks at zero.
+   *
+   * @param pool The memory pool
+   * @param out Where to store the counters
+   * @return 0 on success, -1 with errno set to EINVAL if an argument is NULL
+   */
+  int buddy_stats(struct buddy_pool *pool, struct buddy_stats *out);
+
+  /**
+   * Copy the pool's latency histograms into out and optionally clear them.
+   *
+   * @param pool The memory pool
+   * @param out Where to store the histograms, may be NULL to only reset
+   * @param reset Clear the histograms after copying them
+   * @return 0 on success, -1 with errno set to EINVAL for a NULL pool or to
+   *         ENOTSUP when the library was built without BUDDY_HISTOGRAMS
+   */
+  int buddy_histograms_snapshot(struct buddy_pool *pool, struct buddy_histograms *out, bool reset);
+
+  /**
+   * Value below which the given fraction of a histogram's samples fall, as
+   * the upper bound of the bucket holding that sample.
+   *
+   * @param hist The histogram
+   * @param fraction The fraction between 0 and 1, 0.999 for p99.9
+   * @return The value in ticks or 0 for an empty histogram
+   */
+  uint64_t buddy_histogram_percentile(const struct buddy_histogram *hist, double fraction);
+
+  /**
+   * Walk the pool and report every block that is still reserved. The walk
+   * starts at the base and jumps from header to header by the size of each
+   * block, so it costs one read per block rather than a scan of the pool.
+   * When the sampling profiler is running (see profile.h) the call stacks of
+   * the sampled blocks that are still live are printed as well.
+   *
+   * @param pool The memory pool
+   * @param out Where to write the report, may be NULL to only count
+   * @param leaks Where to store the totals, may be NULL
+   * @return 0 on success, -1 with errno set to EINVAL for a NULL pool or to
+   *         EIO if the walk ran into a corrupt block header
+   */
+  int buddy_leak_report(struct buddy_pool *pool, FILE *out, struct buddy_leaks *leaks);
+
+  /**
+   * Check the pool for corruption. The pool is walked in address order from
+   * header to header, each block's tag, kval and alignment are verified, and
+   * free buddies that should have been merged are flagged. The avail lists
+   * are then followed and compared with the walk through a checksum of the
+   * free blocks, as are the bitmap index and the counters of buddy_stats.
+   * Nothing is allocated or written to the pool.
+   *
+   * With threads above 1 a coarse pass steps over the large blocks and the
+   * ranges of small blocks between them are walked in parallel. The pool
+   * must not be used by other threads while it is checked.
+   *
+   * The TLSF engine is only walked and compared with the counters.
+   *
+   * @param pool The memory pool
+   * @param report Where to store what was found
+   * @param threads Number of threads to walk with, 0 or 1 uses the calling thread only
+   * @return 0 if the pool is consistent, -1 with errno set to EIO if the report
+   *         lists a problem or to EINVAL if an argument is NULL
+   */
+  int buddy_check(struct buddy_pool *pool, struct buddy_check_report *report, unsigned int threads);
+
+  /**
+   * Measure how fragmented the free memory is. The index for order k is the
+   * fraction of the free bytes held by blocks smaller than 2^k: 0 means any
+   * free byte can serve a request of that order, 1 means a request of that
+   * order fails however much is free. This is the number to watch when
+   * large requests fail while bytes_free looks plentiful.
+   *
+   * The buddy engine reads its per order counters, so this does not walk
+   * the pool. The TLSF engine walks its blocks and files each free block
+   * under the largest order that fits in it.
+   *
+   * @param pool The memory pool
+   * @param out Where to store the metrics
+   * @return 0 on success, -1 with errno set to EINVAL if an argument is NULL
+   *         or to EIO if the TLSF walk ran into a corrupt block
+   */
+  int buddy_fragmentation(struct buddy_pool *pool, struct buddy_frag *out);
+
+  /**
+   * Write a map of which parts of the pool are in use, one cell for every
+   * 2^cell_k bytes in address order, for plotting offline. Block headers and
+   * engine metadata count as used.
+   *
+   * @param pool The memory pool
+   * @param out Where to write the heatmap
+   * @param cell_k Order of the bytes covered by one cell, SMALLEST_K to kval_m
+   * @param format BUDDY_HEATMAP_CSV or BUDDY_HEATMAP_BINARY
+   * @return 0 on success, -1 with errno set to EINVAL for a bad argument, to
+   *         EIO if the walk ran into a corrupt header or if writing failed
+   */
+  int buddy_heatmap(struct buddy_pool *pool, FILE *out, size_t cell_k, unsigned int format);
+
   /**
    * Inverse of buddy_init.
    *
+   * Pools created with BUDDY_LEAK_REPORT print buddy_leak_report to stderr
+   * first if any block is still reserved.
+   *
    * Notice that this function does not change the value of pool itself,
    * hence it still points to the same (now invalid) location.
    *
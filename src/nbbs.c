@@ -0,0 +1,433 @@
+/**
+ * @file nbbs.c
+ * @brief   Non-blocking buddy engine. The tree is kept in heap order, node 1
+ *          is the whole pool and the children of node n are 2n and 2n + 1.
+ *          Every node is one status byte: whether the node itself is handed
+ *          out, whether each half holds something that is, and whether a free
+ *          is on its way up through each half. An allocation claims its node
+ *          with one compare and swap and then marks the ancestors on its way
+ *          to the root, backing out if one of them turns out to be handed out
+ *          whole. A free first flags the ancestors it may release, clears its
+ *          node and then clears the flags it finds still set, so an allocation
+ *          that marked the same ancestor in between is never undone.
+ *
+ *          Marks on the way up only matter to allocations of the ancestors.
+ *          Blocks no larger than NBBS_CLIMB levels above the smallest are
+ *          small and mark no higher than the top level, NBBS_CLIMB levels up
+ *          from the leaves, so their cost does not grow with the pool. While
+ *          a larger block is out, which a counter tells, they also look for
+ *          it among their ancestors above the top level. A large allocation
+ *          bumps that counter, claims its node and then checks that its
+ *          nodes on the top level are all clear. Either side writes before it
+ *          reads, so of a small and a large allocation racing for the same
+ *          memory at least one sees the other and backs out.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "nbbs.h"
+
+#define OCC_RIGHT   0x01            /*Something in the right half is handed out*/
+#define OCC_LEFT    0x02            /*Something in the left half is handed out*/
+#define COAL_RIGHT  0x04            /*A free is releasing the right half*/
+#define COAL_LEFT   0x08            /*A free is releasing the left half*/
+#define OCC         0x10            /*The node itself is handed out*/
+#define BUSY        (OCC | OCC_LEFT | OCC_RIGHT)
+
+/**
+ * State of the engine, at the start of its own mapping and followed by the
+ * status bytes of the tree and the order map.
+ */
+struct nbbs_tree
+{
+    size_t bytes;                   /*Size of the mapping*/
+    size_t depth;                   /*Depth of the smallest blocks, the root is at 0*/
+    size_t min_k;                   /*Order of the smallest blocks*/
+    size_t top;                     /*Depth small allocations mark up to*/
+    size_t hint[NBBS_MAX_DEPTH + 1]; /*Where the scan of each level starts, a guess that
+                                      is read and written without synchronization*/
+    uint8_t *order;                 /*Depth of the block starting at each smallest block*/
+    size_t large __attribute__((aligned(64))); /*Large allocations out or on their way,
+                                      apart from the hints written on every call*/
+    uint8_t node[];                 /*Status bytes, index 0 is unused*/
+};
+
+static inline size_t depth_of(size_t n)
+{
+    return (size_t)(63 - __builtin_clzll((unsigned long long)n));
+}
+
+/*
+ * Bits a parent keeps for child n, which is its left child when even.
+ */
+static inline uint8_t occ_bit(size_t n)
+{
+    return (n & 1) ? OCC_RIGHT : OCC_LEFT;
+}
+
+static inline uint8_t coal_bit(size_t n)
+{
+    return (n & 1) ? COAL_RIGHT : COAL_LEFT;
+}
+
+/*
+ * Sequentially consistent so a small and a large allocation, each writing
+ * one node and then reading the other's, cannot both miss the write. Loads
+ * cost nothing extra for it on x86-64.
+ */
+static inline uint8_t load(struct nbbs_tree *t, size_t n)
+{
+    return __atomic_load_n(&t->node[n], __ATOMIC_SEQ_CST);
+}
+
+static inline bool cas(struct nbbs_tree *t, size_t n, uint8_t *expect, uint8_t val)
+{
+    return __atomic_compare_exchange_n(&t->node[n], expect, val, true, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Depth node n releases its marks up to when freed.
+ */
+static inline size_t upper_of(struct nbbs_tree *t, size_t n)
+{
+    return depth_of(n) < t->top ? 0 : t->top;
+}
+
+/**
+ * @brief Whether every node on the top level below n is clear, n above it.
+ */
+static bool top_clear(struct nbbs_tree *t, size_t n)
+{
+    size_t shift = t->top - depth_of(n);
+    size_t from = n << shift, to = (n + 1) << shift;
+    for (size_t i = from; i < to; i++)
+    {
+        if ((i & 7) == 0 && i + 8 <= to) {
+            if (__atomic_load_n((uint64_t *)&t->node[i], __ATOMIC_SEQ_CST)) return false;
+            i += 7;
+            continue;
+        }
+        if (load(t, i)) return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Clear the release flags from n up to the ancestor at depth upper,
+ * stopping where another block keeps the ancestor occupied or where an
+ * allocation has taken the flag away.
+ */
+static void unmark(struct nbbs_tree *t, size_t n, size_t upper)
+{
+    size_t cur = n, child;
+    uint8_t val;
+    do {
+        child = cur;
+        cur >>= 1;
+        uint8_t old = load(t, cur);
+        do {
+            if (!(old & coal_bit(child))) return;
+            val = old & (uint8_t)~(coal_bit(child) | occ_bit(child));
+        } while (!cas(t, cur, &old, val));
+    } while (depth_of(cur) > upper && !(val & occ_bit(child ^ 1)));
+}
+
+/**
+ * @brief Release node n and the marks it put on its ancestors down to depth
+ * upper, the root for a free and the level below a conflict for an
+ * allocation backing out.
+ */
+static void free_node(struct nbbs_tree *t, size_t n, size_t upper)
+{
+    //Flag the ancestors this free may empty, up to the first one whose other
+    //half stays occupied
+    for (size_t runner = n; depth_of(runner) > upper; runner >>= 1)
+    {
+        uint8_t old = __atomic_fetch_or(&t->node[runner >> 1], coal_bit(runner), __ATOMIC_ACQ_REL);
+        if ((old & occ_bit(runner ^ 1)) && !(old & coal_bit(runner ^ 1))) break;
+    }
+    __atomic_store_n(&t->node[n], 0, __ATOMIC_RELEASE);
+    if (depth_of(n) != upper) unmark(t, n, upper);
+}
+
+/**
+ * @brief Claim node n and mark its ancestors, up to the top level for a
+ * small block and up to the root for a large one.
+ *
+ * @return 0 on success, otherwise the node that was in the way: n itself or
+ * an ancestor that is handed out whole
+ */
+static size_t try_alloc(struct nbbs_tree *t, size_t n)
+{
+    size_t upper = upper_of(t, n);
+    bool large = depth_of(n) < t->top;
+    if (large) __atomic_fetch_add(&t->large, 1, __ATOMIC_SEQ_CST);
+    uint8_t old = 0;
+    if (!cas(t, n, &old, BUSY)) {
+        if (large) __atomic_fetch_sub(&t->large, 1, __ATOMIC_SEQ_CST);
+        return n;
+    }
+    for (size_t cur = n; depth_of(cur) > upper;)
+    {
+        size_t child = cur;
+        cur >>= 1;
+        old = load(t, cur);
+        uint8_t val;
+        do {
+            if (old & OCC) {
+                free_node(t, n, depth_of(child));
+                if (large) __atomic_fetch_sub(&t->large, 1, __ATOMIC_SEQ_CST);
+                return cur;
+            }
+            //Taking the release flag tells a free on its way up to leave the mark
+            val = (uint8_t)((old & ~coal_bit(child)) | occ_bit(child));
+            //Writing back the same value would change nothing, and high
+            //nodes are almost always marked already
+        } while (val != old && !cas(t, cur, &old, val));
+    }
+
+    if (large) {
+        //Small blocks below n leave their marks on the top level only
+        if (!top_clear(t, n)) {
+            free_node(t, n, 0);
+            __atomic_fetch_sub(&t->large, 1, __ATOMIC_SEQ_CST);
+            return n;
+        }
+    } else if (upper && __atomic_load_n(&t->large, __ATOMIC_SEQ_CST)) {
+        for (size_t cur = n >> (depth_of(n) - upper); cur > 1;)
+        {
+            cur >>= 1;
+            if (load(t, cur) & OCC) {
+                free_node(t, n, upper);
+                return cur;
+            }
+        }
+    }
+    return 0;
+}
+
+static inline bool has_zero_byte(uint64_t w)
+{
+    return ((w - UINT64_C(0x0101010101010101)) & ~w & UINT64_C(0x8080808080808080)) != 0;
+}
+
+/**
+ * @brief First node in [from, to) whose status byte is clear, or to. Eight
+ * nodes are skipped per load while every one of them is in use.
+ */
+static size_t next_clear(struct nbbs_tree *t, size_t from, size_t to)
+{
+    size_t i = from;
+    while (i < to)
+    {
+        if ((i & 7) == 0 && i + 8 <= to &&
+            !has_zero_byte(__atomic_load_n((uint64_t *)&t->node[i], __ATOMIC_RELAXED)))
+        {
+            i += 8;
+            continue;
+        }
+        if (__atomic_load_n(&t->node[i], __ATOMIC_RELAXED) == 0) return i;
+        i++;
+    }
+    return to;
+}
+
+/**
+ * @brief Ancestor of n that is handed out whole, found with loads only, or 0.
+ * A clear node is usually clear because a block above it was handed out, and
+ * finding that ancestor this way costs no compare and swap and nothing to
+ * back out. The walk stops at the first ancestor with a mark for the half n
+ * is in: something below it is handed out, so nothing above it was when the
+ * mark was made. A block handed out later is still caught by try_alloc.
+ */
+static size_t occupied_above(struct nbbs_tree *t, size_t n)
+{
+    for (size_t cur = n; cur > 1; cur >>= 1)
+    {
+        uint8_t val = __atomic_load_n(&t->node[cur >> 1], __ATOMIC_RELAXED);
+        if (val & OCC) return cur >> 1;
+        if (val & occ_bit(cur)) return 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Allocate a node at depth d between nodes from and to.
+ *
+ * @return The node, 0 if none could be claimed
+ */
+static size_t scan_level(struct nbbs_tree *t, size_t d, size_t from, size_t to)
+{
+    size_t i = from;
+    while ((i = next_clear(t, i, to)) < to)
+    {
+        size_t in_way = occupied_above(t, i);
+        if (in_way == 0) in_way = try_alloc(t, i);
+        if (in_way == 0) return i;
+        //An ancestor handed out whole covers everything below it
+        i = in_way == i ? i + 1 : (in_way + 1) << (d - depth_of(in_way));
+    }
+    return 0;
+}
+
+static inline struct nbbs_tree *tree_of(struct buddy_pool *pool)
+{
+    return pool->nbbs;
+}
+
+int nbbs_init(struct buddy_pool *pool)
+{
+    struct nbbs_tree *t = tree_of(pool);
+    if (t) {
+        //Untouched pages read as zero, which is an empty tree
+        size_t keep = offsetof(struct nbbs_tree, node);
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t first = (keep + page - 1) & ~(page - 1);
+        memset(t->node, 0, (first < t->bytes ? first : t->bytes) - keep);
+        if (t->bytes > first && madvise((char *)t + first, t->bytes - first, MADV_DONTNEED) == -1)
+            return -1;
+        memset(t->hint, 0, sizeof(t->hint));
+        t->large = 0;
+        return 0;
+    }
+
+    size_t depth = pool->kval_m - SMALLEST_K;
+    if (depth > NBBS_MAX_DEPTH) depth = NBBS_MAX_DEPTH;
+    size_t nodes = UINT64_C(2) << depth;
+    size_t leaves = UINT64_C(1) << depth;
+    size_t bytes = offsetof(struct nbbs_tree, node) + nodes + leaves;
+    t = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (t == MAP_FAILED) return -1;
+    t->bytes = bytes;
+    t->depth = depth;
+    t->min_k = pool->kval_m - depth;
+    t->top = depth > NBBS_CLIMB ? depth - NBBS_CLIMB : 0;
+    t->order = t->node + nodes;
+    pool->nbbs = t;
+    return 0;
+}
+
+void nbbs_destroy(struct buddy_pool *pool)
+{
+    struct nbbs_tree *t = tree_of(pool);
+    if (t == NULL) return;
+    munmap(t, t->bytes);
+    pool->nbbs = NULL;
+}
+
+void *nbbs_malloc(struct buddy_pool *pool, size_t size)
+{
+    struct nbbs_tree *t = tree_of(pool);
+    if (size == 0 || size > pool->numbytes) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t k = btok(size);
+    if (k < t->min_k) k = t->min_k;
+
+    //Pick up where the last allocation of this size left off, then wrap around
+    size_t d = pool->kval_m - k;
+    size_t first = UINT64_C(1) << d, end = first << 1;
+    size_t from = __atomic_load_n(&t->hint[d], __ATOMIC_RELAXED);
+    if (from < first || from >= end) from = first;
+    size_t n = scan_level(t, d, from, end);
+    if (n == 0 && from > first) n = scan_level(t, d, first, from);
+    if (n == 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    __atomic_store_n(&t->hint[d], n + 1, __ATOMIC_RELAXED);
+
+    size_t off = (n - first) << k;
+    __atomic_store_n(&t->order[off >> t->min_k], (uint8_t)d, __ATOMIC_RELAXED);
+    return (char *)pool->base + off;
+}
+
+/**
+ * @brief The node of an allocated block, 0 if ptr is not one.
+ */
+static size_t node_of(struct buddy_pool *pool, struct nbbs_tree *t, void *ptr)
+{
+    size_t off = (size_t)((char *)ptr - (char *)pool->base);
+    if ((char *)ptr < (char *)pool->base || off >= pool->numbytes || (off & ((UINT64_C(1) << t->min_k) - 1)))
+        return 0;
+    size_t d = __atomic_load_n(&t->order[off >> t->min_k], __ATOMIC_RELAXED);
+    size_t k = pool->kval_m - d;
+    if (d > t->depth || (off & ((UINT64_C(1) << k) - 1))) return 0;
+    size_t n = (UINT64_C(1) << d) + (off >> k);
+    return (load(t, n) & OCC) ? n : 0;
+}
+
+size_t nbbs_free(struct buddy_pool *pool, void *ptr)
+{
+    struct nbbs_tree *t = tree_of(pool);
+    size_t n = node_of(pool, t, ptr);
+    if (n == 0) return 0;
+    size_t d = depth_of(n);
+    free_node(t, n, upper_of(t, n));
+    if (d < t->top) __atomic_fetch_sub(&t->large, 1, __ATOMIC_SEQ_CST);
+    if (n < __atomic_load_n(&t->hint[d], __ATOMIC_RELAXED)) __atomic_store_n(&t->hint[d], n, __ATOMIC_RELAXED);
+    return UINT64_C(1) << (pool->kval_m - d);
+}
+
+size_t nbbs_usable_size(struct buddy_pool *pool, void *ptr)
+{
+    struct nbbs_tree *t = tree_of(pool);
+    size_t n = node_of(pool, t, ptr);
+    return n ? UINT64_C(1) << (pool->kval_m - depth_of(n)) : 0;
+}
+
+/**
+ * @brief Whether nothing below n is handed out. Above the top level a clear
+ * node says nothing about the small blocks below it.
+ */
+static bool subtree_clear(struct nbbs_tree *t, size_t n)
+{
+    if (load(t, n)) return false;
+    if (depth_of(n) >= t->top) return true;
+    return subtree_clear(t, 2 * n) && subtree_clear(t, 2 * n + 1);
+}
+
+static size_t walk_node(struct buddy_pool *pool, struct nbbs_tree *t, size_t n,
+                        void (*visit)(void *arg, void *ptr, size_t size, bool used), void *arg)
+{
+    size_t d = depth_of(n);
+    size_t k = pool->kval_m - d;
+    char *block = (char *)pool->base + ((n - (UINT64_C(1) << d)) << k);
+    uint8_t s = load(t, n);
+    if (s & OCC) {
+        visit(arg, block, UINT64_C(1) << k, true);
+        return 0;
+    }
+    if (subtree_clear(t, n)) {
+        visit(arg, block, UINT64_C(1) << k, false);
+        return 0;
+    }
+    if (d == t->depth || (s & (COAL_LEFT | COAL_RIGHT))) {
+        //Half marked leaves and flags of a free that never finished
+        visit(arg, block, UINT64_C(1) << k, false);
+        return 1;
+    }
+    size_t bad = 0;
+    for (size_t c = 2 * n; c <= 2 * n + 1; c++)
+    {
+        //Only large blocks mark the levels above the top one
+        bool marked = s & occ_bit(c);
+        bool clear = subtree_clear(t, c);
+        if (d < t->top ? marked && clear : marked == clear) bad++;
+        bad += walk_node(pool, t, c, visit, arg);
+    }
+    return bad;
+}
+
+size_t nbbs_walk(struct buddy_pool *pool, void (*visit)(void *arg, void *ptr, size_t size, bool used), void *arg)
+{
+    return walk_node(pool, tree_of(pool), 1, visit, arg);
+}
@@ -0,0 +1,88 @@
+#ifndef NBBS_H
+#define NBBS_H
+
+#include "lab.h"
+
+/*
+ * Non-blocking buddy engine used by pools created with BUDDY_ENGINE_NBBS,
+ * after the non-blocking buddy system of Marotta et al. The buddy tree is an
+ * array of status bytes changed only with compare and swap, so threads
+ * allocate and free at the same time without a lock and a thread stalled in
+ * the middle of a call never blocks the others. Blocks carry no header and
+ * are aligned to their size.
+ *
+ * These functions are internal to the library, callers go through
+ * buddy_malloc and buddy_free which dispatch on the engine bits of the pool
+ * flags.
+ */
+
+/**
+ * Deepest level of the tree. Pools larger than 2^(NBBS_MAX_DEPTH + SMALLEST_K)
+ * get larger smallest blocks so the tree stays within a few megabytes.
+ */
+#define NBBS_MAX_DEPTH 22
+
+/**
+ * Levels a small allocation marks above its block. Blocks up to
+ * 2^NBBS_CLIMB smallest blocks are small, larger ones mark up to the root
+ * and cost a scan of the top level.
+ */
+#define NBBS_CLIMB 12
+
+/**
+ * Map the tree of a pool, or clear it when the pool already has one, which
+ * turns the whole mapping into one free block.
+ *
+ * @param pool A pool whose base, numbytes and kval_m are set
+ * @return 0 on success, -1 with errno set if the tree could not be mapped
+ */
+int nbbs_init(struct buddy_pool *pool);
+
+/**
+ * Unmap the tree of a pool.
+ *
+ * @param pool The memory pool
+ */
+void nbbs_destroy(struct buddy_pool *pool);
+
+/**
+ * Allocate the first free block that fits size bytes, without locks. Sets
+ * errno to ENOMEM on failure.
+ *
+ * @param pool The memory pool
+ * @param size The number of bytes requested
+ * @return Pointer to the memory or NULL
+ */
+void *nbbs_malloc(struct buddy_pool *pool, size_t size);
+
+/**
+ * Free a block without locks, merging it with its free buddies. Pointers that
+ * are not the start of an allocated block are ignored.
+ *
+ * @param pool The memory pool
+ * @param ptr Pointer returned by nbbs_malloc
+ * @return The bytes released, 0 if nothing was freed
+ */
+size_t nbbs_free(struct buddy_pool *pool, void *ptr);
+
+/**
+ * Size of an allocated block.
+ *
+ * @param pool The memory pool
+ * @param ptr Pointer returned by nbbs_malloc
+ * @return The block size, 0 if ptr is not an allocated block
+ */
+size_t nbbs_usable_size(struct buddy_pool *pool, void *ptr);
+
+/**
+ * Visit every block of the pool in address order. The pool must not change
+ * during the walk.
+ *
+ * @param pool The memory pool
+ * @param visit Called with the block, its size and whether it is allocated
+ * @param arg Passed through to visit
+ * @return The number of tree nodes whose status disagrees with their children
+ */
+size_t nbbs_walk(struct buddy_pool *pool, void (*visit)(void *arg, void *ptr, size_t size, bool used), void *arg);
+
+#endif
@@ -0,0 +1,267 @@
+/**
+ * @file percpu.c
+ * @brief   Per-CPU block caches. A cache is an array of stacks, one per order,
+ *          each a count and an array of pointers. A pop reads the top pointer
+ *          and commits by storing the lower count, a push stores the pointer
+ *          above the top and commits by storing the higher count, so the one
+ *          store that publishes the change is the last instruction of the
+ *          restartable sequence.
+ */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "percpu.h"
+
+#if defined(__linux__) && defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PERCPU_RSEQ 1
+#endif
+#endif
+
+/**
+ * The stacks of one CPU, a cache line apart from the next CPU's.
+ */
+struct percpu_cache
+{
+    uint64_t count[PERCPU_ORDERS];
+    void *slot[PERCPU_ORDERS][PERCPU_SLOTS];
+    pthread_mutex_t lock;               /*Only taken without restartable sequences*/
+} __attribute__((aligned(64)));
+
+struct buddy_percpu
+{
+    size_t bytes;                       /*Size of the mapping*/
+    size_t cpus;                        /*CPUs with a cache, higher numbers miss*/
+    bool rseq;                          /*Restartable sequences are registered*/
+    struct percpu_cache cpu[];
+};
+
+#ifdef PERCPU_RSEQ
+static inline struct rseq *rseq_area(void)
+{
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/*
+ * Both sequences register a descriptor of the code between labels 1 and 2
+ * with the kernel before they start. If the thread is preempted, migrated or
+ * takes a signal in between, the kernel sends it to label 4, right behind the
+ * signature it checks, and the sequence starts over with a fresh CPU number.
+ */
+#define RSEQ_DESCRIPTOR \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0x0, 0x0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, %[rseq_cs]\n\t"
+
+#define RSEQ_ABORT \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long 0x53053053\n\t" \
+    "4:\n\t" \
+    "jmp %l[abort]\n\t" \
+    ".popsection\n\t"
+
+/*
+ * A thread whose registration failed reads a negative cpu_id that never
+ * matches, so the sequences would abort forever. It gets an empty or full
+ * cache instead; percpu_usable keeps such threads away from the caches.
+ */
+static inline bool rseq_failed(struct rseq *rs)
+{
+    return (int32_t)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED) < 0;
+}
+
+static void *rseq_pop(struct buddy_percpu *pc, size_t idx)
+{
+    struct rseq *rs = rseq_area();
+    if (rseq_failed(rs)) return NULL;
+    void *ptr;
+    for (;;)
+    {
+        uint32_t cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+        if (cpu >= pc->cpus) return NULL;
+        struct percpu_cache *c = &pc->cpu[cpu];
+        __asm__ __volatile__ goto(
+            RSEQ_DESCRIPTOR
+            "1:\n\t"
+            "cmpl %[cpu], %[cpu_id]\n\t"
+            "jnz %l[abort]\n\t"
+            "movq %[count], %%rcx\n\t"
+            "testq %%rcx, %%rcx\n\t"
+            "jz %l[empty]\n\t"
+            "subq $1, %%rcx\n\t"
+            "movq (%[slots], %%rcx, 8), %%rdx\n\t"
+            "movq %%rdx, %[ptr]\n\t"
+            "movq %%rcx, %[count]\n\t"
+            "2:\n\t"
+            RSEQ_ABORT
+            : [rseq_cs] "=m" (rs->rseq_cs), [count] "+m" (c->count[idx]), [ptr] "=m" (ptr)
+            : [cpu_id] "m" (rs->cpu_id), [cpu] "r" (cpu),
+              [slots] "r" (c->slot[idx]), "m" (c->slot[idx])
+            : "cc", "rax", "rcx", "rdx"
+            : abort, empty);
+        return ptr;
+    abort:
+        continue;
+    empty:
+        return NULL;
+    }
+}
+
+static bool rseq_push(struct buddy_percpu *pc, size_t idx, void *ptr)
+{
+    struct rseq *rs = rseq_area();
+    if (rseq_failed(rs)) return false;
+    for (;;)
+    {
+        uint32_t cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+        if (cpu >= pc->cpus) return false;
+        struct percpu_cache *c = &pc->cpu[cpu];
+        __asm__ __volatile__ goto(
+            RSEQ_DESCRIPTOR
+            "1:\n\t"
+            "cmpl %[cpu], %[cpu_id]\n\t"
+            "jnz %l[abort]\n\t"
+            "movq %[count], %%rcx\n\t"
+            "cmpq %[max], %%rcx\n\t"
+            "jae %l[full]\n\t"
+            "movq %[ptr], (%[slots], %%rcx, 8)\n\t"
+            "addq $1, %%rcx\n\t"
+            "movq %%rcx, %[count]\n\t"
+            "2:\n\t"
+            RSEQ_ABORT
+            : [rseq_cs] "=m" (rs->rseq_cs), [count] "+m" (c->count[idx]), "+m" (c->slot[idx])
+            : [cpu_id] "m" (rs->cpu_id), [cpu] "r" (cpu),
+              [slots] "r" (c->slot[idx]), [ptr] "r" (ptr), [max] "i" (PERCPU_SLOTS)
+            : "cc", "rax", "rcx"
+            : abort, full);
+        return true;
+    abort:
+        continue;
+    full:
+        return false;
+    }
+}
+
+/**
+ * @brief glibc registers every thread when the kernel supports it, unless
+ * told not to, and a registered thread sees a valid CPU number.
+ */
+static bool rseq_registered(void)
+{
+    return __rseq_size > 0 &&
+           (int32_t)__atomic_load_n(&rseq_area()->cpu_id, __ATOMIC_RELAXED) >= 0;
+}
+#endif
+
+/**
+ * @brief The cache of the CPU the thread runs on, locked. The thread may move
+ * right after, which the lock makes harmless.
+ */
+static struct percpu_cache *cache_lock(struct buddy_percpu *pc)
+{
+    int cpu = sched_getcpu();
+    if (cpu < 0 || (size_t)cpu >= pc->cpus) return NULL;
+    struct percpu_cache *c = &pc->cpu[cpu];
+    pthread_mutex_lock(&c->lock);
+    return c;
+}
+
+int percpu_init(struct buddy_pool *pool)
+{
+    int cpus = get_nprocs_conf();
+    if (cpus < 1) cpus = 1;
+    size_t bytes = offsetof(struct buddy_percpu, cpu) + (size_t)cpus * sizeof(struct percpu_cache);
+    struct buddy_percpu *pc = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pc == MAP_FAILED) return -1;
+    pc->bytes = bytes;
+    pc->cpus = (size_t)cpus;
+#ifdef PERCPU_RSEQ
+    pc->rseq = rseq_registered();
+#endif
+    for (size_t i = 0; i < pc->cpus; i++)
+        pthread_mutex_init(&pc->cpu[i].lock, NULL);
+    pool->percpu = pc;
+    return 0;
+}
+
+void percpu_destroy(struct buddy_pool *pool)
+{
+    struct buddy_percpu *pc = pool->percpu;
+    if (pc == NULL) return;
+    for (size_t i = 0; i < pc->cpus; i++)
+        pthread_mutex_destroy(&pc->cpu[i].lock);
+    munmap(pc, pc->bytes);
+    pool->percpu = NULL;
+}
+
+bool percpu_usable(struct buddy_pool *pool)
+{
+#ifdef PERCPU_RSEQ
+    //Mixing in the mutex would race with the threads that do not take it
+    if (pool->percpu->rseq) return rseq_registered();
+#endif
+    (void)pool;
+    return true;
+}
+
+void *percpu_pop(struct buddy_pool *pool, size_t idx)
+{
+    struct buddy_percpu *pc = pool->percpu;
+#ifdef PERCPU_RSEQ
+    if (pc->rseq) return rseq_pop(pc, idx);
+#endif
+    struct percpu_cache *c = cache_lock(pc);
+    if (c == NULL) return NULL;
+    void *ptr = c->count[idx] ? c->slot[idx][--c->count[idx]] : NULL;
+    pthread_mutex_unlock(&c->lock);
+    return ptr;
+}
+
+bool percpu_push(struct buddy_pool *pool, size_t idx, void *ptr)
+{
+    struct buddy_percpu *pc = pool->percpu;
+#ifdef PERCPU_RSEQ
+    if (pc->rseq) return rseq_push(pc, idx, ptr);
+#endif
+    struct percpu_cache *c = cache_lock(pc);
+    if (c == NULL) return false;
+    bool room = c->count[idx] < PERCPU_SLOTS;
+    if (room) c->slot[idx][c->count[idx]++] = ptr;
+    pthread_mutex_unlock(&c->lock);
+    return room;
+}
+
+size_t percpu_flush(struct buddy_pool *pool, void (*release)(struct buddy_pool *pool, void *ptr))
+{
+    struct buddy_percpu *pc = pool->percpu;
+    size_t flushed = 0;
+    for (size_t i = 0; i < pc->cpus; i++)
+        for (size_t idx = 0; idx < PERCPU_ORDERS; idx++)
+        {
+            struct percpu_cache *c = &pc->cpu[i];
+            while (c->count[idx])
+            {
+                void *ptr = c->slot[idx][--c->count[idx]];
+                if (release) release(pool, ptr);
+                flushed++;
+            }
+        }
+    return flushed;
+}
@@ -0,0 +1,84 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include "lab.h"
+
+/*
+ * Per-CPU caches of small blocks used by pools created with BUDDY_PERCPU.
+ * Each CPU keeps a stack of freed blocks for each of the smallest orders.
+ * On Linux x86-64 a push or pop is a restartable sequence: the kernel
+ * restarts it if the thread is preempted or moved to another CPU before its
+ * final store, so it needs neither a lock nor an atomic instruction. Without
+ * restartable sequences each CPU's stacks sit behind a mutex of their own,
+ * which is correct whichever CPU the thread ends up on.
+ *
+ * These functions are internal to the library, the caches are filled and
+ * drained by buddy_malloc and buddy_free under the pool lock.
+ */
+
+/**
+ * Orders with a cache, from SMALLEST_K up.
+ */
+#define PERCPU_ORDERS 4
+
+/**
+ * Blocks each CPU keeps per order, and how many move between a cache and the
+ * pool at once when the cache runs empty or full.
+ */
+#define PERCPU_SLOTS 32
+#define PERCPU_BATCH (PERCPU_SLOTS / 2)
+
+/**
+ * Map the caches of a pool, one per configured CPU.
+ *
+ * @param pool The memory pool
+ * @return 0 on success, -1 with errno set if they could not be mapped
+ */
+int percpu_init(struct buddy_pool *pool);
+
+/**
+ * Unmap the caches of a pool, the blocks in them are not freed.
+ *
+ * @param pool The memory pool
+ */
+void percpu_destroy(struct buddy_pool *pool);
+
+/**
+ * Whether the calling thread may use the caches. When they run on restartable
+ * sequences a thread that could not register one must leave them alone and
+ * use the pool.
+ *
+ * @param pool The memory pool
+ * @return true if percpu_pop and percpu_push may be called
+ */
+bool percpu_usable(struct buddy_pool *pool);
+
+/**
+ * Take a block of order SMALLEST_K + idx from the cache of the current CPU.
+ *
+ * @param pool The memory pool
+ * @param idx Order above SMALLEST_K, below PERCPU_ORDERS
+ * @return The block or NULL if the cache is empty
+ */
+void *percpu_pop(struct buddy_pool *pool, size_t idx);
+
+/**
+ * Put a block of order SMALLEST_K + idx on the cache of the current CPU.
+ *
+ * @param pool The memory pool
+ * @param idx Order above SMALLEST_K, below PERCPU_ORDERS
+ * @param ptr The user pointer of the block
+ * @return false if the cache is full
+ */
+bool percpu_push(struct buddy_pool *pool, size_t idx, void *ptr);
+
+/**
+ * Empty the caches of every CPU. No other thread may use the pool.
+ *
+ * @param pool The memory pool
+ * @param release Called with each cached block, may be NULL to drop them
+ * @return The number of blocks that were cached
+ */
+size_t percpu_flush(struct buddy_pool *pool, void (*release)(struct buddy_pool *pool, void *ptr));
+
+#endif
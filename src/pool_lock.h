@@ -0,0 +1,17 @@
+#ifndef POOL_LOCK_H
+#define POOL_LOCK_H
+
+#include <pthread.h>
+#include "lab.h"
+
+/*
+ * Every public call on a BUDDY_LOCKED pool runs under the pool's mutex,
+ * including the ones outside lab.c that read state the allocation paths
+ * update. Internal to the library.
+ */
+#define POOL_LOCK(pool) \
+    do { if ((pool) != NULL && ((pool)->flags & BUDDY_LOCKED)) pthread_mutex_lock(&(pool)->lock); } while (0)
+#define POOL_UNLOCK(pool) \
+    do { if ((pool) != NULL && ((pool)->flags & BUDDY_LOCKED)) pthread_mutex_unlock(&(pool)->lock); } while (0)
+
+#endif
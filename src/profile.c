@@ -0,0 +1,313 @@
+/**
+ * @file profile.c
+ * @brief   Sampling heap profiler for buddy pools. Sampled blocks are kept in an
+ *          open addressing table keyed by pointer, call stacks are aggregated in
+ *          a second table keyed by a hash of the stack. Both tables are mapped
+ *          with mmap so the profiler never calls back into an allocator.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <execinfo.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "profile.h"
+#include "pool_lock.h"
+
+#define LIVE_SLOTS   (UINT32_C(1) << 16)  /*Sampled blocks tracked at once, half of them usable*/
+#define BUCKET_SLOTS (UINT32_C(1) << 14)  /*Distinct call stacks, half of them usable*/
+#define SKIP_FRAMES  2                    /*profile_malloc and buddy_malloc*/
+
+/**
+ * Everything sampled from one call stack.
+ */
+struct profile_bucket
+{
+    uint64_t hash;                      /*Hash of the stack*/
+    int depth;                          /*Frames in stack, 0 for an empty slot*/
+    void *stack[PROFILE_MAX_DEPTH];     /*Return addresses, innermost first*/
+    size_t alloc_count;                 /*Samples taken since the profiler started*/
+    size_t alloc_bytes;                 /*Bytes of those samples*/
+    size_t live_count;                  /*Samples not freed yet*/
+    size_t live_bytes;                  /*Bytes of those samples*/
+};
+
+/**
+ * A sampled block that has not been freed.
+ */
+struct profile_live
+{
+    void *ptr;                          /*The user pointer, NULL for an empty slot*/
+    size_t size;                        /*Bytes requested*/
+    uint32_t bucket;                    /*Index of the call stack bucket*/
+};
+
+struct buddy_profiler
+{
+    size_t rate;                        /*Average bytes between samples*/
+    int64_t until_sample;               /*Bytes left before the next sample*/
+    uint64_t rng;                       /*xorshift state for the sample gaps*/
+    size_t live_used;                   /*Occupied live slots*/
+    size_t buckets_used;                /*Occupied bucket slots*/
+    size_t dropped;                     /*Samples lost because a table was full*/
+    struct profile_live live[LIVE_SLOTS];
+    struct profile_bucket buckets[BUCKET_SLOTS];
+};
+
+static inline uint64_t hash_ptr(const void *ptr)
+{
+    return ((uint64_t)(uintptr_t)ptr >> 3) * UINT64_C(0x9E3779B97F4A7C15);
+}
+
+static uint64_t rng_next(struct buddy_profiler *p)
+{
+    p->rng ^= p->rng << 13;
+    p->rng ^= p->rng >> 7;
+    p->rng ^= p->rng << 17;
+    return p->rng;
+}
+
+/**
+ * @brief log2 good to about 1e-4, enough for sample gaps and no libm needed.
+ */
+static double fast_log2(double x)
+{
+    union { double d; uint64_t u; } v = {x};
+    int e = (int)((v.u >> 52) & 0x7ff) - 1023;
+    v.u = (v.u & ((UINT64_C(1) << 52) - 1)) | (UINT64_C(1023) << 52);
+    double m = v.d;
+    return e + (-1.7417939 + (2.8212026 + (-1.4699568 + (0.44717955 - 0.056570851 * m) * m) * m) * m);
+}
+
+/**
+ * @brief Exponentially distributed gap with a mean of rate bytes.
+ */
+static int64_t next_gap(struct buddy_profiler *p)
+{
+    double u = (double)((rng_next(p) >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double gap = -fast_log2(u) * 0.6931471805599453 * (double)p->rate;
+    return gap < 1.0 ? 1 : (int64_t)gap;
+}
+
+int buddy_profile_start(struct buddy_pool *pool, size_t sample_bytes)
+{
+    if (pool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pool->prof == NULL) {
+        struct buddy_profiler *p = mmap(NULL, sizeof(*p), PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) return -1;
+        p->rng = hash_ptr(pool) | 1;
+        //The first backtrace may load the unwinder, get that out of the way now
+        void *frames[1];
+        backtrace(frames, 1);
+        pool->prof = p;
+    }
+    pool->prof->rate = sample_bytes ? sample_bytes : PROFILE_DEFAULT_RATE;
+    pool->prof->until_sample = next_gap(pool->prof);
+    return 0;
+}
+
+void buddy_profile_stop(struct buddy_pool *pool)
+{
+    if (pool == NULL || pool->prof == NULL) return;
+    munmap(pool->prof, sizeof(*pool->prof));
+    pool->prof = NULL;
+}
+
+/**
+ * @brief Find or create the bucket for a stack.
+ *
+ * @return The bucket index or UINT32_MAX when the table is full
+ */
+static uint32_t bucket_for(struct buddy_profiler *p, void **stack, int depth)
+{
+    uint64_t h = 0;
+    for (int i = 0; i < depth; i++)
+        h = (h ^ hash_ptr(stack[i])) * UINT64_C(0x100000001B3);
+
+    for (uint32_t i = (uint32_t)h & (BUCKET_SLOTS - 1);; i = (i + 1) & (BUCKET_SLOTS - 1))
+    {
+        struct profile_bucket *b = &p->buckets[i];
+        if (b->depth == 0)
+        {
+            if (p->buckets_used >= BUCKET_SLOTS / 2) return UINT32_MAX;
+            p->buckets_used++;
+            b->hash = h;
+            b->depth = depth;
+            memcpy(b->stack, stack, (size_t)depth * sizeof(void *));
+            return i;
+        }
+        if (b->hash == h && b->depth == depth && !memcmp(b->stack, stack, (size_t)depth * sizeof(void *)))
+            return i;
+    }
+}
+
+__attribute__((noinline))
+void profile_malloc(struct buddy_pool *pool, void *ptr, size_t size)
+{
+    struct buddy_profiler *p = pool->prof;
+    p->until_sample -= (int64_t)size;
+    if (p->until_sample > 0) return;
+    p->until_sample = next_gap(p);
+
+    void *frames[PROFILE_MAX_DEPTH + SKIP_FRAMES];
+    int depth = backtrace(frames, PROFILE_MAX_DEPTH + SKIP_FRAMES) - SKIP_FRAMES;
+    if (depth <= 0 || p->live_used >= LIVE_SLOTS / 2) {
+        p->dropped++;
+        return;
+    }
+    uint32_t b = bucket_for(p, frames + SKIP_FRAMES, depth);
+    if (b == UINT32_MAX) {
+        p->dropped++;
+        return;
+    }
+
+    struct profile_bucket *bucket = &p->buckets[b];
+    bucket->alloc_count++;
+    bucket->alloc_bytes += size;
+    bucket->live_count++;
+    bucket->live_bytes += size;
+
+    uint32_t i = (uint32_t)hash_ptr(ptr) & (LIVE_SLOTS - 1);
+    while (p->live[i].ptr != NULL)
+        i = (i + 1) & (LIVE_SLOTS - 1);
+    p->live[i].ptr = ptr;
+    p->live[i].size = size;
+    p->live[i].bucket = b;
+    p->live_used++;
+}
+
+/**
+ * @brief Remove slot i from the live table, shifting later entries of the
+ * same probe run back so lookups never stop early.
+ */
+static void live_remove(struct buddy_profiler *p, uint32_t i)
+{
+    uint32_t mask = LIVE_SLOTS - 1;
+    uint32_t j = i;
+    p->live_used--;
+    for (;;)
+    {
+        p->live[i].ptr = NULL;
+        for (;;)
+        {
+            j = (j + 1) & mask;
+            if (p->live[j].ptr == NULL) return;
+            uint32_t home = (uint32_t)hash_ptr(p->live[j].ptr) & mask;
+            //Entries whose home lies cyclically in (i, j] are still reachable
+            bool reachable = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (!reachable) break;
+        }
+        p->live[i] = p->live[j];
+        i = j;
+    }
+}
+
+void profile_free(struct buddy_pool *pool, void *ptr)
+{
+    struct buddy_profiler *p = pool->prof;
+    if (p->live_used == 0) return;
+    for (uint32_t i = (uint32_t)hash_ptr(ptr) & (LIVE_SLOTS - 1);; i = (i + 1) & (LIVE_SLOTS - 1))
+    {
+        struct profile_live *l = &p->live[i];
+        if (l->ptr == NULL) return;
+        if (l->ptr == ptr)
+        {
+            struct profile_bucket *b = &p->buckets[l->bucket];
+            b->live_count--;
+            b->live_bytes -= l->size;
+            live_remove(p, i);
+            return;
+        }
+    }
+}
+
+void profile_forget_live(struct buddy_pool *pool)
+{
+    struct buddy_profiler *p = pool->prof;
+    memset(p->live, 0, sizeof(p->live));
+    p->live_used = 0;
+    for (uint32_t i = 0; i < BUCKET_SLOTS; i++)
+    {
+        p->buckets[i].live_count = 0;
+        p->buckets[i].live_bytes = 0;
+    }
+}
+
+int buddy_profile_dump(struct buddy_pool *pool, FILE *out)
+{
+    if (pool == NULL || pool->prof == NULL || out == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct buddy_profiler *p = pool->prof;
+
+    //The allocating threads of a BUDDY_LOCKED pool update the buckets under the lock
+    POOL_LOCK(pool);
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    for (uint32_t i = 0; i < BUCKET_SLOTS; i++)
+    {
+        live_count += p->buckets[i].live_count;
+        live_bytes += p->buckets[i].live_bytes;
+        alloc_count += p->buckets[i].alloc_count;
+        alloc_bytes += p->buckets[i].alloc_bytes;
+    }
+
+    fprintf(out, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+            live_count, live_bytes, alloc_count, alloc_bytes, p->rate);
+    for (uint32_t i = 0; i < BUCKET_SLOTS; i++)
+    {
+        struct profile_bucket *b = &p->buckets[i];
+        if (b->depth == 0) continue;
+        fprintf(out, "%6zu: %8zu [%6zu: %8zu] @", b->live_count, b->live_bytes,
+                b->alloc_count, b->alloc_bytes);
+        for (int f = 0; f < b->depth; f++)
+            fprintf(out, " %p", b->stack[f]);
+        fputc('\n', out);
+    }
+    POOL_UNLOCK(pool);
+
+    //pprof needs the mappings to symbolize the addresses
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps)
+    {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0)
+            fwrite(buf, 1, n, out);
+        fclose(maps);
+    }
+    //Whatever the failed write left in errno may be gone by now
+    if (ferror(out)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+size_t profile_report_live(struct buddy_pool *pool, FILE *out)
+{
+    struct buddy_profiler *p = pool->prof;
+    size_t samples = 0;
+    for (uint32_t i = 0; i < BUCKET_SLOTS; i++)
+    {
+        struct profile_bucket *b = &p->buckets[i];
+        if (b->depth == 0 || b->live_count == 0) continue;
+        samples += b->live_count;
+        if (out == NULL) continue;
+        fprintf(out, "buddy: %zu sampled blocks (%zu bytes) allocated at:\n", b->live_count, b->live_bytes);
+        //backtrace_symbols_fd writes straight to the descriptor without allocating
+        fflush(out);
+        backtrace_symbols_fd(b->stack, b->depth, fileno(out));
+    }
+    return samples;
+}
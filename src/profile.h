@@ -0,0 +1,76 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * The deepest call stack recorded for a sampled allocation.
+   */
+#define PROFILE_MAX_DEPTH 32
+
+  /**
+   * The default average number of bytes between two samples.
+   */
+#define PROFILE_DEFAULT_RATE (UINT64_C(512) << 10)
+
+  /**
+   * Start sampling the allocations of a pool. About once every sample_bytes
+   * bytes handed out by buddy_malloc the call stack is captured with
+   * backtrace() and the block is tracked until it is passed to buddy_free.
+   * The gap between samples is drawn from an exponential distribution so
+   * every byte has the same chance of being sampled.
+   *
+   * While the profiler is off buddy_malloc and buddy_free only test one
+   * pointer, so it can stay compiled into production builds.
+   *
+   * @param pool The memory pool to profile
+   * @param sample_bytes Average bytes between samples, 0 selects PROFILE_DEFAULT_RATE
+   * @return 0 on success, -1 with errno set if the tables could not be mapped
+   */
+  int buddy_profile_start(struct buddy_pool *pool, size_t sample_bytes);
+
+  /**
+   * Stop sampling and release everything the profiler recorded.
+   *
+   * @param pool The memory pool
+   */
+  void buddy_profile_stop(struct buddy_pool *pool);
+
+  /**
+   * Write the profile in the legacy gperftools heap format understood by
+   * pprof. Each line carries the live (in use) and cumulative (allocated)
+   * sample counts of one call stack, so both views come from one dump:
+   * `pprof -inuse_space` and `pprof -alloc_space`. The header names the
+   * sampling rate so pprof scales the samples back to real sizes.
+   *
+   * @param pool The memory pool
+   * @param out Where to write the profile
+   * @return 0 on success, -1 with errno set to EINVAL if profiling is off or
+   *         to EIO if writing to out failed
+   */
+  int buddy_profile_dump(struct buddy_pool *pool, FILE *out);
+
+  /*
+   * Hooks called by buddy_malloc/buddy_free/buddy_reset while pool->prof is set.
+   */
+  void profile_malloc(struct buddy_pool *pool, void *ptr, size_t size);
+  void profile_free(struct buddy_pool *pool, void *ptr);
+  void profile_forget_live(struct buddy_pool *pool);
+
+  /*
+   * Print the call stacks that still have live samples, used by buddy_leak_report.
+   * Returns the number of live samples.
+   */
+  size_t profile_report_live(struct buddy_pool *pool, FILE *out);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
@@ -0,0 +1,124 @@
+/**
+ * @file registry.c
+ * @brief   Radix tree from addresses to pools. Three levels of 10, 9 and 9 bits
+ *          cover bits 20-47 of an address. Entries hold a pool pointer, or a
+ *          child node pointer tagged with the low bit.
+ */
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "registry.h"
+
+#define REGISTRY_LEVELS 3
+#define REGISTRY_TOP_BITS 10
+#define REGISTRY_NODE_BITS 9
+#define REGISTRY_ADDR_BITS (REGISTRY_GRANULE_K + REGISTRY_TOP_BITS + 2 * REGISTRY_NODE_BITS)
+#define REGISTRY_CHILD 0x1
+
+typedef _Atomic uintptr_t registry_entry;
+
+static const unsigned level_shift[REGISTRY_LEVELS] = {
+    REGISTRY_GRANULE_K + 2 * REGISTRY_NODE_BITS,
+    REGISTRY_GRANULE_K + REGISTRY_NODE_BITS,
+    REGISTRY_GRANULE_K,
+};
+
+static registry_entry registry_top[1 << REGISTRY_TOP_BITS];
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t level_entries(unsigned level)
+{
+    return level == 0 ? (size_t)1 << REGISTRY_TOP_BITS : (size_t)1 << REGISTRY_NODE_BITS;
+}
+
+static inline registry_entry *child_of(uintptr_t entry)
+{
+    return (registry_entry *)(entry & ~(uintptr_t)REGISTRY_CHILD);
+}
+
+/**
+ * @brief Store value in every entry covering [lo, hi) below node, splitting
+ * entries that are only partly covered. With expect set only entries that
+ * hold expect are changed and no nodes are created.
+ *
+ * @return -1 if a node could not be mapped
+ */
+static int registry_fill(registry_entry *node, unsigned level, uintptr_t lo, uintptr_t hi,
+                         uintptr_t value, uintptr_t expect)
+{
+    unsigned shift = level_shift[level];
+    uintptr_t span = (uintptr_t)1 << shift;
+    for (uintptr_t addr = lo; addr < hi;)
+    {
+        uintptr_t end = (addr | (span - 1)) + 1;
+        registry_entry *slot = &node[(addr >> shift) & (level_entries(level) - 1)];
+        uintptr_t entry = atomic_load_explicit(slot, memory_order_relaxed);
+
+        if (addr == (addr & ~(span - 1)) && hi >= end && !(entry & REGISTRY_CHILD)) {
+            //The whole range of the entry
+            if (!expect || entry == expect) atomic_store_explicit(slot, value, memory_order_release);
+        } else if (entry & REGISTRY_CHILD) {
+            if (registry_fill(child_of(entry), level + 1, addr, hi < end ? hi : end, value, expect)) return -1;
+        } else if (!expect) {
+            //Readers only see the child once it is filled in
+            registry_entry *child = mmap(NULL, level_entries(level + 1) * sizeof(registry_entry),
+                                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (child == MAP_FAILED) {
+                errno = ENOMEM;
+                return -1;
+            }
+            if (registry_fill(child, level + 1, addr, hi < end ? hi : end, value, 0)) return -1;
+            atomic_store_explicit(slot, (uintptr_t)child | REGISTRY_CHILD, memory_order_release);
+        }
+        addr = end;
+    }
+    return 0;
+}
+
+int registry_add(struct buddy_pool *pool)
+{
+    uintptr_t lo = (uintptr_t)pool->base;
+    uintptr_t hi = lo + pool->numbytes;
+    //Addresses past the tree, from 5 level page tables, are not tracked
+    if (hi > (uintptr_t)1 << REGISTRY_ADDR_BITS) return 0;
+    if ((lo | hi) & (((uintptr_t)1 << REGISTRY_GRANULE_K) - 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&registry_lock);
+    int rval = registry_fill(registry_top, 0, lo, hi, (uintptr_t)pool, 0);
+    pthread_mutex_unlock(&registry_lock);
+    return rval;
+}
+
+void registry_remove(struct buddy_pool *pool)
+{
+    uintptr_t lo = (uintptr_t)pool->base;
+    uintptr_t hi = lo + pool->numbytes;
+    if (hi > (uintptr_t)1 << REGISTRY_ADDR_BITS) return;
+    pthread_mutex_lock(&registry_lock);
+    registry_fill(registry_top, 0, lo, hi, 0, (uintptr_t)pool);
+    pthread_mutex_unlock(&registry_lock);
+}
+
+struct buddy_pool *registry_lookup(const void *ptr)
+{
+    uintptr_t addr = (uintptr_t)ptr;
+    if (addr >> REGISTRY_ADDR_BITS) return NULL;
+    registry_entry *node = registry_top;
+    uintptr_t entry = 0;
+    for (unsigned level = 0; level < REGISTRY_LEVELS; level++)
+    {
+        entry = atomic_load_explicit(&node[(addr >> level_shift[level]) & (level_entries(level) - 1)],
+                                     memory_order_acquire);
+        if (!(entry & REGISTRY_CHILD)) break;
+        node = child_of(entry);
+    }
+    return (struct buddy_pool *)entry;
+}
@@ -0,0 +1,48 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include "lab.h"
+
+/*
+ * Global map from addresses to the pools that own them, behind buddy_pool_of
+ * and buddy_free_any. Pools are added by buddy_init_ex and removed by
+ * buddy_destroy, these functions are internal to the library.
+ *
+ * The map is a radix tree over bits 20-47 of the address, one entry per
+ * 2^MIN_K bytes, which is why pool mappings are aligned to 2^MIN_K. An
+ * entry at an upper level holds the pool directly when the pool covers its
+ * whole range, so a lookup is at most three loads. Writers serialize on a
+ * mutex, readers take no lock: nodes are never freed and entries are
+ * published with release stores.
+ */
+
+/**
+ * Number of low address bits below the registry's granule.
+ */
+#define REGISTRY_GRANULE_K MIN_K
+
+/**
+ * Enter the mapping of a pool.
+ *
+ * @param pool A pool whose base and numbytes are set, base aligned to 2^REGISTRY_GRANULE_K
+ * @return 0 on success, -1 with errno set to ENOMEM if a node could not be mapped
+ */
+int registry_add(struct buddy_pool *pool);
+
+/**
+ * Remove the mapping of a pool. Entries that no longer point to the pool are
+ * left alone, so removing a pool twice is harmless.
+ *
+ * @param pool The pool
+ */
+void registry_remove(struct buddy_pool *pool);
+
+/**
+ * The pool whose mapping holds ptr.
+ *
+ * @param ptr Any address
+ * @return The pool or NULL
+ */
+struct buddy_pool *registry_lookup(const void *ptr);
+
+#endif
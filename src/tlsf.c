@@ -0,0 +1,345 @@
+/**
+ * @file tlsf.c
+ * @brief   Two level segregated fit engine for the buddy pool. Free blocks are kept
+ *          in lists indexed by a first level (power of two) and a second level
+ *          (linear subdivision of that power). Two bitmaps say which lists are
+ *          non-empty, so finding, splitting and merging blocks never loops.
+ */
+#include <stddef.h>
+#include <string.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "tlsf.h"
+
+#define SL_LOG2         5                       /*Second level lists per power of two (2^5 = 32)*/
+#define SL_COUNT        (1 << SL_LOG2)
+#define ALIGN_LOG2      3                       /*Block sizes are multiples of 8 bytes*/
+#define ALIGN           (1 << ALIGN_LOG2)
+#define FL_SHIFT        (SL_LOG2 + ALIGN_LOG2)  /*Sizes below 2^FL_SHIFT share first level 0*/
+#define SMALL_BLOCK     (1 << FL_SHIFT)
+#define FL_COUNT        (MAX_K - FL_SHIFT + 1)
+
+#define TLSF_FREE       0x1                     /*Block is on a free list*/
+#define TLSF_PREV_FREE  0x2                     /*Physically previous block is free*/
+#define TLSF_FLAGS      (TLSF_FREE | TLSF_PREV_FREE)
+
+/**
+ * Block header. prev_phys is only valid while the previous block is free and
+ * lives in the last word of that block, so a used block costs one size_t of
+ * overhead. next_free and prev_free overlap user data and are only used while
+ * the block is free.
+ */
+struct tlsf_block
+{
+    struct tlsf_block *prev_phys;   /*Physically previous block when it is free*/
+    size_t size;                    /*Bytes of payload, low bits hold TLSF_FLAGS*/
+    struct tlsf_block *next_free;   /*next block in the same free list*/
+    struct tlsf_block *prev_free;   /*prev block in the same free list*/
+};
+
+#define BLOCK_OVERHEAD  sizeof(size_t)
+#define BLOCK_START     offsetof(struct tlsf_block, next_free)
+#define BLOCK_MIN       (sizeof(struct tlsf_block) - sizeof(struct tlsf_block *))
+
+/**
+ * Control structure placed at the start of the pool mapping.
+ */
+struct tlsf_control
+{
+    struct tlsf_block null;                     /*Empty list sentinel*/
+    uint64_t fl_bitmap;                         /*Which first levels have a free block*/
+    uint32_t sl_bitmap[FL_COUNT];               /*Which second levels have a free block*/
+    struct tlsf_block *blocks[FL_COUNT][SL_COUNT];
+};
+
+static inline int fls_size(size_t x)
+{
+    return 63 - __builtin_clzll((unsigned long long)x);
+}
+
+static inline size_t block_size(const struct tlsf_block *block)
+{
+    return block->size & ~(size_t)TLSF_FLAGS;
+}
+
+static inline void *block_to_ptr(struct tlsf_block *block)
+{
+    return (char *)block + BLOCK_START;
+}
+
+static inline struct tlsf_block *block_from_ptr(void *ptr)
+{
+    return (struct tlsf_block *)((char *)ptr - BLOCK_START);
+}
+
+/**
+ * @brief The physically next block starts in the last word of this one.
+ */
+static inline struct tlsf_block *block_next(struct tlsf_block *block)
+{
+    return (struct tlsf_block *)((char *)block_to_ptr(block) + block_size(block) - BLOCK_OVERHEAD);
+}
+
+/**
+ * @brief Mark a block free and tell its physical successor about it.
+ */
+static inline void block_mark_free(struct tlsf_block *block)
+{
+    struct tlsf_block *next = block_next(block);
+    next->prev_phys = block;
+    next->size |= TLSF_PREV_FREE;
+    block->size |= TLSF_FREE;
+}
+
+static inline void block_mark_used(struct tlsf_block *block)
+{
+    block_next(block)->size &= ~(size_t)TLSF_PREV_FREE;
+    block->size &= ~(size_t)TLSF_FREE;
+}
+
+static inline struct tlsf_control *control(struct buddy_pool *pool)
+{
+    return (struct tlsf_control *)pool->base;
+}
+
+/**
+ * @brief Map a block size to the list that holds blocks of that size.
+ */
+static inline void mapping_insert(size_t size, int *fl, int *sl)
+{
+    if (size < SMALL_BLOCK)
+    {
+        *fl = 0;
+        *sl = (int)(size / (SMALL_BLOCK / SL_COUNT));
+    }
+    else
+    {
+        int f = fls_size(size);
+        *sl = (int)(size >> (f - SL_LOG2)) ^ SL_COUNT;
+        *fl = f - (FL_SHIFT - 1);
+    }
+}
+
+/**
+ * @brief Map a request to the first list whose blocks are all large enough.
+ */
+static inline void mapping_search(size_t size, int *fl, int *sl)
+{
+    if (size >= SMALL_BLOCK)
+    {
+        size += (UINT64_C(1) << (fls_size(size) - SL_LOG2)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
+
+static struct tlsf_block *search_suitable_block(struct tlsf_control *ctl, int *fl, int *sl)
+{
+    if (*fl >= FL_COUNT) return NULL;
+
+    uint32_t sl_map = ctl->sl_bitmap[*fl] & (~UINT32_C(0) << *sl);
+    if (!sl_map)
+    {
+        //Nothing left on this first level, take the smallest larger one
+        uint64_t fl_map = *fl + 1 < 64 ? ctl->fl_bitmap & (~UINT64_C(0) << (*fl + 1)) : 0;
+        if (!fl_map) return NULL;
+        *fl = __builtin_ctzll(fl_map);
+        sl_map = ctl->sl_bitmap[*fl];
+    }
+    *sl = __builtin_ctz(sl_map);
+    return ctl->blocks[*fl][*sl];
+}
+
+static void remove_free_block(struct tlsf_control *ctl, struct tlsf_block *block, int fl, int sl)
+{
+    struct tlsf_block *prev = block->prev_free;
+    struct tlsf_block *next = block->next_free;
+    next->prev_free = prev;
+    prev->next_free = next;
+
+    if (ctl->blocks[fl][sl] == block)
+    {
+        ctl->blocks[fl][sl] = next;
+        if (next == &ctl->null)
+        {
+            ctl->sl_bitmap[fl] &= ~(UINT32_C(1) << sl);
+            if (!ctl->sl_bitmap[fl]) ctl->fl_bitmap &= ~(UINT64_C(1) << fl);
+        }
+    }
+}
+
+static void insert_free_block(struct tlsf_control *ctl, struct tlsf_block *block)
+{
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+    struct tlsf_block *current = ctl->blocks[fl][sl];
+    block->next_free = current;
+    block->prev_free = &ctl->null;
+    current->prev_free = block;
+    ctl->blocks[fl][sl] = block;
+    ctl->fl_bitmap |= UINT64_C(1) << fl;
+    ctl->sl_bitmap[fl] |= UINT32_C(1) << sl;
+}
+
+static void unlink_block(struct tlsf_control *ctl, struct tlsf_block *block)
+{
+    int fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+    remove_free_block(ctl, block, fl, sl);
+}
+
+/**
+ * @brief The first block sits right after the control structure.
+ */
+static inline struct tlsf_block *first_block(struct buddy_pool *pool)
+{
+    return (struct tlsf_block *)((char *)pool->base + ((sizeof(struct tlsf_control) + ALIGN - 1) & ~(size_t)(ALIGN - 1)));
+}
+
+void tlsf_init(struct buddy_pool *pool)
+{
+    struct tlsf_control *ctl = control(pool);
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->null.next_free = ctl->null.prev_free = &ctl->null;
+    for (int f = 0; f < FL_COUNT; f++)
+        for (int s = 0; s < SL_COUNT; s++)
+            ctl->blocks[f][s] = &ctl->null;
+
+    //One free block spans everything after the control structure. A zero sized
+    //used block at the very end keeps merges from running off the mapping.
+    char *start = (char *)first_block(pool);
+    char *end = (char *)pool->base + pool->numbytes;
+    struct tlsf_block *block = (struct tlsf_block *)start;
+    struct tlsf_block *sentinel = (struct tlsf_block *)(end - BLOCK_START);
+    block->size = (size_t)((char *)sentinel - start) - BLOCK_OVERHEAD;
+    sentinel->size = 0;
+    block_mark_free(block);
+    insert_free_block(ctl, block);
+}
+
+void *tlsf_malloc(struct buddy_pool *pool, size_t size)
+{
+    if (size == 0 || size > pool->numbytes)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct tlsf_control *ctl = control(pool);
+    size_t adjust = (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    if (adjust < BLOCK_MIN) adjust = BLOCK_MIN;
+
+    int fl, sl;
+    mapping_search(adjust, &fl, &sl);
+    struct tlsf_block *block = search_suitable_block(ctl, &fl, &sl);
+    if (block == NULL || block == &ctl->null)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    remove_free_block(ctl, block, fl, sl);
+
+    //Split off the remainder when it can hold a free block of its own
+    if (block_size(block) >= adjust + sizeof(struct tlsf_block))
+    {
+        struct tlsf_block *rest = (struct tlsf_block *)((char *)block_to_ptr(block) + adjust - BLOCK_OVERHEAD);
+        rest->size = block_size(block) - adjust - BLOCK_OVERHEAD;
+        block->size = adjust | (block->size & TLSF_FLAGS);
+        block_mark_free(rest);
+        insert_free_block(ctl, rest);
+    }
+    block_mark_used(block);
+    return block_to_ptr(block);
+}
+
+void *tlsf_memalign(struct buddy_pool *pool, size_t align, size_t size)
+{
+    if (align <= ALIGN) return tlsf_malloc(pool, size);
+    if (size == 0 || size > pool->numbytes)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    //The gap in front of the aligned pointer becomes a free block of its own,
+    //so it is either empty or at least a whole block
+    size_t gap_min = sizeof(struct tlsf_block);
+    size_t adjust = (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    if (adjust < BLOCK_MIN) adjust = BLOCK_MIN;
+    char *ptr = tlsf_malloc(pool, adjust + align + gap_min);
+    if (ptr == NULL) return NULL;
+
+    struct tlsf_block *block = block_from_ptr(ptr);
+    char *aligned = (char *)(((uintptr_t)ptr + align - 1) & ~(uintptr_t)(align - 1));
+    while (aligned != ptr && (size_t)(aligned - ptr) < gap_min)
+        aligned += align;
+
+    if (aligned != ptr)
+    {
+        //Carve the gap off as a used block and free it, which merges it with
+        //a free block in front
+        size_t gap = (size_t)(aligned - ptr);
+        struct tlsf_block *moved = block_from_ptr(aligned);
+        moved->size = block_size(block) - gap;
+        block->size = (gap - BLOCK_OVERHEAD) | (block->size & TLSF_PREV_FREE);
+        tlsf_free(pool, ptr);
+        block = moved;
+    }
+
+    //Same for what is left past the request
+    if (block_size(block) >= adjust + sizeof(struct tlsf_block))
+    {
+        struct tlsf_block *rest = (struct tlsf_block *)((char *)block_to_ptr(block) + adjust - BLOCK_OVERHEAD);
+        rest->size = block_size(block) - adjust - BLOCK_OVERHEAD;
+        block->size = adjust | (block->size & TLSF_FLAGS);
+        tlsf_free(pool, block_to_ptr(rest));
+    }
+    return block_to_ptr(block);
+}
+
+size_t tlsf_free(struct buddy_pool *pool, void *ptr)
+{
+    if (ptr == NULL) return 0;
+
+    struct tlsf_control *ctl = control(pool);
+    struct tlsf_block *block = block_from_ptr(ptr);
+    if (block->size & TLSF_FREE) return 0;
+    size_t released = block_size(block);
+    //Leave the header marked free even if it gets merged away below
+    block->size |= TLSF_FREE;
+
+    //Merge with the previous block
+    if (block->size & TLSF_PREV_FREE)
+    {
+        struct tlsf_block *prev = block->prev_phys;
+        unlink_block(ctl, prev);
+        prev->size += block_size(block) + BLOCK_OVERHEAD;
+        block = prev;
+    }
+
+    //Merge with the next block
+    struct tlsf_block *next = block_next(block);
+    if (next->size & TLSF_FREE)
+    {
+        unlink_block(ctl, next);
+        block->size += block_size(next) + BLOCK_OVERHEAD;
+    }
+
+    block_mark_free(block);
+    insert_free_block(ctl, block);
+    return released;
+}
+
+size_t tlsf_usable_size(void *ptr)
+{
+    return block_size(block_from_ptr(ptr));
+}
+
+void tlsf_walk(struct buddy_pool *pool, void (*visit)(void *arg, void *ptr, size_t size, bool used), void *arg)
+{
+    //The zero sized sentinel ends the walk
+    for (struct tlsf_block *block = first_block(pool); block_size(block) != 0; block = block_next(block))
+        visit(arg, block_to_ptr(block), block_size(block), !(block->size & TLSF_FREE));
+}
@@ -0,0 +1,68 @@
+#ifndef TLSF_H
+#define TLSF_H
+
+#include "lab.h"
+
+/*
+ * Two level segregated fit engine used by pools created with BUDDY_ENGINE_TLSF.
+ * These functions are internal to the library, callers go through buddy_malloc
+ * and buddy_free which dispatch on the engine bits of the pool flags.
+ */
+
+/**
+ * Lay out the TLSF control structure at the start of the pool mapping and
+ * turn the rest of the mapping into one free block.
+ *
+ * @param pool A pool whose base and numbytes are already set
+ */
+void tlsf_init(struct buddy_pool *pool);
+
+/**
+ * Allocate size bytes in constant time. Sets errno to ENOMEM on failure.
+ *
+ * @param pool The memory pool
+ * @param size The number of bytes requested
+ * @return Pointer to the memory or NULL
+ */
+void *tlsf_malloc(struct buddy_pool *pool, size_t size);
+
+/**
+ * Allocate size bytes at a multiple of align. The request is padded by the
+ * alignment and the unused head and tail are freed again, so it costs one
+ * malloc and up to two frees. Sets errno to ENOMEM on failure.
+ *
+ * @param pool The memory pool
+ * @param align A power of two
+ * @param size The number of bytes requested
+ * @return Pointer to the memory or NULL
+ */
+void *tlsf_memalign(struct buddy_pool *pool, size_t align, size_t size);
+
+/**
+ * Free a block in constant time, merging it with free physical neighbors.
+ * Freeing a block that is already free does nothing.
+ *
+ * @param pool The memory pool
+ * @param ptr Pointer returned by tlsf_malloc
+ * @return The payload bytes released, 0 if nothing was freed
+ */
+size_t tlsf_free(struct buddy_pool *pool, void *ptr);
+
+/**
+ * Usable bytes of a block handed out by tlsf_malloc.
+ *
+ * @param ptr Pointer returned by tlsf_malloc
+ * @return The size of the block payload
+ */
+size_t tlsf_usable_size(void *ptr);
+
+/**
+ * Visit every block of the pool in address order.
+ *
+ * @param pool The memory pool
+ * @param visit Called with the user pointer, payload size and whether the block is in use
+ * @param arg Passed through to visit
+ */
+void tlsf_walk(struct buddy_pool *pool, void (*visit)(void *arg, void *ptr, size_t size, bool used), void *arg);
+
+#endif
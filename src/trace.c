@@ -0,0 +1,368 @@
+/**
+ * @file trace.c
+ * @brief   Allocation trace recorder. Every thread owns a buffer inside the
+ *          tracer mapping and appends it to the trace file with one write
+ *          when it fills up. O_APPEND makes each of those writes land whole
+ *          after the previous one, so threads never wait for each other.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "trace.h"
+#include "clock.h"
+
+#define TLS_SLOTS 4                     /*Tracers a thread remembers its buffer for*/
+
+/**
+ * The events of one thread that are not in the file yet.
+ */
+struct trace_buffer
+{
+    uint32_t count;                     /*Events in ev*/
+    uint64_t last_ns;                   /*Time of the thread's previous call*/
+    const void *owner;                  /*The tls array of the thread it belongs to*/
+    struct buddy_trace_event ev[TRACE_BUFFER_EVENTS];
+};
+
+struct buddy_tracer
+{
+    int fd;                             /*The trace file*/
+    uint64_t gen;                       /*Tells this tracer apart from earlier ones*/
+    uint64_t start_ns;                  /*When buddy_trace_start ran*/
+    uint64_t seq;                       /*Next call number*/
+    uint32_t threads;                   /*Buffers handed out*/
+    uint64_t dropped;                   /*Calls of threads that got no buffer*/
+    int error;                          /*errno of the first failed write, 0 if none*/
+    struct trace_buffer buf[TRACE_MAX_THREADS];
+};
+
+/**
+ * The buffer a thread got from a tracer, found again by the tracer's
+ * generation so a stale entry of a stopped tracer is never used.
+ */
+struct trace_tls
+{
+    uint64_t gen;
+    struct trace_buffer *buf;
+};
+
+static uint64_t generation;
+static __thread struct trace_tls tls[TLS_SLOTS];
+
+static void trace_flush(struct buddy_tracer *t, struct trace_buffer *b)
+{
+    size_t bytes = b->count * sizeof(struct buddy_trace_event);
+    ssize_t n = write(t->fd, b->ev, bytes);
+    if (n != (ssize_t)bytes) {
+        int err = n < 0 ? errno : EIO;
+        int none = 0;
+        __atomic_compare_exchange_n(&t->error, &none, err, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    b->count = 0;
+}
+
+int buddy_trace_start(struct buddy_pool *pool, const char *path)
+{
+    if (pool == NULL || pool->base == NULL || path == NULL || pool->trace != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+
+    struct buddy_trace_header h = {.magic = "BTR1"};
+    h.event_size = sizeof(struct buddy_trace_event);
+    h.pool_bytes = pool->numbytes;
+    h.pool_flags = pool->flags;
+    if (write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h)) {
+        int err = errno ? errno : EIO;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    struct buddy_tracer *t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (t == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    t->fd = fd;
+    t->gen = __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+    t->start_ns = now_ns();
+    pool->trace = t;
+    return 0;
+}
+
+int buddy_trace_stop(struct buddy_pool *pool)
+{
+    if (pool == NULL || pool->trace == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct buddy_tracer *t = pool->trace;
+    pool->trace = NULL;
+    uint32_t threads = t->threads < TRACE_MAX_THREADS ? t->threads : TRACE_MAX_THREADS;
+    for (uint32_t i = 0; i < threads; i++)
+        if (t->buf[i].count) trace_flush(t, &t->buf[i]);
+
+    int err = t->error;
+    if (close(t->fd) && !err) err = errno;
+    munmap(t, sizeof(*t));
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t buddy_trace_dropped(struct buddy_pool *pool)
+{
+    if (pool == NULL || pool->trace == NULL) return 0;
+    return __atomic_load_n(&pool->trace->dropped, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief The calling thread's buffer for t, claiming one on its first call.
+ * A thread tracing more pools than it has slots for finds its buffer again
+ * by owner, so switching between them never claims a second one.
+ *
+ * @return The buffer or NULL when every buffer is taken
+ */
+static struct trace_buffer *thread_buffer(struct buddy_tracer *t)
+{
+    struct trace_tls *slot = NULL;
+    for (int i = 0; i < TLS_SLOTS; i++)
+    {
+        if (tls[i].gen == t->gen) return tls[i].buf;
+        if (slot == NULL && tls[i].gen == 0) slot = &tls[i];
+    }
+    if (slot == NULL) slot = &tls[t->gen & (TLS_SLOTS - 1)];
+
+    struct trace_buffer *b = NULL;
+    uint32_t claimed = __atomic_load_n(&t->threads, __ATOMIC_RELAXED);
+    if (claimed > TRACE_MAX_THREADS) claimed = TRACE_MAX_THREADS;
+    for (uint32_t i = 0; i < claimed && b == NULL; i++)
+        if (__atomic_load_n(&t->buf[i].owner, __ATOMIC_RELAXED) == tls) b = &t->buf[i];
+    if (b == NULL) {
+        uint32_t i = __atomic_fetch_add(&t->threads, 1, __ATOMIC_RELAXED);
+        if (i >= TRACE_MAX_THREADS) return NULL;
+        b = &t->buf[i];
+        b->last_ns = t->start_ns;
+        __atomic_store_n(&b->owner, (const void *)tls, __ATOMIC_RELAXED);
+    }
+    slot->gen = t->gen;
+    slot->buf = b;
+    return b;
+}
+
+void trace_record(struct buddy_pool *pool, unsigned int op, void *ptr, void *result, size_t size)
+{
+    struct buddy_tracer *t = pool->trace;
+    //Numbered even when dropped, so a replay sees the gap
+    uint64_t seq = __atomic_fetch_add(&t->seq, 1, __ATOMIC_RELAXED);
+    struct trace_buffer *b = thread_buffer(t);
+    if (b == NULL) {
+        __atomic_fetch_add(&t->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t now = now_ns();
+    uint64_t delta = now - b->last_ns;
+    b->last_ns = now;
+
+    struct buddy_trace_event *e = &b->ev[b->count++];
+    e->seq_op = seq << BUDDY_TRACE_OP_BITS | op;
+    e->size = size;
+    e->id = ptr ? (uint64_t)((char *)ptr - (char *)pool->base) + 1 : 0;
+    e->result = result ? (uint64_t)((char *)result - (char *)pool->base) + 1 : 0;
+    e->delta_ns = delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta;
+    e->thread = (uint32_t)(b - t->buf);
+
+    if (b->count == TRACE_BUFFER_EVENTS) trace_flush(t, b);
+}
+
+/**
+ * A stretch of the file written by one thread.
+ */
+struct trace_run
+{
+    uint64_t start;                     /*Index of the first event*/
+    uint32_t len;                       /*Events in the run*/
+    uint32_t next;                      /*Next run of the same thread, UINT32_MAX for none*/
+};
+
+/**
+ * Where the merge stands in the calls of one thread.
+ */
+struct trace_cursor
+{
+    uint32_t run;                       /*Current run*/
+    uint32_t pos;                       /*Next event inside it*/
+    uint64_t clock;                     /*Time of the thread's last call returned*/
+};
+
+struct buddy_trace_reader
+{
+    void *map;                          /*The whole file*/
+    size_t map_bytes;
+    const struct buddy_trace_event *ev;
+    size_t count;
+    struct trace_run *runs;
+    size_t runs_bytes;
+    uint32_t first_run[TRACE_MAX_THREADS];
+    struct trace_cursor cursor[TRACE_MAX_THREADS];
+    uint32_t heap[TRACE_MAX_THREADS];   /*Threads with calls left, by their next call number*/
+    uint32_t heap_len;
+};
+
+static inline uint64_t cursor_seq(struct buddy_trace_reader *r, uint32_t t)
+{
+    struct trace_cursor *c = &r->cursor[t];
+    return r->ev[r->runs[c->run].start + c->pos].seq_op;
+}
+
+static void heap_down(struct buddy_trace_reader *r, uint32_t i)
+{
+    uint32_t t = r->heap[i];
+    uint64_t key = cursor_seq(r, t);
+    for (;;)
+    {
+        uint32_t child = 2 * i + 1;
+        if (child >= r->heap_len) break;
+        if (child + 1 < r->heap_len && cursor_seq(r, r->heap[child + 1]) < cursor_seq(r, r->heap[child]))
+            child++;
+        if (cursor_seq(r, r->heap[child]) >= key) break;
+        r->heap[i] = r->heap[child];
+        i = child;
+    }
+    r->heap[i] = t;
+}
+
+struct buddy_trace_reader *buddy_trace_open(const char *path, struct buddy_trace_header *header)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    off_t bytes = lseek(fd, 0, SEEK_END);
+    struct buddy_trace_header h;
+    if (bytes < (off_t)sizeof(h) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        memcmp(h.magic, "BTR1", 4) || h.event_size != sizeof(struct buddy_trace_event) ||
+        ((size_t)bytes - sizeof(h)) % sizeof(struct buddy_trace_event)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct buddy_trace_reader *r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    r->map_bytes = (size_t)bytes;
+    r->map = mmap(NULL, r->map_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (r->map == MAP_FAILED) {
+        munmap(r, sizeof(*r));
+        return NULL;
+    }
+    madvise(r->map, r->map_bytes, MADV_SEQUENTIAL);
+    r->ev = (const struct buddy_trace_event *)((char *)r->map + sizeof(h));
+    r->count = (r->map_bytes - sizeof(h)) / sizeof(struct buddy_trace_event);
+
+    //Count the runs first so their index can be mapped in one go
+    size_t runs = 0;
+    for (size_t i = 0; i < r->count; i++)
+    {
+        if (r->ev[i].thread >= TRACE_MAX_THREADS) {
+            buddy_trace_close(r);
+            errno = EINVAL;
+            return NULL;
+        }
+        if (i == 0 || r->ev[i].thread != r->ev[i - 1].thread) runs++;
+    }
+    r->runs_bytes = (runs ? runs : 1) * sizeof(struct trace_run);
+    r->runs = mmap(NULL, r->runs_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->runs == MAP_FAILED) {
+        r->runs = NULL;
+        int err = errno;
+        buddy_trace_close(r);
+        errno = err;
+        return NULL;
+    }
+
+    uint32_t last_run[TRACE_MAX_THREADS];
+    memset(r->first_run, 0xff, sizeof(r->first_run));
+    size_t n = 0;
+    for (size_t i = 0; i < r->count; i++)
+    {
+        uint32_t t = r->ev[i].thread;
+        if (i > 0 && t == r->ev[i - 1].thread) {
+            r->runs[n - 1].len++;
+            continue;
+        }
+        r->runs[n] = (struct trace_run){i, 1, UINT32_MAX};
+        if (r->first_run[t] == UINT32_MAX) r->first_run[t] = (uint32_t)n;
+        else r->runs[last_run[t]].next = (uint32_t)n;
+        last_run[t] = (uint32_t)n;
+        n++;
+    }
+    if (header) *header = h;
+    buddy_trace_rewind(r);
+    return r;
+}
+
+void buddy_trace_rewind(struct buddy_trace_reader *r)
+{
+    r->heap_len = 0;
+    for (uint32_t t = 0; t < TRACE_MAX_THREADS; t++)
+    {
+        if (r->first_run[t] == UINT32_MAX) continue;
+        r->cursor[t] = (struct trace_cursor){r->first_run[t], 0, 0};
+        r->heap[r->heap_len++] = t;
+    }
+    for (uint32_t i = r->heap_len / 2; i-- > 0;)
+        heap_down(r, i);
+}
+
+const struct buddy_trace_event *buddy_trace_next(struct buddy_trace_reader *r, uint64_t *at_ns)
+{
+    if (r->heap_len == 0) return NULL;
+    uint32_t t = r->heap[0];
+    struct trace_cursor *c = &r->cursor[t];
+    const struct buddy_trace_event *e = &r->ev[r->runs[c->run].start + c->pos];
+    c->clock += e->delta_ns;
+    if (at_ns) *at_ns = c->clock;
+
+    if (++c->pos == r->runs[c->run].len) {
+        c->pos = 0;
+        c->run = r->runs[c->run].next;
+    }
+    if (c->run == UINT32_MAX) r->heap[0] = r->heap[--r->heap_len];
+    if (r->heap_len) heap_down(r, 0);
+    return e;
+}
+
+size_t buddy_trace_count(struct buddy_trace_reader *r)
+{
+    return r->count;
+}
+
+void buddy_trace_close(struct buddy_trace_reader *r)
+{
+    if (r == NULL) return;
+    if (r->runs) munmap(r->runs, r->runs_bytes);
+    munmap(r->map, r->map_bytes);
+    munmap(r, sizeof(*r));
+}
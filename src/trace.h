@@ -0,0 +1,146 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "lab.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * Operations stored in the low bits of buddy_trace_event.seq_op.
+   */
+#define BUDDY_TRACE_MALLOC 0
+#define BUDDY_TRACE_FREE 1
+#define BUDDY_TRACE_REALLOC 2
+#define BUDDY_TRACE_RESET 3
+#define BUDDY_TRACE_OP_BITS 2
+
+  /**
+   * Threads that can record into one trace, calls from any further thread
+   * are counted in buddy_trace_dropped and not written.
+   */
+#define TRACE_MAX_THREADS 256
+
+  /**
+   * Events a thread buffers before it appends them to the file.
+   */
+#define TRACE_BUFFER_EVENTS 1024
+
+  /**
+   * The file starts with this header, followed by buddy_trace_event records.
+   * Each thread appends its records a buffer at a time, so the file is only
+   * in call order per thread. Sort by seq_op to get the global order.
+   */
+  struct buddy_trace_header
+  {
+    char magic[4];              /*"BTR1"*/
+    uint32_t event_size;        /*sizeof(struct buddy_trace_event)*/
+    uint64_t pool_bytes;        /*numbytes of the traced pool*/
+    uint32_t pool_flags;        /*buddy_init_ex flags of the traced pool*/
+    uint32_t reserved;
+  };
+
+  /**
+   * One call. Pointers are stored as IDs, their offset from the pool base
+   * plus one, so 0 stands for NULL and a replay can map them to its own
+   * blocks. An ID is reused once its block is freed.
+   */
+  struct buddy_trace_event
+  {
+    uint64_t seq_op;            /*Global call number << BUDDY_TRACE_OP_BITS | BUDDY_TRACE_* */
+    uint64_t size;              /*Bytes requested, 0 for free and reset*/
+    uint64_t id;                /*Pointer passed in by free and realloc*/
+    uint64_t result;            /*Pointer returned by malloc and realloc*/
+    uint32_t delta_ns;          /*Time since the previous call of this thread, saturated*/
+    uint32_t thread;            /*Small number of the calling thread, from 0*/
+  };
+
+  /**
+   * Record every buddy_malloc, buddy_free, buddy_realloc and buddy_reset on
+   * the pool into a binary trace at path. Each thread fills its own buffer
+   * and appends it to the file with a single write, the only shared state
+   * is the call counter taken with an atomic add. On a BUDDY_LOCKED pool the
+   * calls are numbered under the pool lock, so the numbers follow the order
+   * the pool saw them in.
+   *
+   * Start and stop the trace while no other thread uses the pool.
+   *
+   * @param pool The memory pool to trace
+   * @param path The file to create, truncated if it exists
+   * @return 0 on success, -1 with errno set
+   */
+  int buddy_trace_start(struct buddy_pool *pool, const char *path);
+
+  /**
+   * Flush the buffers of every thread and close the trace.
+   *
+   * @param pool The memory pool
+   * @return 0 on success, -1 with errno set if a write failed on the way
+   */
+  int buddy_trace_stop(struct buddy_pool *pool);
+
+  /**
+   * Calls that were not recorded because too many threads used the pool.
+   *
+   * @param pool The memory pool
+   * @return The number of dropped calls, 0 when tracing is off
+   */
+  uint64_t buddy_trace_dropped(struct buddy_pool *pool);
+
+  struct buddy_trace_reader;
+
+  /**
+   * Open a trace for reading in call order. The file is mapped rather than
+   * read, and the per thread runs in it are merged on the fly, so traces
+   * larger than memory stream through with a few words of state per thread.
+   *
+   * @param path The trace written by buddy_trace_start
+   * @param header Where to store the file header, may be NULL
+   * @return The reader, NULL with errno set (EINVAL if the file is not a trace)
+   */
+  struct buddy_trace_reader *buddy_trace_open(const char *path, struct buddy_trace_header *header);
+
+  /**
+   * The next call in call order.
+   *
+   * @param r The reader
+   * @param at_ns Where to store the time of the call since the trace started, may be NULL
+   * @return The call, NULL after the last one. Valid until the reader is closed
+   */
+  const struct buddy_trace_event *buddy_trace_next(struct buddy_trace_reader *r, uint64_t *at_ns);
+
+  /**
+   * Start over from the first call.
+   *
+   * @param r The reader
+   */
+  void buddy_trace_rewind(struct buddy_trace_reader *r);
+
+  /**
+   * The number of calls in the trace.
+   *
+   * @param r The reader
+   */
+  size_t buddy_trace_count(struct buddy_trace_reader *r);
+
+  /**
+   * Unmap the trace.
+   *
+   * @param r The reader, may be NULL
+   */
+  void buddy_trace_close(struct buddy_trace_reader *r);
+
+  /*
+   * Hook called by buddy_malloc/buddy_free/buddy_realloc/buddy_reset while
+   * pool->trace is set.
+   */
+  void trace_record(struct buddy_pool *pool, unsigned int op, void *ptr, void *result, size_t size);
+
+#ifdef __cplusplus
+} //extern "C"
+#endif
+
+#endif
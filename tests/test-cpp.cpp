@@ -0,0 +1,259 @@
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "harness/unity.h"
+#include "../src/buddy.hpp"
+#include "../src/buddy_pool.hpp"
+
+static struct buddy_pool test_pool;
+
+void setUp(void)
+{
+  buddy_init(&test_pool, UINT64_C(1) << MIN_K);
+}
+
+void tearDown(void)
+{
+  buddy_destroy(&test_pool);
+}
+
+/**
+ * Every block the containers took went back to the pool.
+ */
+static void check_pool_empty(struct buddy_pool *pool)
+{
+  struct buddy_check_report report;
+  assert(buddy_check(pool, &report, 1) == 0 && report.reserved_blocks == 0);
+  struct buddy_stats st;
+  buddy_stats(pool, &st);
+  assert(st.allocs > 0 && st.allocs == st.frees);
+}
+
+struct alignas(64) line
+{
+  char bytes[64];
+};
+
+void test_allocator_containers(void)
+{
+  fprintf(stderr, "->Testing BuddyAllocator with std containers\n");
+  buddy::BuddyAllocator<int> alloc(&test_pool);
+  {
+    std::vector<int, buddy::BuddyAllocator<int>> v(alloc);
+    for (int i = 0; i < 10000; i++)
+      v.push_back(i);
+    assert(v[9999] == 9999);
+    assert((char *)v.data() >= (char *)test_pool.base &&
+           (char *)v.data() < (char *)test_pool.base + test_pool.numbytes);
+
+    //Node containers rebind the allocator to their node type
+    std::list<std::string, buddy::BuddyAllocator<std::string>> l(alloc);
+    std::map<int, int, std::less<int>, buddy::BuddyAllocator<std::pair<const int, int>>> m(alloc);
+    for (int i = 0; i < 1000; i++)
+    {
+      l.push_back(std::to_string(i));
+      m[i] = i * 2;
+    }
+    assert(l.back() == "999" && m[500] == 1000);
+
+    //Over aligned types get their alignment
+    std::vector<line, buddy::BuddyAllocator<line>> lines(alloc);
+    for (int i = 0; i < 100; i++)
+    {
+      lines.emplace_back();
+      assert(((uintptr_t)lines.data() & 63) == 0);
+    }
+
+    //A rebound copy frees what the original allocated
+    buddy::BuddyAllocator<char> other(alloc);
+    assert(other == alloc && other.pool() == &test_pool);
+    char *c = buddy::BuddyAllocator<char>(alloc).allocate(10);
+    other.deallocate(c, 10);
+  }
+  check_pool_empty(&test_pool);
+
+  bool threw = false;
+  try {
+    alloc.allocate(test_pool.numbytes);
+  } catch (const std::bad_alloc &) {
+    threw = true;
+  }
+  assert(threw);
+}
+
+void test_memory_resource(void)
+{
+  fprintf(stderr, "->Testing buddy_memory_resource with pmr containers\n");
+  {
+    buddy::buddy_memory_resource res(&test_pool);
+    std::pmr::unordered_map<int, std::pmr::string> map(&res);
+    for (int i = 0; i < 2000; i++)
+      map.emplace(i, std::pmr::string(100, 'x'));
+    assert(map.size() == 2000 && map[1999].size() == 100);
+    //Strings inside the map use the map's resource
+    assert(map[0].get_allocator().resource() == &res);
+
+    void *p = res.allocate(100, 256);
+    assert(((uintptr_t)p & 255) == 0);
+    res.deallocate(p, 100, 256);
+
+    buddy::buddy_memory_resource same(&test_pool);
+    assert(res.is_equal(same) && !res.is_equal(*std::pmr::new_delete_resource()));
+  }
+  check_pool_empty(&test_pool);
+
+  //A resource with a pool of its own
+  buddy::buddy_memory_resource own(UINT64_C(1) << MIN_K, BUDDY_POLICY_ADDRESS);
+  {
+    std::pmr::vector<double> v(&own);
+    v.resize(1000, 1.5);
+    assert(v[999] == 1.5);
+  }
+  check_pool_empty(own.pool());
+}
+
+//The orders are worked out at compile time
+static_assert(buddy::BuddyPool<16, 6>::order_for(1) == 6, "header fits the smallest block");
+static_assert(buddy::BuddyPool<16, 6>::order_for(49) == 7, "header pushes a request up");
+static_assert(buddy::BuddyPool<16, 6, buddy::SideTable>::order_for(64) == 6, "no header");
+static_assert(buddy::BuddyPool<20, 4, buddy::SideTable>::order_for(70000) == 17, "past the table");
+static_assert(sizeof(buddy::BuddyPool<12, 6>) < 4096 + 1024, "embeds with little overhead");
+
+/**
+ * Fill the pool with random requests, check no two blocks overlap by
+ * stamping each with its own byte, free everything and check the pool
+ * merged back into one block.
+ */
+template <class Pool>
+static void churn_template_pool(Pool &pool, unsigned int seed)
+{
+  struct live
+  {
+    unsigned char *ptr;
+    std::size_t size;
+    unsigned char stamp;
+  };
+  std::vector<live> blocks;
+  for (int i = 0; i < 20000; i++)
+  {
+    if (!blocks.empty() && rand_r(&seed) % 2)
+    {
+      std::size_t at = rand_r(&seed) % blocks.size();
+      live b = blocks[at];
+      for (std::size_t j = 0; j < b.size; j++)
+        assert(b.ptr[j] == b.stamp);
+      pool.deallocate(b.ptr);
+      blocks[at] = blocks.back();
+      blocks.pop_back();
+      continue;
+    }
+    std::size_t size = 1 + rand_r(&seed) % (rand_r(&seed) % 8 ? 200 : 3000);
+    unsigned char *p = static_cast<unsigned char *>(pool.allocate(size));
+    if (p == nullptr) continue;
+    assert(pool.owns(p) && pool.usable_size(p) >= size);
+    assert(((uintptr_t)p & 15) == 0);
+    unsigned char stamp = static_cast<unsigned char>(i);
+    memset(p, stamp, size);
+    blocks.push_back({p, size, stamp});
+  }
+  for (const live &b : blocks)
+    pool.deallocate(b.ptr);
+  assert(pool.bytes_free() == pool.capacity());
+  void *all = pool.allocate(Pool::max_size);
+  assert(all != nullptr && pool.bytes_free() == 0);
+  pool.deallocate(all);
+}
+
+void test_template_pool(void)
+{
+  fprintf(stderr, "->Testing BuddyPool template\n");
+  auto *inline_pool = new buddy::BuddyPool<16, 6>();
+  //A header in every block, 2^10 of the smallest blocks
+  std::vector<void *> smallest;
+  void *p;
+  while ((p = inline_pool->allocate(48)) != nullptr)
+    smallest.push_back(p);
+  assert(smallest.size() == 1024 && inline_pool->bytes_free() == 0);
+  for (void *q : smallest)
+    inline_pool->deallocate(q);
+  churn_template_pool(*inline_pool, 1);
+  delete inline_pool;
+
+  auto *side_pool = new buddy::BuddyPool<18, 4, buddy::SideTable>();
+  //Without a header a power of two request fills its block exactly
+  void *a = side_pool->allocate(1024);
+  assert(side_pool->usable_size(a) == 1024 && ((uintptr_t)a & 63) == 0);
+  side_pool->deallocate(a);
+  churn_template_pool(*side_pool, 2);
+  delete side_pool;
+
+  buddy::BuddyPool<10, 6> tiny;
+  assert(tiny.allocate(0) == nullptr && tiny.allocate(tiny.max_size + 1) == nullptr);
+  void *x = tiny.allocate(100);
+  tiny.reset();
+  assert(tiny.bytes_free() == tiny.capacity() && tiny.allocate(tiny.max_size) == x);
+}
+
+struct session
+{
+  static int live;
+  std::vector<int> buffer;
+  session() : buffer(256, 7) { live++; }
+  ~session() { live--; }
+};
+int session::live = 0;
+
+void test_object_cache_template(void)
+{
+  fprintf(stderr, "->Testing ObjectCache template\n");
+  {
+    buddy::ObjectCache<session> cache(&test_pool, "session");
+    std::vector<session *> held;
+    for (int i = 0; i < 50; i++)
+      held.push_back(cache.allocate());
+    assert(session::live == 50 && held[49]->buffer[255] == 7);
+    held.back()->buffer[0] = 42;
+    for (session *s : held)
+      cache.deallocate(s);
+    //Still constructed, the last one freed comes back first as it was left
+    assert(session::live == 50);
+    session *again = cache.allocate();
+    assert(again == held.back() && again->buffer[0] == 42);
+    struct buddy_cache_stats st = cache.stats();
+    assert(st.ctor_calls == 50 && st.allocs == 51 && st.in_use == 1);
+    cache.deallocate(again);
+    assert(cache.reap() == st.slabs && session::live == 0);
+  }
+  check_pool_empty(&test_pool);
+
+  bool threw = false;
+  struct buddy_pool tlsf;
+  buddy_init_ex(&tlsf, UINT64_C(1) << MIN_K, BUDDY_ENGINE_TLSF);
+  try {
+    buddy::ObjectCache<session> cache(&tlsf);
+  } catch (const std::system_error &) {
+    threw = true;
+  }
+  assert(threw);
+  buddy_destroy(&tlsf);
+}
+
+int main(void)
+{
+  printf("Running C++ adapter tests.\n");
+
+  UNITY_BEGIN();
+  RUN_TEST(test_allocator_containers);
+  RUN_TEST(test_memory_resource);
+  RUN_TEST(test_template_pool);
+  RUN_TEST(test_object_cache_template);
+  return UNITY_END();
+}
@@ -1,7 +1,9 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #ifdef __APPLE__
 #include <sys/errno.h>
 #else
@@ -9,6 +11,11 @@
 #endif
 #include "harness/unity.h"
 #include "../src/lab.h"
+#include "../src/arena.h"
+#include "../src/cache.h"
+#include "../src/percpu.h"
+#include "../src/profile.h"
+#include "../src/trace.h"
 
 static struct buddy_pool test_pool;
 
@@ -50,6 +57,10 @@ void check_buddy_pool_full(struct buddy_pool *pool)
   //If this fails either buddy_init is wrong or we have corrupted the
   //buddy_pool struct.
   assert(pool->avail[pool->kval_m].next == pool->base);
+
+  struct buddy_check_report report;
+  assert(buddy_check(pool, &report, 1) == 0);
+  assert(report.reserved_blocks == 0 && report.free_blocks[pool->kval_m] == 1);
 }
 
 /**
@@ -269,6 +280,1362 @@ void test_buddy_malloc_smallest_k(void)
     buddy_free(&test_pool, mem);
 }
 
+/**
+ * Free two blocks that can not coalesce and make sure the address ordered
+ * policy hands back the lower one while LIFO hands back the last one freed.
+ */
+void test_policy_address_lowest_first(void)
+{
+    fprintf(stderr, "->Testing address ordered placement\n");
+    unsigned int policies[] = {BUDDY_POLICY_LIFO, BUDDY_POLICY_ADDRESS};
+    for (size_t p = 0; p < 2; p++)
+    {
+        struct buddy_pool pool;
+        buddy_init_ex(&pool, UINT64_C(1) << MIN_K, policies[p]);
+        void *mem[8];
+        for (int i = 0; i < 8; i++)
+            mem[i] = buddy_malloc(&pool, 1);
+
+        buddy_free(&pool, mem[2]);
+        buddy_free(&pool, mem[5]);
+        void *again = buddy_malloc(&pool, 1);
+        assert(again == (policies[p] == BUDDY_POLICY_ADDRESS ? mem[2] : mem[5]));
+        if (again == mem[2]) mem[2] = NULL; else mem[5] = NULL;
+
+        buddy_free(&pool, again);
+        for (int i = 0; i < 8; i++)
+            buddy_free(&pool, mem[i]);
+        check_buddy_pool_full(&pool);
+        buddy_destroy(&pool);
+    }
+}
+
+/**
+ * Random churn under the address ordered policy must still coalesce back
+ * into a full pool.
+ */
+void test_policy_address_churn(void)
+{
+    fprintf(stderr, "->Testing address ordered churn\n");
+    struct buddy_pool pool;
+    buddy_init_ex(&pool, UINT64_C(1) << MIN_K, BUDDY_POLICY_ADDRESS);
+    void *mem[256] = {0};
+    for (int i = 0; i < 20000; i++)
+    {
+        int slot = rand() % 256;
+        if (mem[slot])
+        {
+            buddy_free(&pool, mem[slot]);
+            mem[slot] = NULL;
+        }
+        else
+        {
+            mem[slot] = buddy_malloc(&pool, (size_t)(rand() % 4096) + 1);
+        }
+    }
+    for (int i = 0; i < 256; i++)
+        buddy_free(&pool, mem[i]);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+/**
+ * Build an order 7 list holding one block whose buddy is reserved and one
+ * whose buddy is split, then check which one each policy picks.
+ */
+void test_policy_buddy_busy(void)
+{
+    fprintf(stderr, "->Testing buddy busy placement\n");
+    unsigned int policies[] = {BUDDY_POLICY_LIFO, BUDDY_POLICY_BUDDY_BUSY};
+    for (size_t p = 0; p < 2; p++)
+    {
+        struct buddy_pool pool;
+        buddy_init_ex(&pool, UINT64_C(1) << MIN_K, policies[p]);
+        size_t k7 = 100; //100 bytes plus the header needs a kval of 7
+        char *x = buddy_malloc(&pool, 1);    //offset 0, leaves [128,256) free with a split buddy
+        char *y = buddy_malloc(&pool, k7);   //takes [128,256)
+        char *z = buddy_malloc(&pool, k7);   //offset 256, leaves [384,512) free with a reserved buddy
+        assert(y - x == 128 && z - x == 256);
+        buddy_free(&pool, y);                //[128,256) can not coalesce, x is still in use
+
+        char *w = buddy_malloc(&pool, k7);
+        assert(w == (policies[p] == BUDDY_POLICY_BUDDY_BUSY ? x + 384 : y));
+
+        buddy_free(&pool, w);
+        buddy_free(&pool, z);
+        buddy_free(&pool, x);
+        check_buddy_pool_full(&pool);
+        buddy_destroy(&pool);
+    }
+}
+/**
+ * A 600KiB request in a 1MiB pool uses the whole pool unless the tail is
+ * trimmed, in which case a 200KiB request still fits next to it.
+ */
+void test_trim_tail_releases_tail(void)
+{
+    fprintf(stderr, "->Testing trim tail\n");
+    struct buddy_pool pool;
+    buddy_init_ex(&pool, UINT64_C(1) << MIN_K, BUDDY_TRIM_TAIL);
+    void *big = buddy_malloc(&pool, 600 << 10);
+    assert(big != NULL);
+    struct avail *hdr = (struct avail *)big - 1;
+    assert(hdr->kval == MIN_K);
+    assert(hdr->span < (UINT64_C(1) << MIN_K));
+    assert(pool.avail[MIN_K - 2].next != &pool.avail[MIN_K - 2]); //the top 256KiB is free
+
+    void *small = buddy_malloc(&pool, 200 << 10);
+    assert(small != NULL);
+    assert((char *)small > (char *)big + (600 << 10));
+    buddy_free(&pool, big);
+    buddy_free(&pool, small);
+    check_buddy_pool_full(&pool);
+    buddy_destroy(&pool);
+}
+
+/**
+ * Random sizes in trim mode must never overlap and must reassemble into a
+ * full pool once everything is freed.
+ */
+void test_trim_tail_churn(void)
+{
+    fprintf(stderr, "->Testing trim tail churn\n");
+    unsigned int policies[] = {BUDDY_POLICY_LIFO, BUDDY_POLICY_ADDRESS, BUDDY_POLICY_BUDDY_BUSY};
+    for (size_t p = 0; p < 3; p++)
+    {
+        struct buddy_pool pool;
+        buddy_init_ex(&pool, UINT64_C(1) << MIN_K, policies[p] | BUDDY_TRIM_TAIL);
+        unsigned char *mem[128] = {0};
+        size_t len[128] = {0};
+        for (int i = 0; i < 20000; i++)
+        {
+            int slot = rand() % 128;
+            if (mem[slot])
+            {
+                for (size_t b = 0; b < len[slot]; b++)
+                    assert(mem[slot][b] == (unsigned char)slot);
+                buddy_free(&pool, mem[slot]);
+                mem[slot] = NULL;
+            }
+            else
+            {
+                len[slot] = (size_t)(rand() % 20000) + 1;
+                mem[slot] = buddy_malloc(&pool, len[slot]);
+                if (mem[slot]) memset(mem[slot], slot, len[slot]);
+            }
+        }
+        for (int i = 0; i < 128; i++)
+            buddy_free(&pool, mem[i]);
+        check_buddy_pool_full(&pool);
+        buddy_destroy(&pool);
+    }
+}
+/**
+ * Random churn on the TLSF engine must keep blocks disjoint and merge back
+ * into one block that can satisfy a request for most of the pool.
+ */
+void test_tlsf_churn(void)
+{
+    fprintf(stderr, "->Testing TLSF engine churn\n");
+    struct buddy_pool pool;
+    buddy_init_ex(&pool, UINT64_C(1) << MIN_K, BUDDY_ENGINE_TLSF);
+    unsigned char *mem[128] = {0};
+    size_t len[128] = {0};
+    for (int i = 0; i < 20000; i++)
+    {
+        int slot = rand() % 128;
+        if (mem[slot])
+        {
+            for (size_t b = 0; b < len[slot]; b++)
+                assert(mem[slot][b] == (unsigned char)slot);
+            buddy_free(&pool, mem[slot]);
+            buddy_free(&pool, mem[slot]); //double free does nothing
+            mem[slot] = NULL;
+        }
+        else
+        {
+            len[slot] = (size_t)(rand() % 20000) + 1;
+            mem[slot] = buddy_malloc(&pool, len[slot]);
+            if (mem[slot]) memset(mem[slot], slot, len[slot]);
+        }
+    }
+    for (int i = 0; i < 128; i++)
+        buddy_free(&pool, mem[i]);
+
+    void *big = buddy_malloc(&pool, (UINT64_C(1) << (MIN_K - 1)) + (UINT64_C(1) << (MIN_K - 2)));
+    assert(big != NULL);
+    assert(buddy_malloc(&pool, UINT64_C(1) << (MIN_K - 1)) == NULL);
+    assert(errno == ENOMEM);
+    buddy_free(&pool, big);
+    buddy_destroy(&pool);
+}
+/**
+ * Fill an arena past its first chunk, reset it back to one chunk, and make
+ * sure destroy hands everything back to the pool.
+ */
+void test_arena_chain_and_reset(void)
+{
+    fprintf(stderr, "->Testing arena chaining and reset\n");
+    struct buddy_arena arena;
+    arena_init(&arena, &test_pool, 4096);
+    char *first = arena_alloc(&arena, 100);
+    assert(first != NULL);
+    assert(((uintptr_t)first % _Alignof(max_align_t)) == 0);
+    struct arena_chunk *chunk = arena.head;
+
+    //Bump allocations are contiguous inside a chunk
+    char *second = arena_alloc(&arena, 16);
+    assert(second == first + 112);
+
+    for (int i = 0; i < 100; i++)
+    {
+        char *p = arena_alloc(&arena, 200);
+        assert(p != NULL);
+        memset(p, i, 200);
+    }
+    assert(arena.head != chunk && arena.head->prev != NULL);
+
+    //A request larger than a chunk gets a chunk of its own
+    assert(arena_alloc(&arena, 10000) != NULL);
+
+    arena_reset(&arena);
+    assert(arena.head == chunk && chunk->prev == NULL);
+    assert(arena_alloc(&arena, 100) == first);
+
+    arena_destroy(&arena);
+    assert(arena.head == NULL);
+    check_buddy_pool_full(&test_pool);
+}
+/**
+ * Reset a pool with live blocks in every engine and make sure it behaves like
+ * a freshly initialized one, with and without giving the pages back.
+ */
+void test_buddy_reset(void)
+{
+    fprintf(stderr, "->Testing buddy_reset\n");
+    unsigned int flags[] = {BUDDY_POLICY_LIFO, BUDDY_POLICY_ADDRESS | BUDDY_TRIM_TAIL, BUDDY_ENGINE_TLSF};
+    for (size_t f = 0; f < 3; f++)
+    {
+        struct buddy_pool pool;
+        buddy_init_ex(&pool, UINT64_C(1) << MIN_K, flags[f]);
+        for (unsigned int round = 0; round < 2; round++)
+        {
+            for (int i = 0; i < 500; i++)
+            {
+                char *p = buddy_malloc(&pool, (size_t)(rand() % 1000) + 1);
+                assert(p != NULL);
+                *p = 'x';
+            }
+            buddy_reset_ex(&pool, round ? BUDDY_RESET_MADV_FREE : 0);
+            if (flags[f] != BUDDY_ENGINE_TLSF)
+                check_buddy_pool_full(&pool);
+            void *big = buddy_malloc(&pool, UINT64_C(1) << (MIN_K - 1));
+            assert(big != NULL);
+            buddy_reset(&pool);
+        }
+        buddy_destroy(&pool);
+    }
+}
+/**
+ * The counters must follow a split chain and the matching coalescing chain.
+ */
+void test_buddy_stats(void)
+{
+    fprintf(stderr, "->Testing buddy_stats\n");
+    struct buddy_stats st;
+    assert(buddy_stats(&test_pool, NULL) == -1 && errno == EINVAL);
+    buddy_stats(&test_pool, &st);
+    assert(st.free_blocks[MIN_K] == 1);
+    assert(st.bytes_free == test_pool.numbytes && st.bytes_reserved == 0);
+
+    void *mem = buddy_malloc(&test_pool, 1);
+    buddy_stats(&test_pool, &st);
+    for (size_t k = SMALLEST_K; k < MIN_K; k++)
+        assert(st.free_blocks[k] == 1);
+    assert(st.free_blocks[MIN_K] == 0);
+    assert(st.splits == MIN_K - SMALLEST_K);
+    assert(st.bytes_reserved == (UINT64_C(1) << SMALLEST_K) && st.bytes_requested == 1);
+    assert(st.allocs == 1);
+
+    assert(buddy_malloc(&test_pool, UINT64_C(1) << MIN_K) == NULL);
+    buddy_free(&test_pool, mem);
+    buddy_free(&test_pool, mem); //ignored double free is not counted
+    buddy_stats(&test_pool, &st);
+    assert(st.failed_allocs == 1 && st.frees == 1);
+    assert(st.merges == MIN_K - SMALLEST_K);
+    assert(st.free_blocks[MIN_K] == 1 && st.bytes_reserved == 0 && st.bytes_requested == 0);
+    assert(st.peak_reserved == (UINT64_C(1) << SMALLEST_K));
+
+    //Trimmed blocks count the bytes they keep
+    struct buddy_pool pool;
+    buddy_init_ex(&pool, UINT64_C(1) << MIN_K, BUDDY_TRIM_TAIL);
+    mem = buddy_malloc(&pool, 600 << 10);
+    buddy_stats(&pool, &st);
+    assert(st.bytes_reserved == ((struct avail *)mem - 1)->span);
+    buddy_free(&pool, mem);
+    buddy_stats(&pool, &st);
+    assert(st.bytes_reserved == 0 && st.free_blocks[MIN_K] == 1);
+    buddy_destroy(&pool);
+}
+/**
+ * Histograms record one sample per call keyed by order and step count when
+ * compiled in, and report ENOTSUP otherwise.
+ */
+void test_buddy_histograms(void)
+{
+    fprintf(stderr, "->Testing latency histograms\n");
+    struct buddy_histograms *hist = malloc(sizeof(*hist));
+    void *mem = buddy_malloc(&test_pool, 1);
+    buddy_free(&test_pool, mem);
+#ifdef BUDDY_HISTOGRAMS
+    assert(buddy_histograms_snapshot(&test_pool, hist, true) == 0);
+    assert(hist->malloc_by_order[SMALLEST_K].total == 1);
+    assert(hist->malloc_by_steps[MIN_K - SMALLEST_K].total == 1);
+    assert(hist->free_by_order[SMALLEST_K].total == 1);
+    assert(hist->free_by_steps[MIN_K - SMALLEST_K].total == 1);
+    assert(buddy_histogram_percentile(&hist->malloc_by_order[SMALLEST_K], 0.5) <= hist->malloc_by_order[SMALLEST_K].max);
+    assert(buddy_histograms_snapshot(&test_pool, hist, false) == 0);
+    assert(hist->malloc_by_order[SMALLEST_K].total == 0);
+#else
+    assert(buddy_histograms_snapshot(&test_pool, hist, false) == -1 && errno == ENOTSUP);
+#endif
+
+    //Bucket 5 holds exactly 5, bucket 8 holds 8 and 9
+    memset(hist, 0, sizeof(*hist));
+    struct buddy_histogram *h = &hist->malloc_by_order[0];
+    h->count[5] = 10;
+    h->count[8] = 10;
+    h->total = 20;
+    h->max = 9;
+    assert(buddy_histogram_percentile(h, 0.25) == 5);
+    assert(buddy_histogram_percentile(h, 0.9) == 9);
+    free(hist);
+}
+/**
+ * With a one byte sampling rate every allocation is sampled, so the dump
+ * must show exactly the live and cumulative counts we produced.
+ */
+void test_profile_dump(void)
+{
+    fprintf(stderr, "->Testing sampling heap profiler\n");
+    assert(buddy_profile_dump(&test_pool, stderr) == -1 && errno == EINVAL);
+    assert(buddy_profile_start(&test_pool, 1) == 0);
+    void *mem[10];
+    for (int i = 0; i < 10; i++)
+        mem[i] = buddy_malloc(&test_pool, 100);
+    for (int i = 0; i < 4; i++)
+        buddy_free(&test_pool, mem[i]);
+
+    FILE *out = tmpfile();
+    assert(buddy_profile_dump(&test_pool, out) == 0);
+    rewind(out);
+    size_t live_n, live_b, alloc_n, alloc_b, rate;
+    assert(fscanf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu",
+                  &live_n, &live_b, &alloc_n, &alloc_b, &rate) == 5);
+    assert(live_n == 6 && live_b == 600 && alloc_n == 10 && alloc_b == 1000 && rate == 1);
+    char line[256];
+    assert(fgets(line, sizeof(line), out) && fgets(line, sizeof(line), out));
+    assert(strstr(line, "@ 0x") != NULL);
+    fclose(out);
+
+    //A stream that cannot be written fails the dump
+    out = fopen("/dev/null", "r");
+    assert(out != NULL);
+    assert(buddy_profile_dump(&test_pool, out) == -1 && errno == EIO);
+    fclose(out);
+
+    //A reset forgets the live samples but keeps the cumulative ones
+    buddy_reset(&test_pool);
+    out = tmpfile();
+    buddy_profile_dump(&test_pool, out);
+    rewind(out);
+    assert(fscanf(out, "heap profile: %zu: %zu [%zu: %zu]", &live_n, &live_b, &alloc_n, &alloc_b) == 4);
+    assert(live_n == 0 && alloc_n == 10);
+    fclose(out);
+
+    //Churn through the live table, every free must find its sample
+    void *churn[512] = {0};
+    size_t live = 0;
+    for (int i = 0; i < 20000; i++)
+    {
+        int slot = rand() % 512;
+        if (churn[slot]) { buddy_free(&test_pool, churn[slot]); churn[slot] = NULL; live--; }
+        else if ((churn[slot] = buddy_malloc(&test_pool, 64)) != NULL) live++;
+    }
+    out = tmpfile();
+    buddy_profile_dump(&test_pool, out);
+    rewind(out);
+    assert(fscanf(out, "heap profile: %zu: %zu", &live_n, &live_b) == 2);
+    assert(live_n == live && live_b == live * 64);
+    fclose(out);
+    for (int i = 0; i < 512; i++)
+        buddy_free(&test_pool, churn[i]);
+    buddy_profile_stop(&test_pool);
+    assert(test_pool.prof == NULL);
+}
+
+void test_leak_report(void)
+{
+    fprintf(stderr, "->Testing leak report\n");
+    struct buddy_leaks leaks;
+    assert(buddy_leak_report(NULL, NULL, &leaks) == -1 && errno == EINVAL);
+    assert(buddy_leak_report(&test_pool, NULL, &leaks) == 0);
+    assert(leaks.blocks == 0 && leaks.bytes_reserved == 0);
+
+    assert(buddy_profile_start(&test_pool, 1) == 0);
+    void *a = buddy_malloc(&test_pool, 100);
+    void *b = buddy_malloc(&test_pool, 5000);
+    void *c = buddy_malloc(&test_pool, 40);
+    buddy_free(&test_pool, b);
+
+    FILE *out = tmpfile();
+    assert(buddy_leak_report(&test_pool, out, &leaks) == 0);
+    assert(leaks.blocks == 2 && leaks.bytes_requested == 140);
+    assert(leaks.bytes_reserved == 128 + 64 && leaks.sampled == 2);
+    rewind(out);
+    char line[256];
+    bool found_a = false, found_total = false;
+    char want[64];
+    snprintf(want, sizeof(want), "%p 100 bytes", a);
+    while (fgets(line, sizeof(line), out))
+    {
+        if (strstr(line, want)) found_a = true;
+        if (strstr(line, "2 blocks still reserved, 192 bytes (140 requested)")) found_total = true;
+    }
+    assert(found_a && found_total);
+    fclose(out);
+    buddy_free(&test_pool, a);
+    buddy_free(&test_pool, c);
+    assert(buddy_leak_report(&test_pool, NULL, &leaks) == 0 && leaks.blocks == 0 && leaks.sampled == 0);
+    buddy_destroy(&test_pool);
+
+    //Trimmed blocks are skipped by their span, TLSF by its own block sizes
+    unsigned int modes[] = { BUDDY_TRIM_TAIL, BUDDY_ENGINE_TLSF };
+    for (int m = 0; m < 2; m++)
+    {
+        buddy_init_ex(&test_pool, UINT64_C(1) << MIN_K, modes[m] | BUDDY_LEAK_REPORT);
+        void *mem[64];
+        size_t live = 0;
+        for (int i = 0; i < 64; i++)
+            mem[i] = buddy_malloc(&test_pool, 1 + (size_t)(rand() % 20000));
+        for (int i = 0; i < 64; i += 2)
+            buddy_free(&test_pool, mem[i]);
+        for (int i = 1; i < 64; i += 2)
+            live += mem[i] != NULL;
+        struct buddy_stats st;
+        buddy_stats(&test_pool, &st);
+        assert(buddy_leak_report(&test_pool, NULL, &leaks) == 0);
+        assert(leaks.blocks == live && leaks.bytes_reserved == st.bytes_reserved);
+        assert(leaks.bytes_requested == st.bytes_requested);
+        for (int i = 1; i < 64; i += 2)
+            buddy_free(&test_pool, mem[i]);
+        buddy_destroy(&test_pool);
+    }
+
+    //A header that was overwritten stops the walk
+    buddy_init(&test_pool, UINT64_C(1) << MIN_K);
+    a = buddy_malloc(&test_pool, 100);
+    ((struct avail *)a - 1)->kval = 3;
+    assert(buddy_leak_report(&test_pool, NULL, &leaks) == -1 && errno == EIO);
+}
+
+/**
+ * Churn a pool and compare a single threaded and a parallel check.
+ */
+static void check_churned_pool(unsigned int flags)
+{
+    buddy_init_ex(&test_pool, UINT64_C(1) << MIN_K, flags);
+    void *mem[256] = {0};
+    for (int i = 0; i < 4000; i++)
+    {
+        int slot = rand() % 256;
+        if (mem[slot]) { buddy_free(&test_pool, mem[slot]); mem[slot] = NULL; }
+        else mem[slot] = buddy_malloc(&test_pool, 1 + (size_t)(rand() % 3000));
+    }
+    struct buddy_check_report one, many;
+    assert(buddy_check(&test_pool, &one, 1) == 0);
+    assert(buddy_check(&test_pool, &many, 4) == 0);
+    assert(memcmp(&one, &many, sizeof(one)) == 0);
+    assert(one.bytes_free + one.bytes_reserved == test_pool.numbytes || (flags & BUDDY_ENGINE_MASK));
+    for (int i = 0; i < 256; i++)
+        buddy_free(&test_pool, mem[i]);
+    assert(buddy_check(&test_pool, &one, 2) == 0 && one.reserved_blocks == 0);
+    buddy_destroy(&test_pool);
+}
+
+void test_buddy_check(void)
+{
+    fprintf(stderr, "->Testing heap consistency checker\n");
+    struct buddy_check_report report;
+    assert(buddy_check(NULL, &report, 1) == -1 && errno == EINVAL);
+    buddy_destroy(&test_pool);
+
+    check_churned_pool(BUDDY_POLICY_LIFO);
+    check_churned_pool(BUDDY_POLICY_ADDRESS);
+    check_churned_pool(BUDDY_POLICY_BUDDY_BUSY);
+    check_churned_pool(BUDDY_TRIM_TAIL);
+    check_churned_pool(BUDDY_ENGINE_TLSF);
+
+    //Two free buddies of order 6 that were never merged
+    buddy_init(&test_pool, UINT64_C(1) << MIN_K);
+    char *a = buddy_malloc(&test_pool, 1);
+    char *b = buddy_malloc(&test_pool, 1);
+    assert(b - a == 64);
+    buddy_free(&test_pool, a);
+    ((struct avail *)b - 1)->tag = BLOCK_AVAIL;
+    assert(buddy_check(&test_pool, &report, 1) == -1 && errno == EIO);
+    assert(report.unmerged == 1 && report.list_mismatch == 1 && report.bad_headers == 0);
+    ((struct avail *)b - 1)->tag = BLOCK_RESERVED;
+    buddy_free(&test_pool, b);
+    check_buddy_pool_full(&test_pool);
+
+    //A free block unlinked behind the pool's back
+    a = buddy_malloc(&test_pool, 1);
+    struct avail *lost = (struct avail *)(a + 64 - sizeof(struct avail));
+    lost->prev->next = lost->next;
+    lost->next->prev = lost->prev;
+    assert(buddy_check(&test_pool, &report, 4) == -1);
+    assert(report.list_mismatch == 1 && report.unmerged == 0);
+
+    //An overwritten header stops the walk and is reported by address
+    ((struct avail *)a - 1)->kval = 60;
+    assert(buddy_check(&test_pool, &report, 4) == -1);
+    assert(report.bad_headers == 1 && report.first_error == (struct avail *)a - 1);
+}
+
+void test_fragmentation(void)
+{
+    fprintf(stderr, "->Testing fragmentation metrics and heatmap\n");
+    struct buddy_frag f;
+    assert(buddy_fragmentation(&test_pool, NULL) == -1 && errno == EINVAL);
+    assert(buddy_fragmentation(&test_pool, &f) == 0);
+    assert(f.largest_free_order == MIN_K && f.bytes_free == test_pool.numbytes);
+    assert(f.free_bytes[MIN_K] == test_pool.numbytes && f.frag_index[MIN_K] == 0.0);
+
+    //One small block splits the pool into one free block of every smaller order
+    void *mem = buddy_malloc(&test_pool, 1);
+    assert(buddy_fragmentation(&test_pool, &f) == 0);
+    size_t free_bytes = test_pool.numbytes - 64;
+    assert(f.largest_free_order == MIN_K - 1 && f.bytes_free == free_bytes);
+    assert(f.free_bytes[SMALLEST_K] == 64 && f.free_bytes[MIN_K] == 0);
+    assert(f.frag_index[MIN_K] == 1.0 && f.frag_index[SMALLEST_K] == 0.0);
+    assert(f.frag_index[MIN_K - 1] == (double)(free_bytes - (UINT64_C(1) << (MIN_K - 1))) / (double)free_bytes);
+
+    FILE *out = tmpfile();
+    assert(buddy_heatmap(&test_pool, out, MIN_K + 1, BUDDY_HEATMAP_CSV) == -1 && errno == EINVAL);
+    assert(buddy_heatmap(&test_pool, out, MIN_K - 1, BUDDY_HEATMAP_CSV) == 0);
+    rewind(out);
+    char line[128];
+    size_t offset, bytes, used;
+    assert(fgets(line, sizeof(line), out) && strcmp(line, "offset,bytes,used\n") == 0);
+    assert(fscanf(out, "%zu,%zu,%zu\n", &offset, &bytes, &used) == 3);
+    assert(offset == 0 && bytes == test_pool.numbytes / 2 && used == 64);
+    assert(fscanf(out, "%zu,%zu,%zu\n", &offset, &bytes, &used) == 3);
+    assert(offset == test_pool.numbytes / 2 && used == 0);
+    assert(fgetc(out) == EOF);
+    fclose(out);
+
+    out = tmpfile();
+    assert(buddy_heatmap(&test_pool, out, SMALLEST_K, BUDDY_HEATMAP_BINARY) == 0);
+    rewind(out);
+    struct buddy_heatmap_header h;
+    assert(fread(&h, sizeof(h), 1, out) == 1);
+    assert(memcmp(h.magic, "BHM1", 4) == 0 && h.cell_k == SMALLEST_K);
+    assert(h.cells == test_pool.numbytes >> SMALLEST_K);
+    size_t full = 0, empty = 0;
+    for (int c; (c = fgetc(out)) != EOF;)
+    {
+        full += c == 255;
+        empty += c == 0;
+    }
+    assert(full == 1 && empty == h.cells - 1);
+    fclose(out);
+    buddy_free(&test_pool, mem);
+    buddy_destroy(&test_pool);
+
+    //TLSF walks its blocks, its control structure shows up as used
+    buddy_init_ex(&test_pool, UINT64_C(1) << MIN_K, BUDDY_ENGINE_TLSF);
+    mem = buddy_malloc(&test_pool, 5000);
+    struct buddy_stats st;
+    buddy_stats(&test_pool, &st);
+    assert(buddy_fragmentation(&test_pool, &f) == 0);
+    assert(f.bytes_free > 0 && f.bytes_free < st.bytes_free && f.largest_free_order == MIN_K - 1);
+    out = tmpfile();
+    assert(buddy_heatmap(&test_pool, out, 12, BUDDY_HEATMAP_BINARY) == 0);
+    assert(ftell(out) == (long)(sizeof(h) + (test_pool.numbytes >> 12)));
+    rewind(out);
+    assert(fread(&h, sizeof(h), 1, out) == 1);
+    unsigned char cells[256];
+    assert(fread(cells, 1, h.cells, out) == h.cells && h.cells == 256);
+    //Control structure and the block first, the sentinel last, free space between
+    assert(cells[0] == 255 && cells[h.cells - 2] == 0 && cells[h.cells - 1] > 0);
+    fclose(out);
+    buddy_free(&test_pool, mem);
+}
+
+void test_buddy_realloc(void)
+{
+    fprintf(stderr, "->Testing buddy_realloc\n");
+    struct buddy_check_report report;
+    struct buddy_stats st;
+    char *a = buddy_realloc(&test_pool, NULL, 10);
+    assert(a == (char *)test_pool.base + sizeof(struct avail));
+    memset(a, 'a', 10);
+
+    //The upper buddies are free so the block grows where it is
+    char *grown = buddy_realloc(&test_pool, a, 1000);
+    assert(grown == a && ((struct avail *)a - 1)->kval == 10);
+    assert(memcmp(a, "aaaaaaaaaa", 10) == 0);
+    buddy_stats(&test_pool, &st);
+    assert(st.bytes_reserved == 1024 && st.bytes_requested == 1000);
+    assert(buddy_check(&test_pool, &report, 1) == 0);
+
+    //A reserved buddy forces a move, the contents come along
+    char *b = buddy_malloc(&test_pool, 1);
+    assert(b == a + 1024);
+    memset(a, 'b', 1000);
+    char *moved = buddy_realloc(&test_pool, a, 5000);
+    assert(moved != NULL && moved != a && moved[0] == 'b' && moved[999] == 'b');
+    assert(buddy_check(&test_pool, &report, 1) == 0);
+
+    //Shrinking gives the upper halves back without moving
+    char *shrunk = buddy_realloc(&test_pool, moved, 100);
+    assert(shrunk == moved && ((struct avail *)shrunk - 1)->kval == 7);
+    buddy_stats(&test_pool, &st);
+    assert(st.bytes_reserved == 128 + 64 && st.bytes_requested == 101);
+    assert(buddy_check(&test_pool, &report, 1) == 0);
+
+    assert(buddy_realloc(&test_pool, shrunk, test_pool.numbytes) == NULL && errno == ENOMEM);
+    assert(shrunk[99] == 'b');
+    assert(buddy_realloc(&test_pool, shrunk, 0) == NULL);
+    buddy_free(&test_pool, b);
+    check_buddy_pool_full(&test_pool);
+    buddy_destroy(&test_pool);
+
+    //Growth chains keep their contents under the other modes too
+    unsigned int modes[] = { BUDDY_POLICY_ADDRESS, BUDDY_TRIM_TAIL, BUDDY_ENGINE_TLSF };
+    for (int m = 0; m < 3; m++)
+    {
+        buddy_init_ex(&test_pool, UINT64_C(1) << MIN_K, modes[m]);
+        unsigned char *p = NULL, *q = NULL;
+        for (size_t size = 16; size < 200000; size = size * 3 / 2)
+        {
+            p = buddy_realloc(&test_pool, p, size);
+            q = buddy_realloc(&test_pool, q, size / 2 + 1);
+            assert(p != NULL && q != NULL);
+            p[size - 1] = (unsigned char)size;
+            for (size_t i = 16; i < size; i = i * 3 / 2)
+                assert(p[i - 1] == (unsigned char)i);
+        }
+        assert(buddy_check(&test_pool, &report, 1) == 0);
+        buddy_free(&test_pool, p);
+        buddy_free(&test_pool, q);
+        buddy_stats(&test_pool, &st);
+        assert(st.bytes_reserved == 0 && st.bytes_requested == 0);
+        buddy_destroy(&test_pool);
+    }
+}
+
+void test_buddy_memalign(void)
+{
+    fprintf(stderr, "->Testing buddy_memalign\n");
+    struct buddy_check_report report;
+    struct buddy_stats st;
+    errno = 0;
+    assert(buddy_memalign(&test_pool, 24, 100) == NULL && errno == EINVAL);
+    assert(buddy_memalign(&test_pool, 0, 100) == NULL && errno == EINVAL);
+    assert(buddy_memalign(&test_pool, 16, 0) == NULL);
+    assert(buddy_memalign(&test_pool, 16, test_pool.numbytes) == NULL && errno == ENOMEM);
+    buddy_destroy(&test_pool);
+
+    unsigned int modes[] = { 0, BUDDY_POLICY_ADDRESS, BUDDY_TRIM_TAIL, BUDDY_ENGINE_TLSF };
+    for (int m = 0; m < 4; m++)
+    {
+        buddy_init_ex(&test_pool, UINT64_C(1) << MIN_K, modes[m]);
+        unsigned char *mem[13];
+        for (size_t a = 0; a < 13; a++)
+        {
+            size_t align = UINT64_C(1) << a;
+            mem[a] = buddy_memalign(&test_pool, align, 100 + a);
+            assert(mem[a] != NULL && ((uintptr_t)mem[a] & (align - 1)) == 0);
+            memset(mem[a], (int)a, 100 + a);
+        }
+        assert(buddy_check(&test_pool, &report, 1) == 0 && report.reserved_blocks == 13);
+
+        //Growing moves or extends the block, the alignment and contents stay
+        for (size_t a = 0; a < 13; a++)
+        {
+            size_t align = UINT64_C(1) << a;
+            unsigned char *grown = buddy_realloc(&test_pool, mem[a], 3000);
+            assert(grown != NULL && grown[0] == a && grown[99 + a] == a);
+            if (modes[m] != BUDDY_ENGINE_TLSF) assert(((uintptr_t)grown & (align - 1)) == 0);
+            mem[a] = buddy_realloc(&test_pool, grown, 50);
+            assert(mem[a] != NULL && mem[a][49] == a);
+        }
+        assert(buddy_check(&test_pool, &report, 1) == 0);
+        for (size_t a = 0; a < 13; a++)
+            buddy_free(&test_pool, mem[a]);
+        //A second free of an aligned block finds its block already free
+        buddy_free(&test_pool, mem[12]);
+        assert(buddy_check(&test_pool, &report, 1) == 0 && report.reserved_blocks == 0);
+        buddy_stats(&test_pool, &st);
+        assert(st.bytes_reserved == 0 && st.bytes_requested == 0 && st.allocs == st.frees);
+        if ((modes[m] & BUDDY_ENGINE_MASK) == BUDDY_ENGINE_BUDDY) check_buddy_pool_full(&test_pool);
+        buddy_destroy(&test_pool);
+    }
+}
+
+void test_sized_free_and_usable_size(void)
+{
+    fprintf(stderr, "->Testing buddy_free_sized, buddy_usable_size and buddy_malloc_at_least\n");
+    struct buddy_stats st;
+    size_t actual = 0;
+    char *a = buddy_malloc(&test_pool, 100);
+    assert(buddy_usable_size(&test_pool, a) == 128 - sizeof(struct avail));
+    char *b = buddy_malloc_at_least(&test_pool, 600, &actual);
+    assert(actual == 1024 - sizeof(struct avail) && buddy_usable_size(&test_pool, b) == actual);
+    size_t none = 1;
+    assert(buddy_malloc_at_least(&test_pool, test_pool.numbytes, &none) == NULL && none == 0);
+    buddy_stats(&test_pool, &st);
+    assert(st.bytes_requested == 700);
+
+    //The slack belongs to the caller and survives a move
+    memset(b, 'x', actual);
+    char *c = buddy_malloc(&test_pool, 5000);
+    char *moved = buddy_realloc(&test_pool, b, 3000);
+    assert(moved != b && moved[actual - 1] == 'x');
+
+    //Freed by their requested size, which is all the buddy engine reads
+    buddy_free_sized(&test_pool, a, 100);
+    ((struct avail *)moved - 1)->size = (size_t)0xdeadbeef;
+    buddy_free_sized(&test_pool, moved, 3000);
+    ((struct avail *)c - 1)->size = SIZE_MAX;
+    buddy_free_sized(&test_pool, c, 5000);
+    buddy_free_sized(&test_pool, NULL, 10);
+    buddy_stats(&test_pool, &st);
+    assert(st.bytes_reserved == 0 && st.bytes_requested == 0 && st.allocs == st.frees);
+    check_buddy_pool_full(&test_pool);
+
+    char *aligned = buddy_memalign(&test_pool, 256, 100);
+    assert(buddy_usable_size(&test_pool, aligned) >= 100);
+    buddy_free(&test_pool, aligned);
+    assert(buddy_usable_size(&test_pool, aligned) == 0 && buddy_usable_size(&test_pool, NULL) == 0);
+    buddy_destroy(&test_pool);
+
+    //Trimmed blocks keep whole units, TLSF blocks their payload
+    unsigned int modes[] = { BUDDY_TRIM_TAIL, BUDDY_ENGINE_TLSF };
+    for (int m = 0; m < 2; m++)
+    {
+        buddy_init_ex(&test_pool, UINT64_C(1) << MIN_K, modes[m]);
+        char *p = buddy_malloc_at_least(&test_pool, 600, &actual);
+        size_t want = modes[m] == BUDDY_TRIM_TAIL ? 640 - sizeof(struct avail) : 600;
+        assert(p != NULL && actual == want);
+        memset(p, 'y', actual);
+        buddy_free_sized(&test_pool, p, 600);
+        buddy_stats(&test_pool, &st);
+        assert(st.bytes_reserved == 0 && st.frees == 1);
+        buddy_destroy(&test_pool);
+    }
+}
+
+struct cached_conn
+{
+    unsigned int magic;
+    char buffer[200];
+};
+
+static int conn_ctor(void *obj, void *arg)
+{
+    int *budget = arg;
+    if (*budget == 0) return -1;
+    (*budget)--;
+    ((struct cached_conn *)obj)->magic = 0xC0FFEE;
+    return 0;
+}
+
+static void conn_dtor(void *obj, void *arg)
+{
+    (void)arg;
+    assert(((struct cached_conn *)obj)->magic == 0xC0FFEE);
+    ((struct cached_conn *)obj)->magic = 0;
+}
+
+void test_object_cache(void)
+{
+    fprintf(stderr, "->Testing buddy_cache object caching\n");
+    struct buddy_cache cache;
+    struct buddy_cache_stats st;
+    int budget = 1000;
+    assert(buddy_cache_init(&cache, &test_pool, "conn", 0, 0, NULL, NULL, NULL) == -1 && errno == EINVAL);
+    assert(buddy_cache_init(&cache, &test_pool, "conn", 8, 3, NULL, NULL, NULL) == -1 && errno == EINVAL);
+    assert(buddy_cache_init(&cache, &test_pool, "conn", sizeof(struct cached_conn), 64,
+                            conn_ctor, conn_dtor, &budget) == 0);
+    assert(cache.slab_k == CACHE_MIN_SLAB_K && cache.per_slab >= CACHE_MIN_OBJECTS);
+
+    //Three full slabs
+    struct cached_conn *objs[128];
+    size_t n = 3 * cache.per_slab;
+    assert(n <= 128);
+    for (size_t i = 0; i < n; i++)
+    {
+        objs[i] = buddy_cache_alloc(&cache);
+        assert(objs[i] != NULL && objs[i]->magic == 0xC0FFEE && ((uintptr_t)objs[i] & 63) == 0);
+        memset(objs[i]->buffer, i, sizeof(objs[i]->buffer));
+    }
+    for (size_t i = 0; i < n; i++)
+        assert(objs[i]->buffer[199] == (char)i);
+    buddy_cache_stats(&cache, &st);
+    assert(st.in_use == n && st.constructed == n && st.ctor_calls == n && st.slabs == 3);
+
+    //Freed objects come back constructed, the constructor does not run again
+    for (size_t i = 0; i < n; i++)
+        buddy_cache_free(&cache, objs[i]);
+    for (size_t i = 0; i < n; i++)
+    {
+        objs[i] = buddy_cache_alloc(&cache);
+        assert(objs[i]->magic == 0xC0FFEE);
+    }
+    buddy_cache_stats(&cache, &st);
+    assert(st.ctor_calls == n && st.allocs == 2 * n && st.frees == n && st.slab_allocs == 3);
+
+    //A failing constructor fails the allocation
+    budget = 0;
+    assert(buddy_cache_alloc(&cache) == NULL && errno == ECANCELED);
+    budget = 1000;
+
+    //Idle slabs are reaped with their objects destroyed, one object keeps its slab
+    void *keep = buddy_cache_alloc(&cache);
+    for (size_t i = 0; i < n; i++)
+        buddy_cache_free(&cache, objs[i]);
+    buddy_cache_stats(&cache, &st);
+    assert(buddy_cache_reap(&cache) == 3);
+    struct buddy_cache_stats after;
+    buddy_cache_stats(&cache, &after);
+    assert(after.slabs == 1 && after.in_use == 1 && after.constructed == 1);
+    assert(after.dtor_calls == st.constructed - 1);
+    buddy_cache_free(&cache, keep);
+    buddy_cache_destroy(&cache);
+    buddy_cache_stats(&cache, &st);
+    assert(st.slabs == 0 && st.slab_frees == st.slab_allocs);
+    check_buddy_pool_full(&test_pool);
+}
+
+static void *locked_churn(void *arg)
+{
+    struct buddy_pool *pool = arg;
+    void *mem[128] = {0};
+    unsigned int seed = (unsigned int)(uintptr_t)mem;
+    for (int i = 0; i < 20000; i++)
+    {
+        int slot = rand_r(&seed) % 128;
+        if (mem[slot]) {
+            assert(*(uintptr_t *)mem[slot] == (uintptr_t)&mem[slot]);
+            buddy_free(pool, mem[slot]);
+            mem[slot] = NULL;
+        } else if ((mem[slot] = buddy_malloc(pool, 8 + (size_t)(rand_r(&seed) % 2000))) != NULL) {
+            *(uintptr_t *)mem[slot] = (uintptr_t)&mem[slot];
+        }
+    }
+    for (int i = 0; i < 128; i++)
+        buddy_free(pool, mem[i]);
+    return NULL;
+}
+
+#if defined(__linux__) && defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#define TEST_RSEQ 1
+
+/*
+ * Churn from a thread without a restartable sequence, as if its registration
+ * had failed while the pool was created by a thread that has one.
+ */
+static void *unregistered_churn(void *arg)
+{
+    if (__rseq_size > 0) {
+        struct rseq *rs = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+        assert(syscall(SYS_rseq, rs, sizeof(*rs), RSEQ_FLAG_UNREGISTER, RSEQ_SIG) == 0);
+        assert((int32_t)rs->cpu_id < 0);
+    }
+    return locked_churn(arg);
+}
+#endif
+#endif
+
+void test_locked_pool(void)
+{
+    fprintf(stderr, "->Testing BUDDY_LOCKED pool shared by threads\n");
+    buddy_destroy(&test_pool);
+    unsigned int modes[] = { BUDDY_LOCKED, BUDDY_LOCKED | BUDDY_ENGINE_TLSF };
+    for (int m = 0; m < 2; m++)
+    {
+        buddy_init_ex(&test_pool, UINT64_C(1) << MIN_K, modes[m]);
+        pthread_t tid[4];
+        for (int t = 0; t < 4; t++)
+            assert(pthread_create(&tid[t], NULL, locked_churn, &test_pool) == 0);
+        for (int t = 0; t < 4; t++)
+            pthread_join(tid[t], NULL);
+        struct buddy_check_report report;
+        assert(buddy_check(&test_pool, &report, 1) == 0 && report.reserved_blocks == 0);
+        struct buddy_stats st;
+        buddy_stats(&test_pool, &st);
+        assert(st.allocs == st.frees);
+        buddy_destroy(&test_pool);
+    }
+}
+
+static volatile int registry_churning;
+
+static void *registry_churn(void *arg)
+{
+    (void)arg;
+    while (registry_churning)
+    {
+        struct buddy_pool pool;
+        buddy_init(&pool, UINT64_C(1) << (MIN_K + 1));
+        buddy_destroy(&pool);
+    }
+    return NULL;
+}
+
+void test_buddy_free_any(void)
+{
+    fprintf(stderr, "->Testing buddy_free_any across pools\n");
+    //A large pool fills whole upper level entries of the registry
+    struct buddy_pool pools[3];
+    size_t kvals[] = { MIN_K, MIN_K + 3, 31 };
+    char *blocks[3][64];
+    for (int i = 0; i < 3; i++)
+    {
+        buddy_init(&pools[i], UINT64_C(1) << kvals[i]);
+        assert(((uintptr_t)pools[i].base & ((UINT64_C(1) << MIN_K) - 1)) == 0);
+        assert(buddy_pool_of(pools[i].base) == &pools[i]);
+        assert(buddy_pool_of((char *)pools[i].base + pools[i].numbytes - 1) == &pools[i]);
+        for (int j = 0; j < 64; j++)
+            blocks[i][j] = buddy_malloc(&pools[i], 100 + (size_t)j * 100);
+    }
+    assert(buddy_pool_of(test_pool.base) == &test_pool);
+    assert(buddy_pool_of(&kvals) == NULL && buddy_pool_of(NULL) == NULL);
+    buddy_free_any(&kvals);
+    buddy_free_any(NULL);
+
+    //Free the blocks of all pools interleaved, without naming the pool
+    pthread_t tid;
+    registry_churning = 1;
+    assert(pthread_create(&tid, NULL, registry_churn, NULL) == 0);
+    for (int j = 0; j < 64; j++)
+        for (int i = 0; i < 3; i++)
+        {
+            assert(buddy_pool_of(blocks[i][j] + 50) == &pools[i]);
+            buddy_free_any(blocks[i][j]);
+        }
+    registry_churning = 0;
+    pthread_join(tid, NULL);
+
+    for (int i = 0; i < 3; i++)
+    {
+        check_buddy_pool_full(&pools[i]);
+        char *base = pools[i].base;
+        buddy_destroy(&pools[i]);
+        assert(buddy_pool_of(base) == NULL);
+    }
+}
+
+struct remote_batch
+{
+    struct buddy_pool *pool;
+    char **blocks;
+    int count;
+};
+
+static void *remote_free_batch(void *arg)
+{
+    struct remote_batch *b = arg;
+    for (int i = 0; i < b->count; i++)
+    {
+        assert(*(uintptr_t *)b->blocks[i] == (uintptr_t)&b->blocks[i]);
+        buddy_free(b->pool, b->blocks[i]);
+    }
+    return NULL;
+}
+
+static void *take_ownership(void *arg)
+{
+    buddy_set_owner(arg);
+    return NULL;
+}
+
+void test_remote_free_queue(void)
+{
+    fprintf(stderr, "->Testing frees from other threads on a BUDDY_OWNED pool\n");
+    buddy_destroy(&test_pool);
+    buddy_init_ex(&test_pool, UINT64_C(1) << MIN_K, BUDDY_OWNED);
+    enum { THREADS = 4, PER_THREAD = 500 };
+    static char *blocks[THREADS * PER_THREAD];
+    for (int i = 0; i < THREADS * PER_THREAD; i++)
+    {
+        blocks[i] = buddy_malloc(&test_pool, 40 + (size_t)(i % 7) * 50);
+        *(uintptr_t *)blocks[i] = (uintptr_t)&blocks[i];
+    }
+
+    //The owner keeps allocating, and draining, while the others free
+    pthread_t tid[THREADS];
+    struct remote_batch batch[THREADS];
+    for (int t = 0; t < THREADS; t++)
+    {
+        batch[t] = (struct remote_batch){ &test_pool, blocks + t * PER_THREAD, PER_THREAD };
+        assert(pthread_create(&tid[t], NULL, remote_free_batch, &batch[t]) == 0);
+    }
+    for (int i = 0; i < 2000; i++)
+        buddy_free(&test_pool, buddy_malloc(&test_pool, 64));
+    for (int t = 0; t < THREADS; t++)
+        pthread_join(tid[t], NULL);
+    buddy_drain_remote(&test_pool);
+
+    struct buddy_stats st;
+    buddy_stats(&test_pool, &st);
+    assert(st.remote_frees == THREADS * PER_THREAD && st.allocs == st.frees);
+    assert(buddy_drain_remote(&test_pool) == 0);
+    check_buddy_pool_full(&test_pool);
+
+    //Handed to another thread, the old owner's frees become remote
+    char *mine = buddy_malloc(&test_pool, 100);
+    *(uintptr_t *)mine = (uintptr_t)&mine;
+    pthread_t next;
+    assert(pthread_create(&next, NULL, take_ownership, &test_pool) == 0);
+    pthread_join(next, NULL);
+    buddy_free(&test_pool, mine);
+    buddy_stats(&test_pool, &st);
+    assert(st.bytes_reserved > 0 && test_pool.remote == mine);
+    buddy_set_owner(&test_pool);
+    assert(buddy_drain_remote(&test_pool) == 1);
+    check_buddy_pool_full(&test_pool);
+}
+
+void test_nbbs_engine(void)
+{
+    fprintf(stderr, "->Testing NBBS engine on one thread\n");
+    struct buddy_pool pool;
+    buddy_init_ex(&pool, UINT64_C(1) << MIN_K, BUDDY_ENGINE_NBBS);
+    struct buddy_check_report report;
+    struct buddy_stats st;
+
+    //No header, blocks are aligned to their size
+    char *a = buddy_malloc(&pool, 64);
+    char *b = buddy_malloc(&pool, 65);
+    assert(a == pool.base && buddy_usable_size(&pool, a) == 64);
+    assert(((uintptr_t)b & 127) == 0 && buddy_usable_size(&pool, b) == 128);
+    char *c = buddy_memalign(&pool, 4096, 10);
+    assert(((uintptr_t)c & 4095) == 0);
+    buddy_stats(&pool, &st);
+    assert(st.allocs == 3 && st.bytes_reserved == 64 + 128 + 4096);
+    assert(buddy_check(&pool, &report, 1) == 0 && report.reserved_blocks == 3);
+
+    //Grows by moving, keeps its bytes
+    memset(b, 'b', 128);
+    char *grown = buddy_realloc(&pool, b, 1000);
+    assert(grown != b && grown[127] == 'b' && buddy_realloc(&pool, grown, 100) == grown);
+
+    buddy_free(&pool, a);
+    buddy_free(&pool, a); //double free does nothing
+    buddy_free(&pool, grown + 8); //so does a pointer into a block
+    buddy_free(&pool, grown);
+    buddy_free(&pool, c);
+    buddy_stats(&pool, &st);
+    assert(st.bytes_reserved == 0 && st.allocs == st.frees && st.allocs == 4);
+
+    //Everything merged back, the whole pool is one block again
+    assert(buddy_check(&pool, &report, 1) == 0 && report.reserved_blocks == 0);
+    void *all = buddy_malloc(&pool, pool.numbytes);
+    assert(all == pool.base && buddy_malloc(&pool, 1) == NULL && errno == ENOMEM);
+    buddy_free(&pool, all);
+
+    //Filled with the smallest blocks there is no room left, then none is lost
+    size_t count = 0;
+    while (buddy_malloc(&pool, 1))
+        count++;
+    assert(count == pool.numbytes >> SMALLEST_K);
+    buddy_reset(&pool);
+    assert(buddy_malloc(&pool, pool.numbytes) == pool.base);
+    buddy_destroy(&pool);
+}
+
+struct nbbs_worker
+{
+    struct buddy_pool *pool;
+    unsigned int seed;
+    size_t filled;
+};
+
+/**
+ * Random sizes, each block stamped over its whole length with a value only
+ * this thread and slot use and checked before it is freed, so two threads
+ * ever getting overlapping blocks shows up as a broken stamp.
+ */
+static void *nbbs_churn(void *arg)
+{
+    struct nbbs_worker *w = arg;
+    uint32_t *mem[64] = {0};
+    size_t len[64] = {0};
+    for (int i = 0; i < 20000; i++)
+    {
+        int slot = rand_r(&w->seed) % 64;
+        uint32_t stamp = (uint32_t)(uintptr_t)&mem[slot];
+        if (mem[slot]) {
+            for (size_t j = 0; j < len[slot]; j++)
+                assert(mem[slot][j] == stamp);
+            buddy_free(w->pool, mem[slot]);
+            mem[slot] = NULL;
+            continue;
+        }
+        len[slot] = 1 + (size_t)(rand_r(&w->seed) % (rand_r(&w->seed) % 8 ? 64 : 2048));
+        //Now and then a block big enough to mark up to the root
+        if (rand_r(&w->seed) % 256 == 0) len[slot] = (UINT64_C(1) << (MIN_K - 1)) / sizeof(uint32_t);
+        mem[slot] = buddy_malloc(w->pool, len[slot] * sizeof(uint32_t));
+        for (size_t j = 0; mem[slot] && j < len[slot]; j++)
+            mem[slot][j] = stamp;
+    }
+    for (int i = 0; i < 64; i++)
+        buddy_free(w->pool, mem[i]);
+    return NULL;
+}
+
+static void *nbbs_fill(void *arg)
+{
+    struct nbbs_worker *w = arg;
+    while (buddy_malloc(w->pool, 1))
+        w->filled++;
+    return NULL;
+}
+
+void test_nbbs_threads(void)
+{
+    fprintf(stderr, "->Testing NBBS engine shared by threads without a lock\n");
+    struct buddy_pool pool;
+    buddy_init_ex(&pool, UINT64_C(1) << (MIN_K + 2), BUDDY_ENGINE_NBBS);
+    struct buddy_check_report report;
+    struct buddy_stats st;
+    pthread_t tid[4];
+    struct nbbs_worker w[4];
+    for (int round = 0; round < 3; round++)
+    {
+        for (int t = 0; t < 4; t++)
+        {
+            w[t] = (struct nbbs_worker){ &pool, (unsigned int)(round * 4 + t + 1), 0 };
+            assert(pthread_create(&tid[t], NULL, nbbs_churn, &w[t]) == 0);
+        }
+        for (int t = 0; t < 4; t++)
+            pthread_join(tid[t], NULL);
+        //Every mark the threads left on the tree was taken back
+        assert(buddy_check(&pool, &report, 1) == 0 && report.reserved_blocks == 0);
+        buddy_stats(&pool, &st);
+        assert(st.allocs == st.frees && st.bytes_reserved == 0);
+        void *all = buddy_malloc(&pool, pool.numbytes);
+        assert(all == pool.base);
+        buddy_free(&pool, all);
+    }
+
+    //Racing for the smallest blocks, every block goes to exactly one thread
+    size_t filled = 0;
+    for (int t = 0; t < 4; t++)
+    {
+        w[t] = (struct nbbs_worker){ &pool, 0, 0 };
+        assert(pthread_create(&tid[t], NULL, nbbs_fill, &w[t]) == 0);
+    }
+    for (int t = 0; t < 4; t++)
+    {
+        pthread_join(tid[t], NULL);
+        filled += w[t].filled;
+    }
+    assert(filled == pool.numbytes >> SMALLEST_K);
+    assert(buddy_check(&pool, &report, 1) == 0 && report.reserved_blocks == filled);
+    buddy_destroy(&pool);
+}
+
+void test_percpu_cache(void)
+{
+    fprintf(stderr, "->Testing per-CPU caches of small blocks\n");
+    buddy_destroy(&test_pool);
+    buddy_init_ex(&test_pool, UINT64_C(1) << MIN_K, BUDDY_LOCKED | BUDDY_PERCPU);
+    assert(test_pool.percpu != NULL);
+    struct buddy_stats st;
+
+    //The first miss takes a batch from the pool, the rest stays cached
+    char *a = buddy_malloc(&test_pool, 64);
+    buddy_stats(&test_pool, &st);
+    assert(a != NULL && st.allocs == PERCPU_BATCH && st.frees == 0);
+    buddy_free(&test_pool, a);
+    char *b = buddy_malloc(&test_pool, 100);
+    assert(b == a);
+    buddy_stats(&test_pool, &st);
+    assert(st.allocs == PERCPU_BATCH && st.frees == 0);
+
+    //Larger blocks bypass the caches
+    char *big = buddy_malloc(&test_pool, 2000);
+    buddy_free(&test_pool, big);
+    buddy_stats(&test_pool, &st);
+    assert(st.allocs == PERCPU_BATCH + 1 && st.frees == 1);
+    buddy_free(&test_pool, b);
+    assert(buddy_percpu_flush(&test_pool) == PERCPU_BATCH);
+    assert(buddy_percpu_flush(&test_pool) == 0);
+    check_buddy_pool_full(&test_pool);
+
+    //Overflowing a cache sends a batch back
+    static char *many[4 * PERCPU_SLOTS];
+    for (int i = 0; i < 4 * PERCPU_SLOTS; i++)
+        assert((many[i] = buddy_malloc(&test_pool, 200)) != NULL);
+    for (int i = 0; i < 4 * PERCPU_SLOTS; i++)
+        buddy_free(&test_pool, many[i]);
+    buddy_stats(&test_pool, &st);
+    assert(st.allocs - st.frees <= PERCPU_SLOTS);
+    buddy_percpu_flush(&test_pool);
+    check_buddy_pool_full(&test_pool);
+
+    //Threads move between CPUs while they churn
+    pthread_t tid[4];
+    for (int t = 0; t < 4; t++)
+        assert(pthread_create(&tid[t], NULL, locked_churn, &test_pool) == 0);
+    for (int t = 0; t < 4; t++)
+        pthread_join(tid[t], NULL);
+    buddy_percpu_flush(&test_pool);
+    buddy_stats(&test_pool, &st);
+    assert(st.allocs == st.frees);
+    check_buddy_pool_full(&test_pool);
+
+#ifdef TEST_RSEQ
+    //A thread without a restartable sequence bypasses the caches
+    pthread_t plain;
+    buddy_free(&test_pool, buddy_malloc(&test_pool, 10));
+    assert(pthread_create(&plain, NULL, unregistered_churn, &test_pool) == 0);
+    assert(pthread_create(&tid[0], NULL, locked_churn, &test_pool) == 0);
+    pthread_join(plain, NULL);
+    pthread_join(tid[0], NULL);
+    buddy_percpu_flush(&test_pool);
+    buddy_stats(&test_pool, &st);
+    assert(st.allocs == st.frees);
+    check_buddy_pool_full(&test_pool);
+#endif
+
+    //A reset drops the cached blocks with everything else
+    buddy_free(&test_pool, buddy_malloc(&test_pool, 10));
+    buddy_reset(&test_pool);
+    assert(buddy_percpu_flush(&test_pool) == 0);
+    check_buddy_pool_full(&test_pool);
+    buddy_destroy(&test_pool);
+
+    //Only the buddy engine without trimming has caches
+    buddy_init_ex(&test_pool, UINT64_C(1) << MIN_K, BUDDY_PERCPU | BUDDY_TRIM_TAIL);
+    assert(test_pool.percpu == NULL);
+}
+
+void test_trace_replay(void)
+{
+    fprintf(stderr, "->Testing trace recorder against a replay\n");
+    assert(buddy_trace_stop(&test_pool) == -1 && errno == EINVAL);
+    buddy_destroy(&test_pool);
+    buddy_init_ex(&test_pool, UINT64_C(1) << MIN_K, BUDDY_LOCKED);
+    char path[] = "/tmp/buddy-trace-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    assert(buddy_trace_start(&test_pool, path) == 0);
+    assert(buddy_trace_start(&test_pool, path) == -1 && errno == EINVAL);
+
+    pthread_t tid[4];
+    for (int t = 0; t < 4; t++)
+        assert(pthread_create(&tid[t], NULL, locked_churn, &test_pool) == 0);
+    for (int t = 0; t < 4; t++)
+        pthread_join(tid[t], NULL);
+    void *mem = buddy_malloc(&test_pool, 100);
+    mem = buddy_realloc(&test_pool, mem, 5000);
+    buddy_free(&test_pool, mem);
+    buddy_reset(&test_pool);
+    assert(buddy_trace_dropped(&test_pool) == 0);
+    assert(buddy_trace_stop(&test_pool) == 0);
+    assert(test_pool.trace == NULL);
+
+    struct buddy_trace_header h;
+    struct buddy_trace_reader *r = buddy_trace_open(path, &h);
+    assert(r != NULL);
+    assert(h.pool_bytes == test_pool.numbytes && h.pool_flags == BUDDY_LOCKED);
+    size_t n = buddy_trace_count(r);
+    assert(n > 4 * 20000);
+
+    //Replaying on one thread in call order must hand out the very same blocks
+    struct buddy_pool replay;
+    buddy_init_ex(&replay, h.pool_bytes, 0);
+    uint32_t threads = 0;
+    uint64_t last_at[TRACE_MAX_THREADS] = {0}, at;
+    const struct buddy_trace_event *e;
+    size_t i = 0;
+    for (; (e = buddy_trace_next(r, &at)) != NULL; i++)
+    {
+        assert(e->seq_op >> BUDDY_TRACE_OP_BITS == i);
+        if (e->thread >= threads) threads = e->thread + 1;
+        assert(at >= last_at[e->thread]);
+        last_at[e->thread] = at;
+        void *in_ptr = e->id ? (char *)replay.base + e->id - 1 : NULL;
+        void *p = NULL;
+        switch (e->seq_op & ((1u << BUDDY_TRACE_OP_BITS) - 1))
+        {
+        case BUDDY_TRACE_MALLOC: p = buddy_malloc(&replay, e->size); break;
+        case BUDDY_TRACE_FREE: buddy_free(&replay, in_ptr); break;
+        case BUDDY_TRACE_REALLOC: p = buddy_realloc(&replay, in_ptr, e->size); break;
+        case BUDDY_TRACE_RESET: buddy_reset(&replay); break;
+        }
+        uint64_t id = p ? (uint64_t)((char *)p - (char *)replay.base) + 1 : 0;
+        assert(id == e->result);
+        if (i == n - 1) assert((e->seq_op & 3) == BUDDY_TRACE_RESET);
+    }
+    assert(i == n && threads == 5);
+    buddy_trace_rewind(r);
+    assert((e = buddy_trace_next(r, NULL)) != NULL && e->seq_op >> BUDDY_TRACE_OP_BITS == 0);
+    buddy_trace_close(r);
+
+    //Anything else is refused
+    FILE *f = fopen(path, "wb");
+    fputs("not a trace", f);
+    fclose(f);
+    assert(buddy_trace_open(path, NULL) == NULL && errno == EINVAL);
+    unlink(path);
+    buddy_destroy(&replay);
+}
+
+void test_trace_many_pools(void)
+{
+    fprintf(stderr, "->Testing one thread tracing more pools than it remembers\n");
+    enum { POOLS = 9, ROUNDS = 1000 };
+    static struct buddy_pool pools[POOLS];
+    char paths[POOLS][32];
+    for (int p = 0; p < POOLS; p++)
+    {
+        buddy_init_ex(&pools[p], UINT64_C(1) << MIN_K, 0);
+        strcpy(paths[p], "/tmp/buddy-trace-XXXXXX");
+        int fd = mkstemp(paths[p]);
+        assert(fd >= 0);
+        close(fd);
+        assert(buddy_trace_start(&pools[p], paths[p]) == 0);
+    }
+    //Every switch between pools misses the thread's slots once there are
+    //more pools than slots, none of them may cost a buffer
+    for (int i = 0; i < ROUNDS; i++)
+        for (int p = 0; p < POOLS; p++)
+            buddy_free(&pools[p], buddy_malloc(&pools[p], 64));
+    for (int p = 0; p < POOLS; p++)
+    {
+        assert(buddy_trace_dropped(&pools[p]) == 0);
+        assert(buddy_trace_stop(&pools[p]) == 0);
+        struct buddy_trace_reader *r = buddy_trace_open(paths[p], NULL);
+        assert(r != NULL && buddy_trace_count(r) == 2 * ROUNDS);
+        const struct buddy_trace_event *e;
+        while ((e = buddy_trace_next(r, NULL)) != NULL)
+            assert(e->thread == 0);
+        buddy_trace_close(r);
+        unlink(paths[p]);
+        buddy_destroy(&pools[p]);
+    }
+}
 
 int main(void) {
   time_t t;
@@ -293,5 +1660,31 @@ int main(void) {
   RUN_TEST(test_buddy_free_null);
   RUN_TEST(test_buddy_free_invalid);
   RUN_TEST(test_buddy_malloc_smallest_k);
+  RUN_TEST(test_policy_address_lowest_first);
+  RUN_TEST(test_policy_address_churn);
+  RUN_TEST(test_policy_buddy_busy);
+  RUN_TEST(test_trim_tail_releases_tail);
+  RUN_TEST(test_trim_tail_churn);
+  RUN_TEST(test_tlsf_churn);
+  RUN_TEST(test_arena_chain_and_reset);
+  RUN_TEST(test_buddy_reset);
+  RUN_TEST(test_buddy_stats);
+  RUN_TEST(test_buddy_histograms);
+  RUN_TEST(test_profile_dump);
+  RUN_TEST(test_leak_report);
+  RUN_TEST(test_buddy_check);
+  RUN_TEST(test_fragmentation);
+  RUN_TEST(test_buddy_realloc);
+  RUN_TEST(test_buddy_memalign);
+  RUN_TEST(test_object_cache);
+  RUN_TEST(test_sized_free_and_usable_size);
+  RUN_TEST(test_locked_pool);
+  RUN_TEST(test_buddy_free_any);
+  RUN_TEST(test_remote_free_queue);
+  RUN_TEST(test_nbbs_engine);
+  RUN_TEST(test_nbbs_threads);
+  RUN_TEST(test_percpu_cache);
+  RUN_TEST(test_trace_replay);
+  RUN_TEST(test_trace_many_pools);
 return UNITY_END();
 }
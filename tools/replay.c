@@ -0,0 +1,261 @@
+/**
+ * @file replay.c
+ * @brief   Replays a trace written by buddy_trace_start against a fresh pool.
+ *          The calls run on one thread in the order they were numbered in, so
+ *          a replay is deterministic whatever threads recorded the trace. The
+ *          trace runs twice: a timed pass for the throughput, at full speed or
+ *          waiting for each call's original time with -t, and an untimed pass
+ *          that samples the footprint and fragmentation.
+ *
+ *          usage: replay [-t] [-k pool_k] [-f flags] [-o frag_order] trace
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/lab.h"
+#include "../src/trace.h"
+#include "../src/clock.h"
+
+#define SAMPLE_EVERY 1024           /*Calls between two fragmentation samples*/
+#define SPIN_NS 50000               /*Waits shorter than this spin instead of sleeping*/
+#define TOMBSTONE UINT64_MAX
+
+struct trace
+{
+    struct buddy_trace_header header;
+    struct buddy_trace_event *ev;
+    size_t count;
+    uint64_t *at_ns;                /*Time of each call since the trace started*/
+};
+
+/**
+ * Maps the IDs of the trace to the blocks of the replay.
+ */
+struct id_map
+{
+    uint64_t *id;                   /*0 empty, TOMBSTONE removed*/
+    void **ptr;
+    size_t mask;
+};
+
+struct replay_result
+{
+    double seconds;
+    size_t diverged;                /*Calls that failed in one run and not the other*/
+    struct buddy_stats stats;
+    size_t samples;
+    size_t min_largest;             /*Smallest largest_free_order seen*/
+    double frag_sum;                /*Sum of frag_index[frag_order] over the samples*/
+    double frag_max;
+};
+
+static inline uint64_t hash_id(uint64_t id)
+{
+    return (id >> 3) * UINT64_C(0x9E3779B97F4A7C15);
+}
+
+/**
+ * Load the whole trace in call order, the timed pass should only measure the pool.
+ */
+static int load(const char *path, struct trace *t)
+{
+    struct buddy_trace_reader *r = buddy_trace_open(path, &t->header);
+    if (r == NULL) {
+        perror(path);
+        return -1;
+    }
+    t->count = buddy_trace_count(r);
+    t->ev = malloc((t->count + 1) * sizeof(*t->ev));
+    t->at_ns = malloc((t->count + 1) * sizeof(uint64_t));
+    const struct buddy_trace_event *e;
+    for (size_t i = 0; (e = buddy_trace_next(r, &t->at_ns[i])) != NULL; i++)
+        t->ev[i] = *e;
+    buddy_trace_close(r);
+
+    //Calls dropped by the recorder still took a number
+    uint64_t numbered = t->count ? (t->ev[t->count - 1].seq_op >> BUDDY_TRACE_OP_BITS) + 1 : 0;
+    if (numbered != t->count)
+        fprintf(stderr, "replay: %" PRIu64 " calls missing, the trace is incomplete\n", numbered - t->count);
+    return 0;
+}
+
+static void map_init(struct id_map *m, size_t events)
+{
+    size_t cap = 16;
+    while (cap < 2 * events)
+        cap *= 2;
+    m->id = calloc(cap, sizeof(uint64_t));
+    m->ptr = malloc(cap * sizeof(void *));
+    m->mask = cap - 1;
+}
+
+static void map_destroy(struct id_map *m)
+{
+    free(m->id);
+    free(m->ptr);
+}
+
+/**
+ * Every insert can take a fresh slot and the table has twice as many slots
+ * as the trace has calls, so a probe always ends.
+ */
+static void map_put(struct id_map *m, uint64_t id, void *ptr)
+{
+    size_t i = hash_id(id) & m->mask;
+    while (m->id[i] != 0 && m->id[i] != TOMBSTONE && m->id[i] != id)
+        i = (i + 1) & m->mask;
+    m->id[i] = id;
+    m->ptr[i] = ptr;
+}
+
+static void *map_take(struct id_map *m, uint64_t id)
+{
+    for (size_t i = hash_id(id) & m->mask; m->id[i] != 0; i = (i + 1) & m->mask)
+    {
+        if (m->id[i] == id) {
+            m->id[i] = TOMBSTONE;
+            return m->ptr[i];
+        }
+    }
+    return NULL;
+}
+
+static void wait_until(uint64_t target)
+{
+    uint64_t now = now_ns();
+    if (target <= now) return;
+    if (target - now > SPIN_NS) {
+        struct timespec ts = {(time_t)((target - SPIN_NS) / 1000000000u), (long)((target - SPIN_NS) % 1000000000u)};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    while (now_ns() < target)
+        ;
+}
+
+static void sample(struct buddy_pool *pool, size_t frag_order, struct replay_result *r)
+{
+    struct buddy_frag frag;
+    buddy_fragmentation(pool, &frag);
+    double f = frag.frag_index[frag_order];
+    r->frag_sum += f;
+    if (f > r->frag_max) r->frag_max = f;
+    if (frag.largest_free_order < r->min_largest) r->min_largest = frag.largest_free_order;
+    r->samples++;
+}
+
+static void replay(const struct trace *t, size_t pool_bytes, unsigned int flags, bool timing,
+                   size_t frag_order, bool sampling, struct replay_result *r)
+{
+    struct buddy_pool pool;
+    struct id_map map;
+    buddy_init_ex(&pool, pool_bytes, flags);
+    map_init(&map, t->count);
+    memset(r, 0, sizeof(*r));
+    r->min_largest = SIZE_MAX;
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < t->count; i++)
+    {
+        const struct buddy_trace_event *e = &t->ev[i];
+        if (timing) wait_until(start + t->at_ns[i]);
+        void *p = NULL;
+        switch (e->seq_op & ((1u << BUDDY_TRACE_OP_BITS) - 1))
+        {
+        case BUDDY_TRACE_MALLOC:
+            p = buddy_malloc(&pool, e->size);
+            break;
+        case BUDDY_TRACE_FREE:
+            buddy_free(&pool, map_take(&map, e->id));
+            break;
+        case BUDDY_TRACE_REALLOC: {
+            void *old = e->id ? map_take(&map, e->id) : NULL;
+            p = buddy_realloc(&pool, old, e->size);
+            //A failed realloc leaves the block where it was
+            if (p == NULL && old && e->size) map_put(&map, e->id, old);
+            break;
+        }
+        case BUDDY_TRACE_RESET:
+            buddy_reset(&pool);
+            memset(map.id, 0, (map.mask + 1) * sizeof(uint64_t));
+            break;
+        }
+        if ((p != NULL) != (e->result != 0)) r->diverged++;
+        if (p && e->result) map_put(&map, e->result, p);
+        if (sampling && i % SAMPLE_EVERY == 0) sample(&pool, frag_order, r);
+    }
+    r->seconds = (double)(now_ns() - start) / 1e9;
+    if (sampling) sample(&pool, frag_order, r);
+    buddy_stats(&pool, &r->stats);
+
+    map_destroy(&map);
+    buddy_destroy(&pool);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: replay [-t] [-k pool_k] [-f flags] [-o frag_order] trace\n"
+                    "  -t  wait for the original time of every call\n"
+                    "  -k  replay into a pool of 2^pool_k bytes instead of the traced size\n"
+                    "  -f  buddy_init_ex flags instead of the traced ones\n"
+                    "  -o  order the fragmentation index is reported for (default 16)\n");
+}
+
+int main(int argc, char **argv)
+{
+    bool timing = false;
+    size_t pool_k = 0, frag_order = 16;
+    long flags = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "tk:f:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': timing = true; break;
+        case 'k': pool_k = strtoull(optarg, NULL, 0); break;
+        case 'f': flags = strtol(optarg, NULL, 0); break;
+        case 'o': frag_order = strtoull(optarg, NULL, 0); break;
+        default: usage(); return 2;
+        }
+    }
+    if (optind != argc - 1 || frag_order >= MAX_K) {
+        usage();
+        return 2;
+    }
+
+    struct trace t;
+    if (load(argv[optind], &t)) return 1;
+    size_t pool_bytes = pool_k ? UINT64_C(1) << pool_k : t.header.pool_bytes;
+    //A replay runs on one thread and reports its own leaks
+    unsigned int pool_flags = flags >= 0 ? (unsigned int)flags
+                                         : t.header.pool_flags & ~(unsigned int)(BUDDY_LOCKED | BUDDY_LEAK_REPORT);
+
+    size_t threads = 0;
+    for (size_t i = 0; i < t.count; i++)
+        if (t.ev[i].thread >= threads) threads = t.ev[i].thread + 1;
+    double traced = t.count ? (double)t.at_ns[t.count - 1] / 1e9 : 0;
+    printf("replay: %zu calls from %zu threads over %.3fs, pool %zu bytes, flags 0x%x\n",
+           t.count, threads, traced, pool_bytes, pool_flags);
+
+    struct replay_result timed, sampled;
+    replay(&t, pool_bytes, pool_flags, timing, frag_order, false, &timed);
+    replay(&t, pool_bytes, pool_flags, false, frag_order, true, &sampled);
+
+    printf("%-26s %.3fs (%.2f Mcalls/sec)%s\n", "time", timed.seconds,
+           (double)t.count / timed.seconds / 1e6, timing ? " with original timing" : "");
+    printf("%-26s %zu\n", "diverged calls", timed.diverged);
+    printf("%-26s %zu\n", "failed allocations", timed.stats.failed_allocs);
+    printf("%-26s %zu\n", "peak footprint (bytes)", sampled.stats.peak_reserved);
+    printf("%-26s %zu\n", "live at end (bytes)", sampled.stats.bytes_reserved);
+    printf("%-26s %zu\n", "min largest free order", sampled.min_largest);
+    printf("frag index order %-9zu mean %.3f max %.3f over %zu samples\n", frag_order,
+           sampled.frag_sum / (double)sampled.samples, sampled.frag_max, sampled.samples);
+
+    free(t.ev);
+    free(t.at_ns);
+    return 0;
+}
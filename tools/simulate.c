@@ -0,0 +1,828 @@
+/**
+ * @file simulate.c
+ * @brief   What-if simulator for buddy pool configurations. Runs a trace written
+ *          by buddy_trace_start against the allocator metadata only, a bitmap of
+ *          the free blocks of every order, so nothing the trace allocated is
+ *          ever touched and a pool of any size costs a few bits per block.
+ *          Every combination of smallest order, header size, lazy coalescing
+ *          threshold and slab classes given on the command line is simulated in
+ *          one pass over the trace (one pass per worker thread) and compared on
+ *          peak footprint, internal and external fragmentation and failures.
+ *
+ *          The model: a request of n bytes takes the smallest block of at least
+ *          n + header bytes, lowest address first (BUDDY_POLICY_ADDRESS). With a
+ *          lazy threshold of L up to L freed blocks of each order wait on a side
+ *          list for a request of the same order instead of coalescing, the lists
+ *          are coalesced when a request would fail. Requests that fit a slab
+ *          class take an object of that class from a slab, one 2^slab_k block
+ *          carved into equal objects with the metadata kept outside the pool.
+ *          A realloc stays in place while the size keeps its order or class.
+ *          Calls that failed when the trace was recorded are skipped, an object
+ *          that fails in a configuration is left out of it from then on.
+ *
+ *          usage: simulate [-k pool_k] [-m orders] [-H headers] [-l lazy] [-s slabs]
+ *                          [-S slab_k] [-o frag_order] [-j threads] trace
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <sys/errno.h>
+#else
+#include <errno.h>
+#endif
+#include "../src/lab.h"
+#include "../src/trace.h"
+#include "../src/freemap.h"
+#include "../src/clock.h"
+
+#define MAX_CONFIGS 256
+#define MAX_LIST 16
+#define MAX_CLASSES 32
+#define SAMPLE_EVERY 4096           /*Calls between two fragmentation samples*/
+#define NONE UINT64_MAX
+
+struct config
+{
+    size_t min_k;                   /*Smallest block order*/
+    size_t header;                  /*Bytes of header in every block*/
+    size_t lazy;                    /*Freed blocks per order kept off the buddy lists*/
+    size_t classes[MAX_CLASSES];    /*Slab object sizes, ascending*/
+    size_t nclasses;
+    const char *slab_name;
+};
+
+/**
+ * A 2^slab_k block carved into objects of one class.
+ */
+struct slab
+{
+    uint64_t base;                  /*Offset of the block*/
+    uint32_t cls;
+    uint32_t cap;                   /*Objects in the slab*/
+    uint32_t used;                  /*Objects handed out*/
+    uint32_t bump;                  /*Objects never handed out start here*/
+    uint32_t nfree;                 /*Entries in free*/
+    uint32_t *free;                 /*Returned objects*/
+    struct slab *prev, *next;       /*Partial list of the class*/
+    bool partial;
+};
+
+struct sim
+{
+    struct config cfg;
+    size_t pool_k;
+    size_t slab_k;
+    size_t frag_order;
+    uint64_t *bits;                 /*Free blocks, a bitmap tree per order as in the pool freemap*/
+    size_t bits_bytes;
+    size_t bits_off[MAX_K];
+    size_t free_count[MAX_K];
+    uint64_t *lazy[MAX_K];          /*Freed blocks waiting to be reused*/
+    size_t lazy_len[MAX_K];
+    struct slab **slab_at;          /*Slab of every 2^slab_k block, NULL if none*/
+    struct slab *partial[MAX_CLASSES];
+    uint64_t *obj;                  /*Offset of every live object by slot, NONE if it failed*/
+
+    size_t reserved;                /*Bytes in blocks not free, lazy lists and slabs included*/
+    size_t requested;               /*Bytes asked for by the live objects*/
+    size_t peak;                    /*Highest reserved*/
+    size_t requested_at_peak;
+    size_t failures;
+    uint64_t first_failure;         /*Call number of the first failure, NONE if none*/
+    size_t failure_size;            /*Bytes it asked for*/
+    size_t failure_free;            /*Free bytes at that moment*/
+    size_t splits, merges, flushes;
+    size_t samples;
+    size_t min_largest;             /*Smallest largest free order seen*/
+    double frag_sum, frag_max;      /*frag index at frag_order over the samples*/
+};
+
+/**
+ * The live objects of the trace, shared by the simulations of one worker.
+ */
+struct live
+{
+    uint64_t *key;                  /*Trace ID, 0 for an empty slot*/
+    uint64_t *slot;
+    size_t mask;
+    size_t used;
+    size_t *size;                   /*Bytes requested by each slot*/
+    uint64_t *free_slots;
+    size_t nfree;
+    size_t slots;                   /*Slots handed out so far*/
+    size_t cap;
+};
+
+struct worker
+{
+    pthread_t tid;
+    const char *path;
+    struct sim *sims[MAX_CONFIGS];
+    size_t nsims;
+    size_t calls;
+    int error;                      /*errno if the trace could not be read, 0 if none*/
+};
+
+/*
+ * Traces run to billions of calls, running out of memory on the way ends the
+ * run with a message rather than a crash.
+ */
+
+static void out_of_memory(size_t bytes)
+{
+    fprintf(stderr, "simulate: out of memory allocating %zu bytes\n", bytes);
+    exit(1);
+}
+
+static void *xmalloc(size_t bytes)
+{
+    void *p = malloc(bytes);
+    if (p == NULL && bytes) out_of_memory(bytes);
+    return p;
+}
+
+static void *xcalloc(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+    if (p == NULL && n && size) out_of_memory(n * size);
+    return p;
+}
+
+static void *xrealloc(void *old, size_t bytes)
+{
+    void *p = realloc(old, bytes);
+    if (p == NULL && bytes) out_of_memory(bytes);
+    return p;
+}
+
+/*
+ * The free blocks of every order, the same bitmap trees as the pool freemap.
+ */
+
+static inline void bit_set(struct sim *s, size_t k, uint64_t idx)
+{
+    s->free_count[k]++;
+    freemap_tree_set(s->bits + s->bits_off[k], s->pool_k - k, idx);
+}
+
+static inline void bit_clear(struct sim *s, size_t k, uint64_t idx)
+{
+    s->free_count[k]--;
+    freemap_tree_clear(s->bits + s->bits_off[k], s->pool_k - k, idx);
+}
+
+static inline bool bit_test(struct sim *s, size_t k, uint64_t idx)
+{
+    return freemap_tree_test(s->bits + s->bits_off[k], idx);
+}
+
+static inline uint64_t bit_first(struct sim *s, size_t k)
+{
+    return freemap_tree_first(s->bits + s->bits_off[k], s->pool_k - k);
+}
+
+/*
+ * The buddy system proper, offsets are bytes from the start of the pool.
+ */
+
+static uint64_t buddy_take(struct sim *s, size_t k)
+{
+    size_t j = k;
+    while (j <= s->pool_k && s->free_count[j] == 0)
+        j++;
+    if (j > s->pool_k) return NONE;
+    uint64_t idx = bit_first(s, j);
+    bit_clear(s, j, idx);
+    uint64_t off = idx << j;
+    while (j > k)
+    {
+        j--;
+        bit_set(s, j, (off >> j) + 1);
+        s->splits++;
+    }
+    return off;
+}
+
+static void buddy_give(struct sim *s, uint64_t off, size_t k)
+{
+    while (k < s->pool_k)
+    {
+        uint64_t buddy = (off >> k) ^ 1;
+        if (!bit_test(s, k, buddy)) break;
+        bit_clear(s, k, buddy);
+        off &= ~(UINT64_C(1) << k);
+        k++;
+        s->merges++;
+    }
+    bit_set(s, k, off >> k);
+}
+
+static void lazy_flush(struct sim *s)
+{
+    for (size_t k = s->cfg.min_k; k <= s->pool_k; k++)
+    {
+        for (size_t i = 0; i < s->lazy_len[k]; i++)
+        {
+            buddy_give(s, s->lazy[k][i], k);
+            s->reserved -= UINT64_C(1) << k;
+        }
+        s->lazy_len[k] = 0;
+    }
+    s->flushes++;
+}
+
+static uint64_t block_alloc(struct sim *s, size_t k)
+{
+    if (k > s->pool_k) return NONE;
+    if (s->lazy_len[k]) return s->lazy[k][--s->lazy_len[k]];
+    uint64_t off = buddy_take(s, k);
+    if (off == NONE && s->cfg.lazy) {
+        lazy_flush(s);
+        off = buddy_take(s, k);
+    }
+    if (off != NONE) s->reserved += UINT64_C(1) << k;
+    return off;
+}
+
+static void block_free(struct sim *s, uint64_t off, size_t k)
+{
+    if (s->lazy_len[k] < s->cfg.lazy) {
+        s->lazy[k][s->lazy_len[k]++] = off;
+        return;
+    }
+    buddy_give(s, off, k);
+    s->reserved -= UINT64_C(1) << k;
+}
+
+/*
+ * Slabs.
+ */
+
+static inline size_t class_of(struct sim *s, size_t size)
+{
+    for (size_t c = 0; c < s->cfg.nclasses; c++)
+        if (size <= s->cfg.classes[c]) return c;
+    return MAX_CLASSES;
+}
+
+static void partial_remove(struct sim *s, struct slab *sl)
+{
+    if (sl->prev) sl->prev->next = sl->next;
+    else s->partial[sl->cls] = sl->next;
+    if (sl->next) sl->next->prev = sl->prev;
+    sl->partial = false;
+}
+
+static void partial_push(struct sim *s, struct slab *sl)
+{
+    sl->prev = NULL;
+    sl->next = s->partial[sl->cls];
+    if (sl->next) sl->next->prev = sl;
+    s->partial[sl->cls] = sl;
+    sl->partial = true;
+}
+
+static uint64_t slab_alloc(struct sim *s, size_t cls)
+{
+    struct slab *sl = s->partial[cls];
+    if (sl == NULL)
+    {
+        uint64_t base = block_alloc(s, s->slab_k);
+        if (base == NONE) return NONE;
+        sl = xcalloc(1, sizeof(*sl));
+        sl->base = base;
+        sl->cls = (uint32_t)cls;
+        sl->cap = (uint32_t)((UINT64_C(1) << s->slab_k) / s->cfg.classes[cls]);
+        sl->free = xmalloc(sl->cap * sizeof(uint32_t));
+        s->slab_at[base >> s->slab_k] = sl;
+        partial_push(s, sl);
+    }
+    uint32_t i = sl->nfree ? sl->free[--sl->nfree] : sl->bump++;
+    if (++sl->used == sl->cap) partial_remove(s, sl);
+    return sl->base + (uint64_t)i * s->cfg.classes[cls];
+}
+
+static void slab_free(struct sim *s, uint64_t off)
+{
+    struct slab *sl = s->slab_at[off >> s->slab_k];
+    sl->free[sl->nfree++] = (uint32_t)((off - sl->base) / s->cfg.classes[sl->cls]);
+    sl->used--;
+    if (sl->used == 0)
+    {
+        if (sl->partial) partial_remove(s, sl);
+        s->slab_at[sl->base >> s->slab_k] = NULL;
+        block_free(s, sl->base, s->slab_k);
+        free(sl->free);
+        free(sl);
+    }
+    else if (!sl->partial)
+    {
+        partial_push(s, sl);
+    }
+}
+
+/*
+ * Objects.
+ */
+
+static inline size_t order_of(struct sim *s, size_t size)
+{
+    size_t k = btok(size + s->cfg.header);
+    return k < s->cfg.min_k ? s->cfg.min_k : k;
+}
+
+static size_t largest_free(struct sim *s)
+{
+    for (size_t k = s->pool_k + 1; k-- > s->cfg.min_k;)
+        if (s->free_count[k]) return k;
+    return 0;
+}
+
+static uint64_t obj_alloc(struct sim *s, size_t size, uint64_t call)
+{
+    size_t cls = class_of(s, size);
+    uint64_t off = cls < MAX_CLASSES ? slab_alloc(s, cls) : block_alloc(s, order_of(s, size));
+    if (off == NONE)
+    {
+        if (s->failures++ == 0) {
+            s->first_failure = call;
+            s->failure_size = size;
+            s->failure_free = (UINT64_C(1) << s->pool_k) - s->reserved;
+        }
+        return NONE;
+    }
+    s->requested += size;
+    if (s->reserved > s->peak) {
+        s->peak = s->reserved;
+        s->requested_at_peak = s->requested;
+    }
+    return off;
+}
+
+static void obj_free(struct sim *s, uint64_t off, size_t size)
+{
+    if (off == NONE) return;
+    s->requested -= size;
+    if (class_of(s, size) < MAX_CLASSES) slab_free(s, off);
+    else block_free(s, off, order_of(s, size));
+}
+
+static uint64_t obj_realloc(struct sim *s, uint64_t off, size_t old, size_t size, uint64_t call)
+{
+    if (off == NONE) return obj_alloc(s, size, call);
+    size_t cls = class_of(s, old);
+    bool same = cls < MAX_CLASSES ? class_of(s, size) == cls
+                                  : class_of(s, size) == MAX_CLASSES && order_of(s, size) == order_of(s, old);
+    if (same) {
+        s->requested += size - old;
+        return off;
+    }
+    uint64_t moved = obj_alloc(s, size, call);
+    obj_free(s, off, old);
+    return moved;
+}
+
+static void sample(struct sim *s)
+{
+    size_t free_bytes = 0, small = 0;
+    for (size_t k = s->cfg.min_k; k <= s->pool_k; k++)
+    {
+        size_t bytes = s->free_count[k] << k;
+        free_bytes += bytes;
+        if (k < s->frag_order) small += bytes;
+    }
+    double f = free_bytes ? (double)small / (double)free_bytes : 0;
+    s->frag_sum += f;
+    if (f > s->frag_max) s->frag_max = f;
+    size_t largest = largest_free(s);
+    if (largest < s->min_largest) s->min_largest = largest;
+    s->samples++;
+}
+
+static void sim_format(struct sim *s)
+{
+    //Untouched pages of the map read as zero, only the parts in use cost memory
+    madvise(s->bits, s->bits_bytes, MADV_DONTNEED);
+    memset(s->free_count, 0, sizeof(s->free_count));
+    memset(s->lazy_len, 0, sizeof(s->lazy_len));
+    size_t slabs = s->pool_k >= s->slab_k ? UINT64_C(1) << (s->pool_k - s->slab_k) : 0;
+    for (size_t i = 0; i < slabs; i++)
+    {
+        if (s->slab_at[i] == NULL) continue;
+        free(s->slab_at[i]->free);
+        free(s->slab_at[i]);
+        s->slab_at[i] = NULL;
+    }
+    memset(s->partial, 0, sizeof(s->partial));
+    s->reserved = 0;
+    s->requested = 0;
+    bit_set(s, s->pool_k, 0);
+}
+
+static struct sim *sim_create(const struct config *cfg, size_t pool_k, size_t slab_k, size_t frag_order)
+{
+    struct sim *s = xcalloc(1, sizeof(*s));
+    s->cfg = *cfg;
+    s->pool_k = pool_k;
+    s->slab_k = slab_k;
+    s->frag_order = frag_order;
+    s->first_failure = NONE;
+    s->min_largest = SIZE_MAX;
+
+    size_t words = 0;
+    for (size_t k = cfg->min_k; k <= pool_k; k++)
+    {
+        s->bits_off[k] = words;
+        for (size_t l = 0; l < freemap_levels(pool_k - k); l++)
+            words += freemap_words(pool_k - k, l);
+        if (cfg->lazy) s->lazy[k] = xmalloc(cfg->lazy * sizeof(uint64_t));
+    }
+    s->bits_bytes = words * sizeof(uint64_t);
+    s->bits = mmap(NULL, s->bits_bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (s->bits == MAP_FAILED) {
+        perror("simulate: bitmap");
+        exit(1);
+    }
+    size_t slabs = pool_k >= slab_k ? UINT64_C(1) << (pool_k - slab_k) : 1;
+    s->slab_at = xcalloc(slabs, sizeof(struct slab *));
+    sim_format(s);
+    return s;
+}
+
+static void sim_destroy(struct sim *s)
+{
+    sim_format(s);
+    munmap(s->bits, s->bits_bytes);
+    for (size_t k = 0; k < MAX_K; k++)
+        free(s->lazy[k]);
+    free(s->slab_at);
+    free(s->obj);
+    free(s);
+}
+
+/*
+ * Live objects, an open addressing table from trace ID to slot.
+ */
+
+static inline uint64_t hash_id(uint64_t id)
+{
+    return (id >> 3) * UINT64_C(0x9E3779B97F4A7C15);
+}
+
+static void live_grow_table(struct live *l)
+{
+    size_t old_cap = l->key ? l->mask + 1 : 0;
+    uint64_t *key = l->key, *slot = l->slot;
+    size_t cap = old_cap ? 2 * old_cap : 1024;
+    l->key = xcalloc(cap, sizeof(uint64_t));
+    l->slot = xmalloc(cap * sizeof(uint64_t));
+    l->mask = cap - 1;
+    for (size_t i = 0; i < old_cap; i++)
+    {
+        if (key[i] == 0) continue;
+        size_t j = hash_id(key[i]) & l->mask;
+        while (l->key[j])
+            j = (j + 1) & l->mask;
+        l->key[j] = key[i];
+        l->slot[j] = slot[i];
+    }
+    free(key);
+    free(slot);
+}
+
+static void live_put(struct live *l, uint64_t id, uint64_t slot)
+{
+    if (l->key == NULL || 2 * (l->used + 1) > l->mask + 1) live_grow_table(l);
+    size_t i = hash_id(id) & l->mask;
+    while (l->key[i] && l->key[i] != id)
+        i = (i + 1) & l->mask;
+    if (l->key[i] == 0) l->used++;
+    l->key[i] = id;
+    l->slot[i] = slot;
+}
+
+/**
+ * Remove an ID, shifting later entries of the same probe run back so
+ * lookups never stop early.
+ *
+ * @return Its slot or NONE if the ID is not live
+ */
+static uint64_t live_take(struct live *l, uint64_t id)
+{
+    if (l->key == NULL) return NONE;
+    size_t i = hash_id(id) & l->mask;
+    while (l->key[i] != id)
+    {
+        if (l->key[i] == 0) return NONE;
+        i = (i + 1) & l->mask;
+    }
+    uint64_t slot = l->slot[i];
+    l->used--;
+    for (size_t j = i;;)
+    {
+        l->key[i] = 0;
+        for (;;)
+        {
+            j = (j + 1) & l->mask;
+            if (l->key[j] == 0) return slot;
+            size_t home = hash_id(l->key[j]) & l->mask;
+            bool reachable = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (!reachable) break;
+        }
+        l->key[i] = l->key[j];
+        l->slot[i] = l->slot[j];
+        i = j;
+    }
+}
+
+static uint64_t slot_new(struct live *l, struct worker *w)
+{
+    if (l->nfree) return l->free_slots[--l->nfree];
+    if (l->slots == l->cap)
+    {
+        l->cap = l->cap ? 2 * l->cap : 1024;
+        l->size = xrealloc(l->size, l->cap * sizeof(size_t));
+        l->free_slots = xrealloc(l->free_slots, l->cap * sizeof(uint64_t));
+        for (size_t i = 0; i < w->nsims; i++)
+            w->sims[i]->obj = xrealloc(w->sims[i]->obj, l->cap * sizeof(uint64_t));
+    }
+    return l->slots++;
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *w = arg;
+    struct buddy_trace_reader *r = buddy_trace_open(w->path, NULL);
+    if (r == NULL) {
+        w->error = errno;
+        fprintf(stderr, "simulate: %s: %s\n", w->path, strerror(errno));
+        return NULL;
+    }
+    struct live l = {0};
+    const struct buddy_trace_event *e;
+    uint64_t call = 0;
+    for (; (e = buddy_trace_next(r, NULL)) != NULL; call++)
+    {
+        unsigned int op = e->seq_op & ((1u << BUDDY_TRACE_OP_BITS) - 1);
+        if (op == BUDDY_TRACE_REALLOC && e->id == 0) op = BUDDY_TRACE_MALLOC;
+        if (op == BUDDY_TRACE_REALLOC && e->size == 0) op = BUDDY_TRACE_FREE;
+
+        if (op == BUDDY_TRACE_MALLOC && e->result)
+        {
+            uint64_t slot = slot_new(&l, w);
+            l.size[slot] = e->size;
+            for (size_t i = 0; i < w->nsims; i++)
+                w->sims[i]->obj[slot] = obj_alloc(w->sims[i], e->size, call);
+            live_put(&l, e->result, slot);
+        }
+        else if (op == BUDDY_TRACE_FREE)
+        {
+            uint64_t slot = live_take(&l, e->id);
+            if (slot == NONE) continue;
+            for (size_t i = 0; i < w->nsims; i++)
+                obj_free(w->sims[i], w->sims[i]->obj[slot], l.size[slot]);
+            l.free_slots[l.nfree++] = slot;
+        }
+        else if (op == BUDDY_TRACE_REALLOC && e->result)
+        {
+            uint64_t slot = live_take(&l, e->id);
+            if (slot == NONE) {
+                slot = slot_new(&l, w);
+                for (size_t i = 0; i < w->nsims; i++)
+                    w->sims[i]->obj[slot] = obj_alloc(w->sims[i], e->size, call);
+            } else {
+                for (size_t i = 0; i < w->nsims; i++)
+                    w->sims[i]->obj[slot] = obj_realloc(w->sims[i], w->sims[i]->obj[slot],
+                                                        l.size[slot], e->size, call);
+            }
+            l.size[slot] = e->size;
+            live_put(&l, e->result, slot);
+        }
+        else if (op == BUDDY_TRACE_RESET)
+        {
+            for (size_t i = 0; i < w->nsims; i++)
+                sim_format(w->sims[i]);
+            if (l.key) memset(l.key, 0, (l.mask + 1) * sizeof(uint64_t));
+            l.used = 0;
+            l.slots = 0;
+            l.nfree = 0;
+        }
+
+        if (call % SAMPLE_EVERY == 0)
+            for (size_t i = 0; i < w->nsims; i++)
+                sample(w->sims[i]);
+    }
+    for (size_t i = 0; i < w->nsims; i++)
+        sample(w->sims[i]);
+    w->calls = call;
+    free(l.key);
+    free(l.slot);
+    free(l.size);
+    free(l.free_slots);
+    buddy_trace_close(r);
+    return NULL;
+}
+
+/**
+ * @brief Parse a comma separated list of numbers.
+ *
+ * @return The number of entries
+ */
+static size_t parse_list(const char *arg, size_t *out, size_t max)
+{
+    size_t n = 0;
+    char *end;
+    while (n < max && *arg)
+    {
+        out[n++] = strtoull(arg, &end, 0);
+        if (*end != ',') break;
+        arg = end + 1;
+    }
+    return n;
+}
+
+/**
+ * @brief Parse slab sets: "none" or sizes separated by ':', sets separated by ','.
+ */
+static size_t parse_slabs(char *arg, struct config *out, size_t max)
+{
+    size_t n = 0;
+    for (char *set = strtok(arg, ","); set && n < max; set = strtok(NULL, ","))
+    {
+        struct config *c = &out[n++];
+        c->slab_name = set;
+        c->nclasses = 0;
+        if (!strcmp(set, "none")) continue;
+        for (const char *p = set; *p && c->nclasses < MAX_CLASSES;)
+        {
+            char *end;
+            c->classes[c->nclasses++] = strtoull(p, &end, 0);
+            p = *end == ':' ? end + 1 : end + strlen(end);
+        }
+    }
+    return n;
+}
+
+static bool slabs_fit(const struct config *cfg, size_t slab_k, size_t pool_k)
+{
+    if (slab_k < cfg->min_k || slab_k > pool_k) return false;
+    for (size_t c = 0; c < cfg->nclasses; c++)
+        if (cfg->classes[c] == 0 || cfg->classes[c] > (UINT64_C(1) << slab_k)) return false;
+    return true;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: simulate [-k pool_k] [-m orders] [-H headers] [-l lazy] [-s slabs]\n"
+            "                [-S slab_k] [-o frag_order] [-j threads] trace\n"
+            "  -k  pool order, default the traced pool\n"
+            "  -m  smallest block orders to try, default 5,6,7\n"
+            "  -H  header bytes to try, default 8,24\n"
+            "  -l  lazy coalescing thresholds to try, default 0,16\n"
+            "  -s  slab class sets to try, default none,16:32:48:64:96:128:192:256\n"
+            "  -S  slab order, default 16\n"
+            "  -o  order the external fragmentation is reported for, default 16\n"
+            "  -j  worker threads, default one per CPU\n");
+}
+
+int main(int argc, char **argv)
+{
+    size_t orders[MAX_LIST] = {5, 6, 7}, norders = 3;
+    size_t headers[MAX_LIST] = {8, 24}, nheaders = 2;
+    size_t lazies[MAX_LIST] = {0, 16}, nlazies = 2;
+    char default_slabs[] = "none,16:32:48:64:96:128:192:256";
+    char *slab_arg = default_slabs;
+    size_t pool_k = 0, slab_k = 16, frag_order = 16;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus > 0 ? (size_t)cpus : 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "k:m:H:l:s:S:o:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'k': pool_k = strtoull(optarg, NULL, 0); break;
+        case 'm': norders = parse_list(optarg, orders, MAX_LIST); break;
+        case 'H': nheaders = parse_list(optarg, headers, MAX_LIST); break;
+        case 'l': nlazies = parse_list(optarg, lazies, MAX_LIST); break;
+        case 's': slab_arg = optarg; break;
+        case 'S': slab_k = strtoull(optarg, NULL, 0); break;
+        case 'o': frag_order = strtoull(optarg, NULL, 0); break;
+        case 'j': nthreads = strtoull(optarg, NULL, 0); break;
+        default: usage(); return 2;
+        }
+    }
+    if (optind != argc - 1 || frag_order >= MAX_K || nthreads == 0) {
+        usage();
+        return 2;
+    }
+    const char *path = argv[optind];
+
+    struct buddy_trace_header h;
+    struct buddy_trace_reader *r = buddy_trace_open(path, &h);
+    if (r == NULL) {
+        perror(path);
+        return 1;
+    }
+    size_t calls = buddy_trace_count(r);
+    buddy_trace_close(r);
+    if (pool_k == 0) pool_k = btok(h.pool_bytes);
+    if (pool_k >= MAX_K) {
+        fprintf(stderr, "simulate: pool order %zu is too large\n", pool_k);
+        return 2;
+    }
+
+    struct config slabs[MAX_LIST];
+    size_t nslabs = parse_slabs(slab_arg, slabs, MAX_LIST);
+    static struct sim *sims[MAX_CONFIGS];
+    size_t nsims = 0;
+    for (size_t a = 0; a < norders; a++)
+        for (size_t b = 0; b < nheaders; b++)
+            for (size_t c = 0; c < nlazies; c++)
+                for (size_t d = 0; d < nslabs && nsims < MAX_CONFIGS; d++)
+                {
+                    struct config cfg = slabs[d];
+                    cfg.min_k = orders[a];
+                    cfg.header = headers[b];
+                    cfg.lazy = lazies[c];
+                    //A block must have room for its header and then some
+                    if (cfg.min_k < 2 || (UINT64_C(1) << cfg.min_k) <= cfg.header || cfg.min_k > pool_k) {
+                        fprintf(stderr, "simulate: skipping min order %zu with a %zu byte header\n",
+                                cfg.min_k, cfg.header);
+                        continue;
+                    }
+                    if (cfg.nclasses && !slabs_fit(&cfg, slab_k, pool_k)) {
+                        fprintf(stderr, "simulate: skipping slabs %s, they need classes of 1 to 2^%zu "
+                                "bytes and a slab order from %zu to %zu\n", cfg.slab_name, slab_k,
+                                cfg.min_k, pool_k);
+                        continue;
+                    }
+                    sims[nsims++] = sim_create(&cfg, pool_k, slab_k, frag_order);
+                }
+
+    if (nthreads > nsims) nthreads = nsims ? nsims : 1;
+    struct worker *workers = xcalloc(nthreads, sizeof(*workers));
+    for (size_t i = 0; i < nsims; i++)
+    {
+        struct worker *w = &workers[i % nthreads];
+        w->sims[w->nsims++] = sims[i];
+    }
+    uint64_t start = now_ns();
+    for (size_t t = 0; t < nthreads; t++)
+    {
+        workers[t].path = path;
+        int err = pthread_create(&workers[t].tid, NULL, run_worker, &workers[t]);
+        if (err) {
+            fprintf(stderr, "simulate: starting a worker: %s\n", strerror(err));
+            return 1;
+        }
+    }
+    int failed = 0;
+    for (size_t t = 0; t < nthreads; t++)
+    {
+        pthread_join(workers[t].tid, NULL);
+        if (workers[t].error) failed = 1;
+    }
+    //A worker that could not read the trace leaves its configurations empty
+    if (failed) return 1;
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    printf("simulate: %zu calls, pool order %zu, %zu configurations on %zu threads in %.2fs "
+           "(%.1f M simulated calls/sec)\n\n", calls, pool_k, nsims, nthreads, seconds,
+           (double)calls * (double)nsims / seconds / 1e6);
+    printf("%5s %6s %4s %-28s %12s %8s %9s %9s %7s %8s %12s\n", "min_k", "header", "lazy", "slabs",
+           "peak_bytes", "internal", "ext_mean", "ext_max", "largest", "failures", "first_fail");
+    for (size_t i = 0; i < nsims; i++)
+    {
+        struct sim *s = sims[i];
+        double internal = s->peak ? 1.0 - (double)s->requested_at_peak / (double)s->peak : 0;
+        printf("%5zu %6zu %4zu %-28s %12zu %7.1f%% %8.1f%% %8.1f%% %7zu %8zu ",
+               s->cfg.min_k, s->cfg.header, s->cfg.lazy, s->cfg.slab_name, s->peak, internal * 100,
+               s->samples ? s->frag_sum / (double)s->samples * 100 : 0, s->frag_max * 100,
+               s->min_largest, s->failures);
+        if (s->first_failure == NONE) printf("%12s\n", "-");
+        else printf("%12" PRIu64 "\n", s->first_failure);
+    }
+    printf("\ninternal: share of the peak footprint not asked for, ext: share of the free bytes "
+           "in blocks below order %zu,\nlargest: smallest largest free order seen, first_fail: "
+           "call number of the first failure\n", frag_order);
+    for (size_t i = 0; i < nsims; i++)
+    {
+        struct sim *s = sims[i];
+        if (s->first_failure != NONE)
+            printf("min_k %zu header %zu lazy %zu slabs %s: first failure asked for %zu bytes with %zu free\n",
+                   s->cfg.min_k, s->cfg.header, s->cfg.lazy, s->cfg.slab_name, s->failure_size, s->failure_free);
+        sim_destroy(s);
+    }
+    free(workers);
+    return 0;
+}